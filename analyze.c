@@ -0,0 +1,456 @@
+#include <string.h>
+#include "us.h"
+#include "arena.h"
+#include "cell.h"
+#include "env.h"
+#include "gc.h"
+#include "intern.h"
+#include "eval.h"
+#include "native.h"
+#include "analyze.h"
+
+#if !defined(MEM_DEBUG)
+#define MEM_DEBUG 0
+#endif
+#include "mem.h"
+
+// #define LOG_LEVEL LOG_LEVEL_DEBUG
+#include "log.h"
+#if defined(LOG_LEVEL) && LOG_LEVEL <= LOG_LEVEL_DEBUG
+static char dumper[10*1024];
+#endif
+
+// How many values (procedure plus args) a call can keep on the C stack; calls
+// with more than this get them from the heap
+#define EXEC_MAX_STACK_ARGS 8
+
+// Everything we need while analyzing a lambda body.  We go over the body
+// twice: first we only count the executors and args, then we create them all
+// in a single block.
+typedef struct Builder {
+    ExecBlock* block;       // null while counting
+    Exec* execs;            // all executors in the block
+    const Exec** args;      // all arrays of args in the block
+    int count;              // how many executors there are so far
+    int argc;               // how many args there are so far
+    Exec scratch;           // where executors go while counting
+} Builder;
+
+static Cell* lambda_exec(US* us, Cell* lambda);
+static Cell* proc_exec(US* us, Cell* proc);
+static Cell* analyze(US* us, Cell* lambda);
+static const Exec* build(Builder* b, Cell* cell);
+static const Exec* build_call(Builder* b, Cell* cell);
+static Exec* new_exec(Builder* b, ExecFunc* func);
+static const Exec** new_args(Builder* b, int count);
+static int gather_args(Cell* cell, int wanted, Cell* args[]);
+static Cell* run(US* us, const Exec* exec, Env* env);
+static Cell* run_tail(US* us, ExecTail* tail);
+static Env* frame_at(Env* env, int depth);
+
+static Cell* exec_const(US* us, const Exec* exec, Env* env, ExecTail* tail);
+static Cell* exec_local0(US* us, const Exec* exec, Env* env, ExecTail* tail);
+static Cell* exec_local(US* us, const Exec* exec, Env* env, ExecTail* tail);
+static Cell* exec_global(US* us, const Exec* exec, Env* env, ExecTail* tail);
+static Cell* exec_set_local(US* us, const Exec* exec, Env* env, ExecTail* tail);
+static Cell* exec_set_global(US* us, const Exec* exec, Env* env, ExecTail* tail);
+static Cell* exec_define_global(US* us, const Exec* exec, Env* env, ExecTail* tail);
+static Cell* exec_if(US* us, const Exec* exec, Env* env, ExecTail* tail);
+static Cell* exec_lambda(US* us, const Exec* exec, Env* env, ExecTail* tail);
+static Cell* exec_call(US* us, const Exec* exec, Env* env, ExecTail* tail);
+static Cell* exec_eval(US* us, const Exec* exec, Env* env, ExecTail* tail);
+
+Cell* exec_create_procedure(US* us, Cell* lambda, Env* env)
+{
+    // lambda and env must survive analyzing the lambda body
+    gc_push_cell(us->gc, &lambda);
+    gc_push_env(us->gc, &env);
+    Cell* exec = lambda_exec(us, lambda);
+    gc_pop(us->gc, 2);
+    Cell* proc = cell_create_procedure(us, lambda, env);
+    proc->pval.exec = exec;
+    gc_write_cell(us, proc, exec);
+    return proc;
+}
+
+Cell* exec_run(US* us, Cell* proc, Env* frame)
+{
+    // from now on, nobody else might be holding on to the frame and the
+    // executors we run, so they must be roots for the GC
+    ExecTail tail;
+    tail.env = frame;
+    gc_push_env(us->gc, &tail.env);
+    tail.owner = proc_exec(us, proc);
+    tail.exec = tail.owner->exec->entry;
+    gc_push_cell(us->gc, &tail.owner);
+    Cell* ret = 0;
+    while (!ret) {
+        ret = tail.exec->func(us, tail.exec, tail.env, &tail);
+    }
+    gc_pop(us->gc, 2);
+    return ret;
+}
+
+// Get the executors for a lambda body, analyzing it only the first time
+static Cell* lambda_exec(US* us, Cell* lambda)
+{
+    if (!lambda->lval.exec) {
+        Cell* exec = analyze(us, lambda);
+        lambda->lval.exec = exec;
+        gc_write_cell(us, lambda, exec);
+    }
+    return lambda->lval.exec;
+}
+
+// Get the executors for a procedure body; procedures created by the VM do not
+// have them until they are first called here
+static Cell* proc_exec(US* us, Cell* proc)
+{
+    if (!proc->pval.exec) {
+        Cell* exec = lambda_exec(us, proc->pval.lambda);
+        proc->pval.exec = exec;
+        gc_write_cell(us, proc, exec);
+    }
+    return proc->pval.exec;
+}
+
+// Analyze the body of a lambda, which must be reachable by the GC
+static Cell* analyze(US* us, Cell* lambda)
+{
+    Builder b;
+    memset(&b, 0, sizeof(Builder));
+    Cell* body = lambda->lval.body;
+    build(&b, body);
+
+    int bytes = sizeof(ExecBlock) + b.count * sizeof(Exec) + b.argc * sizeof(Exec*);
+    char* block = 0;
+    MEM_ALLOC_SIZE(block, bytes);
+    b.block = (ExecBlock*) block;
+    b.execs = (Exec*) (block + sizeof(ExecBlock));
+    b.args = (const Exec**) (b.execs + b.count);
+    b.block->bytes = bytes;
+    b.block->count = b.count;
+    b.block->lambda = lambda;
+    b.count = 0;
+    b.argc = 0;
+    b.block->entry = build(&b, body);
+    LOG(DEBUG, ("ANALYZE: %d executors, %d args, %d bytes for %s", b.count, b.argc, bytes, cell_dump(body, 1, dumper)));
+
+    // the lambda keeps alive every cell the executors refer to
+    return cell_create_exec(us, b.block);
+}
+
+static const Exec* build(Builder* b, Cell* cell)
+{
+    Exec* exec = 0;
+    switch (CELL_TAG(cell)) {
+        case CELL_LOCAL:
+            exec = new_exec(b, cell->loc.depth ? exec_local : exec_local0);
+            exec->local.depth = cell->loc.depth;
+            exec->local.slot = cell->loc.slot;
+            return exec;
+
+        case CELL_GLOBAL:
+            exec = new_exec(b, exec_global);
+            exec->sym = cell->gsym;
+            return exec;
+
+        case CELL_LAMBDA:
+            exec = new_exec(b, exec_lambda);
+            exec->value = cell;
+            return exec;
+
+        case CELL_SYMBOL:
+            // a symbol that was not resolved => let cell_eval look it up
+            exec = new_exec(b, exec_eval);
+            exec->value = cell;
+            return exec;
+
+        case CELL_CONS:
+            break;
+
+        default:
+            // anything not a cons => self-evaluating
+            exec = new_exec(b, exec_const);
+            exec->value = cell;
+            return exec;
+    }
+
+    // we know for sure we have a cons cell; is it a special form?
+    Cell* car = cell->cons.car;
+    if (car == sym_quote) {
+        Cell* args[2];
+        exec = new_exec(b, exec_const);
+        exec->value = gather_args(cell, 2, args) ? args[1] : nil;
+        return exec;
+    }
+
+    if (car == sym_define || car == sym_set) {
+        Cell* args[3];
+        if (!gather_args(cell, 3, args)) {
+            exec = new_exec(b, exec_const);
+            exec->value = nil;
+        } else if (CELL_TAG(args[1]) == CELL_LOCAL) {
+            exec = new_exec(b, exec_set_local);
+            exec->set.depth = args[1]->loc.depth;
+            exec->set.slot = args[1]->loc.slot;
+            exec->set.value = build(b, args[2]);
+        } else if (CELL_TAG(args[1]) == CELL_GLOBAL) {
+            exec = new_exec(b, car == sym_define ? exec_define_global : exec_set_global);
+            exec->set.sym = args[1]->gsym;
+            exec->set.value = build(b, args[2]);
+        } else {
+            // a target that was not resolved => let cell_eval deal with it
+            exec = new_exec(b, exec_eval);
+            exec->value = cell;
+        }
+        return exec;
+    }
+
+    if (car == sym_if) {
+        Cell* args[4];
+        exec = new_exec(b, gather_args(cell, 4, args) ? exec_if : exec_const);
+        if (exec->func == exec_const) {
+            exec->value = nil;
+            return exec;
+        }
+        exec->branch.test = build(b, args[1]);
+        exec->branch.then = build(b, args[2]);
+        exec->branch.other = build(b, args[3]);
+        return exec;
+    }
+
+    if (car == sym_lambda) {
+        // a lambda that was not resolved => let cell_eval resolve it
+        exec = new_exec(b, exec_eval);
+        exec->value = cell;
+        return exec;
+    }
+
+    return build_call(b, cell);
+}
+
+static const Exec* build_call(Builder* b, Cell* cell)
+{
+    int argc = 0;
+    for (Cell* c = cell; c && CELL_TAG(c) == CELL_CONS; c = c->cons.cdr) {
+        ++argc;
+    }
+
+    Exec* exec = new_exec(b, exec_call);
+    const Exec** args = new_args(b, argc);
+    int pos = 0;
+    for (Cell* c = cell; c && CELL_TAG(c) == CELL_CONS; c = c->cons.cdr, ++pos) {
+        const Exec* arg = build(b, c->cons.car);
+        if (args) {
+            args[pos] = arg;
+        }
+    }
+    exec->call.args = args;
+    exec->call.argc = argc;
+    return exec;
+}
+
+// Get room for a new executor; when counting, it is just scratch space
+static Exec* new_exec(Builder* b, ExecFunc* func)
+{
+    Exec* exec = b->block ? &b->execs[b->count] : &b->scratch;
+    ++b->count;
+    exec->func = func;
+    return exec;
+}
+
+// Get room for an array of args; when counting, there is none
+static const Exec** new_args(Builder* b, int count)
+{
+    const Exec** args = b->block ? &b->args[b->argc] : 0;
+    b->argc += count;
+    return args;
+}
+
+static int gather_args(Cell* cell, int wanted, Cell* args[])
+{
+    int pos = 0;
+    for (Cell* c = cell; c && c != nil && pos < wanted; c = c->cons.cdr) {
+        args[pos] = (Cell*) c->cons.car;
+        if (!args[pos]) {
+            return 0;
+        }
+        ++pos;
+    }
+    return pos == wanted;
+}
+
+// Run an executor to get its value, which is not in tail position
+static Cell* run(US* us, const Exec* exec, Env* env)
+{
+    ExecTail tail;
+    tail.owner = 0;
+    Cell* ret = exec->func(us, exec, env, &tail);
+    return ret ? ret : run_tail(us, &tail);
+}
+
+// Go on running executors in tail position until one returns a value; only
+// now might nobody else be holding on to their env and owner, so they must be
+// roots for the GC
+static Cell* run_tail(US* us, ExecTail* tail)
+{
+    Cell* ret = 0;
+    gc_push_env(us->gc, &tail->env);
+    gc_push_cell(us->gc, &tail->owner);
+    while (!ret) {
+        ret = tail->exec->func(us, tail->exec, tail->env, tail);
+    }
+    gc_pop(us->gc, 2);
+    return ret;
+}
+
+// Get the frame a given number of levels up from env
+static Env* frame_at(Env* env, int depth)
+{
+    for (; depth > 0; --depth) {
+        env = env->parent;
+    }
+    return env;
+}
+
+static Cell* exec_const(US* us, const Exec* exec, Env* env, ExecTail* tail)
+{
+    (void) us;
+    (void) env;
+    (void) tail;
+    return exec->value;
+}
+
+static Cell* exec_local0(US* us, const Exec* exec, Env* env, ExecTail* tail)
+{
+    (void) us;
+    (void) tail;
+    Cell* ret = env->slots[exec->local.slot];
+    return ret ? ret : nil;
+}
+
+static Cell* exec_local(US* us, const Exec* exec, Env* env, ExecTail* tail)
+{
+    (void) us;
+    (void) tail;
+    Cell* ret = frame_at(env, exec->local.depth)->slots[exec->local.slot];
+    return ret ? ret : nil;
+}
+
+static Cell* exec_global(US* us, const Exec* exec, Env* env, ExecTail* tail)
+{
+    (void) us;
+    (void) env;
+    (void) tail;
+    Cell* ret = exec->sym->value;
+    return ret ? ret : nil;
+}
+
+static Cell* exec_set_local(US* us, const Exec* exec, Env* env, ExecTail* tail)
+{
+    (void) tail;
+    Cell* ret = run(us, exec->set.value, env);
+    Env* frame = frame_at(env, exec->set.depth);
+    frame->slots[exec->set.slot] = ret;
+    gc_write_env(us, frame, ret);
+    return ret;
+}
+
+static Cell* exec_set_global(US* us, const Exec* exec, Env* env, ExecTail* tail)
+{
+    (void) tail;
+    Symbol* sym = exec->set.sym;
+    if (!sym->value) {
+        LOG(ERROR, ("EXEC: symbol [%s] not found", sym->name));
+        return nil;
+    }
+    Cell* ret = run(us, exec->set.value, env);
+    sym->value = ret;
+    gc_write_env(us, us->env, ret);
+    return ret;
+}
+
+static Cell* exec_define_global(US* us, const Exec* exec, Env* env, ExecTail* tail)
+{
+    (void) tail;
+    Cell* ret = run(us, exec->set.value, env);
+    exec->set.sym->value = ret;
+    gc_write_env(us, us->env, ret);
+    return ret;
+}
+
+// Pick a branch, which is in tail position
+static Cell* exec_if(US* us, const Exec* exec, Env* env, ExecTail* tail)
+{
+    Cell* test = run(us, exec->branch.test, env);
+    tail->exec = test == bool_t ? exec->branch.then : exec->branch.other;
+    tail->env = env;
+    return 0;
+}
+
+static Cell* exec_lambda(US* us, const Exec* exec, Env* env, ExecTail* tail)
+{
+    (void) tail;
+    return exec_create_procedure(us, exec->value, env);
+}
+
+// Call a native function right away; for a procedure, create its frame, and
+// go on with its body, which is in tail position
+static Cell* exec_call(US* us, const Exec* exec, Env* env, ExecTail* tail)
+{
+    Cell* stack[EXEC_MAX_STACK_ARGS];
+    Cell** argv = stack;
+    int argc = exec->call.argc;
+    if (argc > EXEC_MAX_STACK_ARGS) {
+        MEM_ALLOC_TYPE(argv, argc, Cell*);
+    }
+
+    // we eval the procedure and each arg in the caller's environment; the ones
+    // we already have must survive evaluating the others
+    int count = 0;
+    gc_push_cells(us->gc, &argv, &count);
+    while (count < argc) {
+        argv[count] = run(us, exec->call.args[count], env);
+        ++count;
+    }
+
+    Cell* ret = nil;
+    Cell* proc = argv[0];
+    switch (CELL_TAG(proc)) {
+        case CELL_NATIVE:
+            ret = native_apply(us, proc, argc - 1, argv + 1);
+            break;
+
+        case CELL_PROC: {
+            // a new frame, with the args bound to the slots for the params,
+            // and chained to the env captured when the lambda was created
+            Cell* owner = proc_exec(us, proc);
+            const Lambda* lambda = &proc->pval.lambda->lval;
+            Env* frame = arena_get_frame(us->arena, lambda->names, lambda->size);
+            int bound = argc - 1 < lambda->arity ? argc - 1 : lambda->arity;
+            for (int j = 0; j < bound; ++j) {
+                frame->slots[j] = argv[j + 1];
+                gc_write_env(us, frame, argv[j + 1]);
+            }
+            gc_chain_env(us, frame, proc->pval.env);
+            tail->exec = owner->exec->entry;
+            tail->env = frame;
+            tail->owner = owner;
+            ret = 0;
+            break;
+        }
+    }
+    gc_pop(us->gc, 1);
+    if (argv != stack) {
+        MEM_FREE_TYPE(argv, argc, Cell*);
+    }
+    return ret;
+}
+
+static Cell* exec_eval(US* us, const Exec* exec, Env* env, ExecTail* tail)
+{
+    (void) tail;
+    Cell* ret = cell_eval(us, exec->value, env);
+    return ret ? ret : nil;
+}
@@ -0,0 +1,66 @@
+#ifndef ANALYZE_H_
+#define ANALYZE_H_
+
+// Closure compilation: the body of a resolved lambda (see resolve.h) is
+// analyzed once into a tree of executors, one per node, each of them a C
+// function plus the operands it needs, already picked apart.  Running them
+// then never looks at the shape of the code again: no gathering of args, no
+// checks for special forms.  A lambda body is analyzed the first time a
+// procedure is created for it, and all those procedures share the executors.
+
+// Define our structures
+struct US;
+struct Cell;
+struct Env;
+struct Symbol;
+struct Exec;
+
+// Where to go on after an executor, when its value is the value of another
+// executor, in tail position: an if branch, or a procedure body
+typedef struct ExecTail {
+    const struct Exec* exec;    // the executor to run next
+    struct Env* env;            // the env to run it in
+    struct Cell* owner;         // the exec cell that owns it, if it changed
+} ExecTail;
+
+// Function prototype for an executor: return the value of its node, or fill
+// in tail and return null, and the caller then runs tail->exec
+typedef struct Cell* (ExecFunc)(struct US* us, const struct Exec* exec, struct Env* env, ExecTail* tail);
+
+// An executor
+typedef struct Exec {
+    ExecFunc* func;
+    union {
+        struct Cell* value;             // a constant, a lambda, or anything
+                                        // else, to be evaluated by cell_eval
+        struct Symbol* sym;             // a global variable
+        struct {
+            int depth;
+            int slot;
+        } local;                        // a local variable
+        struct {
+            const struct Exec* test;
+            const struct Exec* then;
+            const struct Exec* other;
+        } branch;                       // an if special form
+        struct {
+            const struct Exec* value;
+            struct Symbol* sym;
+            int depth;
+            int slot;
+        } set;                          // a define or a set! special form
+        struct {
+            const struct Exec** args;   // args[0] is what is being called
+            int argc;
+        } call;                         // a procedure call
+    };
+} Exec;
+
+// Create a procedure for a resolved lambda, analyzing its body if this was not
+// done yet
+struct Cell* exec_create_procedure(struct US* us, struct Cell* lambda, struct Env* env);
+
+// Run the body of a procedure in its frame, which has all args bound already
+struct Cell* exec_run(struct US* us, struct Cell* proc, struct Env* frame);
+
+#endif
@@ -1,5 +1,9 @@
+#include <fcntl.h>
 #include <stdlib.h>
 #include <strings.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "arena.h"
 
 #if !defined(MEM_DEBUG)
@@ -10,71 +14,143 @@
 // #define LOG_LEVEL LOG_LEVEL_DEBUG
 #include "log.h"
 
+// Initial number of buckets (as a power of two) for the pool directories
+#define POOL_DIR_BITS 6
+
+static int cell_class(int size);
+static unsigned long cell_pool_bytes(int size);
+static uintptr_t pool_align(unsigned long bytes);
+static void pool_dir_init(PoolDir* dir);
+static void pool_dir_fini(PoolDir* dir);
+static void pool_dir_add(PoolDir* dir, const void* pool);
+static void pool_dir_del(PoolDir* dir, const void* pool);
+static int pool_dir_has(const PoolDir* dir, const void* pool);
+static long cell_pool_destroy(Arena* arena, CellPool* pool);
+static long env_pool_destroy(Arena* arena, EnvPool* pool);
+static CellPool* cell_pool_first_free(Arena* arena, int cls);
+static EnvPool* env_pool_first_free(Arena* arena);
+static void cell_pool_sweep(Arena* arena, CellPool* pool, uint64_t keep, GCStats* stats);
+static void env_pool_sweep(EnvPool* pool, uint64_t keep, GCStats* stats);
+static int count_bits(uint64_t mask);
+static long string_put(Arena* arena, char* str, int size);
+static void string_heap_trim(Arena* arena);
+static ArenaImage* image_find(Arena* arena, const char* str);
+static void image_unmap(Arena* arena, ArenaImage* image);
+static int arena_collect(Arena* arena);
+static void arena_forget_dirty(Arena* arena);
+static Env* arena_next_env(Arena* arena);
+
+// Size of the slots for each size class of cells
+static const int cell_sizes[ARENA_CELL_CLASSES] = {
+    ARENA_CELL_SMALL_SIZE,
+    sizeof(Cell),
+};
+
 Arena* arena_create(void)
 {
     Arena* arena = 0;
     MEM_ALLOC_TYPE(arena, 1, Arena);
+    for (int k = 0; k < ARENA_CELL_CLASSES; ++k) {
+        arena->cell_align[k] = pool_align(cell_pool_bytes(cell_sizes[k]));
+    }
+    arena->env_align = pool_align(sizeof(((EnvPool*) 0)->slots));
+    arena->max_empty_pools = ARENA_MAX_EMPTY_POOLS;
+    pool_dir_init(&arena->cell_dir);
+    pool_dir_init(&arena->env_dir);
     LOG(INFO, ("arena: created %p", arena));
     return arena;
 }
 
-static void cell_cleanup(Cell* cell)
+// Free any data owned by a cell; return how many bytes were freed.
+static long cell_cleanup(Arena* arena, Cell* cell)
 {
+    long bytes = 0;
     switch (cell->tag) {
         case CELL_STRING:
-        case CELL_SYMBOL:
-            MEM_FREE_SIZE(cell->sval, 0);
+            if (cell->sval != CELL_STRING_INLINE(cell)) {
+                bytes = string_put(arena, cell->sval, cell->len + 1);
+            }
+            cell->sval = 0;
+            break;
+        case CELL_CODE:
+            bytes = cell->code->bytes;
+            MEM_FREE_SIZE(cell->code, bytes);
+            break;
+        case CELL_EXEC:
+            bytes = cell->exec->bytes;
+            MEM_FREE_SIZE(cell->exec, bytes);
             break;
     }
     cell->tag = CELL_NONE;
+    return bytes;
 }
 
-static void env_cleanup(Env* env)
+// Free all symbols in an env (but keep its table), or forget the slots in a
+// frame (but keep any spill array); return how many bytes were freed.
+static long env_cleanup(Env* env)
 {
+    long bytes = 0;
     env->parent = 0;
+    env->slots = 0;
+    env->names = 0;
+    env->count = 0;
+    if (!env->table) {
+        return bytes;
+    }
     for (int j = 0; j < env->size; ++j) {
         for (Symbol* sym = env->table[j]; sym; ) {
             Symbol* tmp = sym;
             sym = sym->next;
-            MEM_FREE_SIZE(tmp->name, 0);
+            bytes += sizeof(Symbol);
             MEM_FREE_TYPE(tmp, 1, Symbol);
         }
         env->table[j] = 0;
     }
+    return bytes;
 }
 
 void arena_destroy(Arena* arena)
 {
     int count = 0;
+    long bytes = 0;
     LOG(INFO, ("arena: destroying arena %p", arena));
     count = 0;
+    bytes = 0;
     for (CellPool* pool = arena->cells; pool; ) {
-        for (unsigned long j = 0; j < ARENA_POOL_SIZE; ++j) {
-            cell_cleanup(&pool->slots[j]);
-        }
         CellPool* tmp = pool;
         pool = pool->next;
-        LOG(DEBUG, ("arena: destroying cell pool %p", tmp));
-        MEM_FREE_TYPE(tmp, 1, CellPool);
+        bytes += cell_pool_destroy(arena, tmp);
         ++count;
     }
-    LOG(INFO, ("arena: destroyed %d cell pools, %lu bytes", count, (unsigned long) (count * sizeof(CellPool))));
+    LOG(INFO, ("arena: destroyed %d cell pools, %ld bytes", count, bytes));
 
     count = 0;
+    bytes = 0;
     for (EnvPool* pool = arena->envs; pool; ) {
-        for (unsigned long j = 0; j < ARENA_POOL_SIZE; ++j) {
-            Env* env = &pool->slots[j];
-            env_cleanup(env);
-            MEM_FREE_TYPE(env->table, env->size, Symbol*);
-        }
         EnvPool* tmp = pool;
         pool = pool->next;
-        LOG(DEBUG, ("arena: destroying env pool %p", tmp));
-        MEM_FREE_TYPE(tmp, 1, EnvPool);
+        bytes += env_pool_destroy(arena, tmp);
+        ++count;
+    }
+    LOG(INFO, ("arena: destroyed %d env pools, %ld bytes", count, bytes));
+
+    // all strings were given back when destroying the cell pools
+    count = 0;
+    for (StringChunk* chunk = arena->strings; chunk; ) {
+        StringChunk* tmp = chunk;
+        chunk = chunk->next;
+        MEM_FREE_SIZE(tmp, ARENA_STRING_CHUNK);
         ++count;
     }
-    LOG(INFO, ("arena: destroyed %d env pools, %lu bytes", count, (unsigned long) (count * sizeof(EnvPool))));
+    LOG(INFO, ("arena: destroyed %d string chunks", count));
+
+    // likewise, no strings are left in any image
+    while (arena->images) {
+        image_unmap(arena, arena->images);
+    }
 
+    pool_dir_fini(&arena->cell_dir);
+    pool_dir_fini(&arena->env_dir);
     MEM_FREE_TYPE(arena, 1, Arena);
 }
 
@@ -86,85 +162,295 @@ void arena_destroy(Arena* arena)
 
 Cell* arena_get_cell(Arena* arena, int hint)
 {
-    (void) hint;
-    CellPool* pool = 0;
-    int pos = 0;
-    for (pool = arena->cells; pool; pool = pool->next) {
-        // find first unused slot in this pool
-        int lsb = ffsll(pool->mask);
-        if (lsb) {
-            // there is at least one bit set to 1 => free slot
-            pos = lsb - 1;
-            break;
-        }
+    int cls = cell_class(hint);
+
+    if (arena->step) {
+        // an incremental collection is under way, help it along
+        arena->step(arena->collect_data);
+    }
+    if (arena->nursery && arena->young >= arena->nursery) {
+        // nursery is full, time for a (probably minor) collection
+        arena_collect(arena);
+    }
+
+    CellPool* pool = cell_pool_first_free(arena, cls);
+    if (!pool && arena_collect(arena)) {
+        // try again, some slots may have been freed
+        pool = cell_pool_first_free(arena, cls);
     }
 
     if (!pool) {
-        // Need to create a new cell pool
-        MEM_ALLOC_TYPE(pool, 1, CellPool);
-        LOG(DEBUG, ("arena: created cell pool %p", pool));
+        // Need to create a new cell pool, with slots as big as its class needs
+        char* mem = 0;
+        MEM_ALLOC_ALIGNED(mem, arena->cell_align[cls], cell_pool_bytes(cell_sizes[cls]), char);
+        pool = (CellPool*) mem;
+        LOG(DEBUG, ("arena: created cell pool %p, class %d", pool, cls));
+        pool_dir_add(&arena->cell_dir, pool);
+        ++arena->cell_pools;
         pool->mask = POOL_EMPTY;
+        pool->cls = cls;
+        pool->size = cell_sizes[cls];
         pool->next = arena->cells;
         arena->cells = pool;
-        pos = 0;
+        pool->next_free = arena->cells_free[cls];
+        arena->cells_free[cls] = pool;
+        pool->listed = 1;
     }
 
-    // mark pos as used to return it
+    // find first unused slot in this pool; there is at least one bit set to 1
+    int pos = ffsll(pool->mask) - 1;
+
+    // mark pos as used to return it, and remember it is young
     POOL_MARK_USED(pool->mask, pos);
+    if (!pool->young) {
+        pool->next_young = arena->cells_young;
+        arena->cells_young = pool;
+    }
+    pool->young |= 1ULL << pos;
+    ++arena->young;
 
     // free any data that might still be in the cell
-    Cell* cell = &pool->slots[pos];
-    cell_cleanup(cell);
+    Cell* cell = CELL_POOL_SLOT(pool, pos);
+    cell_cleanup(arena, cell);
     return cell;
 }
 
-Env* arena_get_env(Arena* arena, int hint)
+char* arena_get_string(Arena* arena, int size)
+{
+    char* str = 0;
+    if (size > ARENA_STRING_MAX) {
+        MEM_ALLOC_SIZE(str, size);
+        return str;
+    }
+
+    StringChunk* chunk = arena->strings;
+    if (!chunk || chunk->used + size > ARENA_STRING_CHUNK) {
+        // Need to create a new chunk; the old one stays around until all the
+        // strings in it are given back
+        char* mem = 0;
+        MEM_ALLOC_ALIGNED(mem, ARENA_STRING_CHUNK, ARENA_STRING_CHUNK, char);
+        chunk = (StringChunk*) mem;
+        LOG(DEBUG, ("arena: created string chunk %p", chunk));
+        chunk->used = sizeof(StringChunk);
+        chunk->next = arena->strings;
+        arena->strings = chunk;
+        ++arena->string_chunks;
+    }
+    str = (char*) chunk + chunk->used;
+    chunk->used += size;
+    ++chunk->live;
+    return str;
+}
+
+long arena_put_string(Arena* arena, char* str, int size)
+{
+    return string_put(arena, str, size);
+}
+
+ArenaImage* arena_map_image(Arena* arena, const char* path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        LOG(WARNING, ("arena: could not open [%s]", path));
+        return 0;
+    }
+    struct stat st;
+    char* base = 0;
+    if (fstat(fd, &st) < 0) {
+        LOG(WARNING, ("arena: could not stat [%s]", path));
+        close(fd);
+        return 0;
+    }
+    if (st.st_size > 0) {
+        // private and writable: what we write stays with us, in a copy of just
+        // the pages we write to
+        base = mmap(0, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        if (base == MAP_FAILED) {
+            LOG(WARNING, ("arena: could not map [%s]", path));
+            close(fd);
+            return 0;
+        }
+    }
+    close(fd);
+
+    ArenaImage* image = 0;
+    MEM_ALLOC_TYPE(image, 1, ArenaImage);
+    image->base = base;
+    image->size = st.st_size;
+    image->held = 1;
+    image->next = arena->images;
+    arena->images = image;
+    LOG(INFO, ("arena: mapped [%s] at %p, %ld bytes", path, base, image->size));
+    return image;
+}
+
+void arena_release_image(Arena* arena, ArenaImage* image)
+{
+    image->held = 0;
+    if (!image->live) {
+        image_unmap(arena, image);
+    }
+}
+
+int arena_hold_image_string(Arena* arena, const char* str)
+{
+    ArenaImage* image = image_find(arena, str);
+    if (!image) {
+        return 0;
+    }
+    ++image->live;
+    return 1;
+}
+
+// Find the image a string lives in, if any; there are only ever a few of them.
+static ArenaImage* image_find(Arena* arena, const char* str)
 {
-    EnvPool* pool = 0;
-    int pos = 0;
-    for (pool = arena->envs; pool; pool = pool->next) {
-        // find first unused slot in this pool
-        int lsb = ffsll(pool->mask);
-        if (lsb) {
-            // there is at least one bit set to 1 => free slot
-            pos = lsb - 1;
+    for (ArenaImage* image = arena->images; image; image = image->next) {
+        if (str >= image->base && str < image->base + image->size) {
+            return image;
+        }
+    }
+    return 0;
+}
+
+static void image_unmap(Arena* arena, ArenaImage* image)
+{
+    for (ArenaImage** prev = &arena->images; *prev; prev = &(*prev)->next) {
+        if (*prev == image) {
+            *prev = image->next;
             break;
         }
     }
+    LOG(INFO, ("arena: unmapping image at %p, %ld bytes", image->base, image->size));
+    if (image->size > 0) {
+        munmap(image->base, image->size);
+    }
+    MEM_FREE_TYPE(image, 1, ArenaImage);
+}
+
+Env* arena_get_env(Arena* arena, int hint)
+{
+    Env* env = arena_next_env(arena);
+    int size = hint ? hint : 1021;
+    if (env->table && env->size != size) {
+        // this slot had a table of a different size; make it the right size
+        MEM_FREE_TYPE(env->table, env->size, Symbol*);
+        env->size = 0;
+    }
+    if (env->table) {
+        LOG(DEBUG, ("ARENA - ENV: reusing %p, %d buckets at %p", env, env->size, env->table));
+    } else {
+        env->size = size;
+        MEM_ALLOC_TYPE(env->table, env->size, Symbol*);
+        LOG(DEBUG, ("ARENA - ENV: created %p, %d buckets at %p", env, env->size, env->table));
+    }
+    return env;
+}
+
+Env* arena_get_frame(Arena* arena, Cell* names, int count)
+{
+    Env* env = arena_next_env(arena);
+    if (env->table) {
+        // this slot was a hash table before; frames don't need that
+        MEM_FREE_TYPE(env->table, env->size, Symbol*);
+        env->table = 0;
+        env->size = 0;
+    }
+    if (count <= ENV_FRAME_SLOTS) {
+        env->slots = env->values;
+    } else {
+        if (env->spill_size < count) {
+            MEM_FREE_TYPE(env->spill, env->spill_size, Cell*);
+            env->spill_size = count;
+            MEM_ALLOC_TYPE(env->spill, env->spill_size, Cell*);
+        }
+        env->slots = env->spill;
+    }
+    memset(env->slots, 0, count * sizeof(Cell*));
+    env->names = names;
+    env->count = count;
+    LOG(DEBUG, ("ARENA - ENV: created frame %p, %d slots", env, count));
+    return env;
+}
+
+// Get the next free env slot, already cleaned up, for an env or a frame
+static Env* arena_next_env(Arena* arena)
+{
+    if (arena->step) {
+        // an incremental collection is under way, help it along
+        arena->step(arena->collect_data);
+    }
+    if (arena->nursery && arena->young >= arena->nursery) {
+        // nursery is full, time for a (probably minor) collection
+        arena_collect(arena);
+    }
+
+    EnvPool* pool = env_pool_first_free(arena);
+    if (!pool && arena_collect(arena)) {
+        // try again, some slots may have been freed
+        pool = env_pool_first_free(arena);
+    }
 
     if (!pool) {
         // Need to create a new pool
-        MEM_ALLOC_TYPE(pool, 1, EnvPool);
+        MEM_ALLOC_ALIGNED(pool, arena->env_align, 1, EnvPool);
         LOG(DEBUG, ("arena: created env pool %p", pool));
+        pool_dir_add(&arena->env_dir, pool);
+        ++arena->env_pools;
         pool->mask = POOL_EMPTY;
         pool->next = arena->envs;
         arena->envs = pool;
-        pos = 0;
+        pool->next_free = arena->envs_free;
+        arena->envs_free = pool;
+        pool->listed = 1;
     }
 
-    // mark pos as used and return it
+    // find first unused slot in this pool; there is at least one bit set to 1
+    int pos = ffsll(pool->mask) - 1;
+
+    // mark pos as used and return it, and remember it is young
     POOL_MARK_USED(pool->mask, pos);
+    if (!pool->young) {
+        pool->next_young = arena->envs_young;
+        arena->envs_young = pool;
+    }
+    pool->young |= 1ULL << pos;
+    ++arena->young;
 
     Env* env = &pool->slots[pos];
     env_cleanup(env);
-    if (env->size) {
-        LOG(DEBUG, ("ARENA - ENV: reusing %p, %d buckets at %p", env, env->size, env->table));
-    } else {
-        env->size = hint ? hint : 1021;
-        MEM_ALLOC_TYPE(env->table, env->size, Symbol*);
-        LOG(DEBUG, ("ARENA - ENV: created %p, %d buckets at %p", env, env->size, env->table));
-    }
     return env;
 }
 
 void arena_reset_to_empty(Arena* arena)
 {
+    // every pool is empty now, so every pool goes into the free lists
+    for (int k = 0; k < ARENA_CELL_CLASSES; ++k) {
+        arena->cells_free[k] = 0;
+    }
     for (CellPool* pool = arena->cells; pool; pool = pool->next) {
         pool->mask = POOL_EMPTY;
+        pool->young = 0;
+        pool->dirty = 0;
+        pool->next_free = arena->cells_free[pool->cls];
+        arena->cells_free[pool->cls] = pool;
+        pool->listed = 1;
     }
+    arena->envs_free = arena->envs;
     for (EnvPool* pool = arena->envs; pool; pool = pool->next) {
         pool->mask = POOL_EMPTY;
+        pool->young = 0;
+        pool->dirty = 0;
+        pool->next_free = pool->next;
+        pool->listed = 1;
     }
+    arena->cells_young = 0;
+    arena->cells_dirty = 0;
+    arena->envs_young = 0;
+    arena->envs_dirty = 0;
+    arena->young = 0;
+    arena->cell_sweep = 0;
+    arena->env_sweep = 0;
 }
 
 int arena_is_cell_used(Arena* arena, const Cell* cell)
@@ -173,7 +459,7 @@ int arena_is_cell_used(Arena* arena, const Cell* cell)
     if (!pool) {
         return 0;
     }
-    int pos = cell - pool->slots;
+    int pos = CELL_POOL_POS(pool, cell);
     return POOL_IS_USED(pool->mask, pos);
 }
 
@@ -193,7 +479,7 @@ void arena_mark_cell_used(Arena* arena, const Cell* cell)
     if (!pool) {
         return;
     }
-    int pos = cell - pool->slots;
+    int pos = CELL_POOL_POS(pool, cell);
     POOL_MARK_USED(pool->mask, pos);
 }
 
@@ -207,30 +493,339 @@ void arena_mark_env_used(Arena* arena, const Env* env)
     POOL_MARK_USED(pool->mask, pos);
 }
 
-CellPool* arena_get_pool_for_cell(Arena* arena, const Cell* cell)
+void arena_clear_marks(Arena* arena)
 {
     for (CellPool* pool = arena->cells; pool; pool = pool->next) {
-        if (pool->slots <= cell && cell < (pool->slots + ARENA_POOL_SIZE)) {
-            return pool;
+        pool->mark = 0;
+    }
+    for (EnvPool* pool = arena->envs; pool; pool = pool->next) {
+        pool->mark = 0;
+    }
+}
+
+int arena_mark_cell(Arena* arena, const Cell* cell)
+{
+    CellPool* pool = arena_get_pool_for_cell(arena, cell);
+    if (!pool) {
+        return 0;
+    }
+    uint64_t bit = 1ULL << CELL_POOL_POS(pool, cell);
+    if (pool->mark & bit) {
+        return 0;
+    }
+    pool->mark |= bit;
+    return 1;
+}
+
+int arena_mark_env(Arena* arena, const Env* env)
+{
+    EnvPool* pool = arena_get_pool_for_env(arena, env);
+    if (!pool) {
+        return 0;
+    }
+    uint64_t bit = 1ULL << (env - pool->slots);
+    if (pool->mark & bit) {
+        return 0;
+    }
+    pool->mark |= bit;
+    return 1;
+}
+
+void arena_sweep(Arena* arena, GCStats* stats)
+{
+    GCStats local;
+    if (!stats) {
+        stats = &local;
+    }
+    memset(stats, 0, sizeof(GCStats));
+
+    // After this everything is old; forget the young lists right away, since
+    // some of those pools may be destroyed below; this also cancels any
+    // incremental sweep
+    arena->cells_young = 0;
+    arena->envs_young = 0;
+    arena->young = 0;
+    arena_forget_dirty(arena);
+    arena->cell_sweep = 0;
+    arena->env_sweep = 0;
+
+    // Go over all cell pools, rebuilding the free lists as we go
+    int empty = 0;
+    CellPool** cell_free[ARENA_CELL_CLASSES];
+    for (int k = 0; k < ARENA_CELL_CLASSES; ++k) {
+        cell_free[k] = &arena->cells_free[k];
+    }
+    for (CellPool** prev = &arena->cells; *prev; ) {
+        CellPool* pool = *prev;
+        cell_pool_sweep(arena, pool, 0, stats);
+        pool->young = 0;
+        pool->listed = 0;
+
+        if (pool->mask == POOL_EMPTY && ++empty > arena->max_empty_pools) {
+            *prev = pool->next;
+            stats->freed_bytes += cell_pool_destroy(arena, pool);
+            ++stats->freed_pools;
+            continue;
         }
+        if (pool->mask) {
+            *cell_free[pool->cls] = pool;
+            cell_free[pool->cls] = &pool->next_free;
+            pool->listed = 1;
+        }
+        prev = &pool->next;
+    }
+    for (int k = 0; k < ARENA_CELL_CLASSES; ++k) {
+        *cell_free[k] = 0;
+    }
 
+    // Same thing for all env pools
+    empty = 0;
+    EnvPool** env_free = &arena->envs_free;
+    for (EnvPool** prev = &arena->envs; *prev; ) {
+        EnvPool* pool = *prev;
+        env_pool_sweep(pool, 0, stats);
+        pool->young = 0;
+        pool->listed = 0;
+
+        if (pool->mask == POOL_EMPTY && ++empty > arena->max_empty_pools) {
+            *prev = pool->next;
+            stats->freed_bytes += env_pool_destroy(arena, pool);
+            ++stats->freed_pools;
+            continue;
+        }
+        if (pool->mask) {
+            *env_free = pool;
+            env_free = &pool->next_free;
+            pool->listed = 1;
+        }
+        prev = &pool->next;
     }
-    LOG(DEBUG, ("ARENA: cell %p out of bound -- WTF?", cell));
-    return 0;
+    *env_free = 0;
+    string_heap_trim(arena);
+
+    LOG(DEBUG, ("arena: swept %ld cells, %ld envs, %ld pools, %ld bytes",
+                stats->freed_cells, stats->freed_envs, stats->freed_pools, stats->freed_bytes));
 }
 
-EnvPool* arena_get_pool_for_env(Arena* arena, const Env* env)
+// Pools only become available again as they are swept, so that we never hand
+// out a slot that still holds garbage, and never destroy a pool that is still
+// in the free list.
+void arena_sweep_begin(Arena* arena, GCStats* stats)
 {
+    memset(stats, 0, sizeof(GCStats));
+
+    // from now on, anything that is used must be kept, so it starts young
+    for (CellPool* pool = arena->cells_young; pool; pool = pool->next_young) {
+        pool->young = 0;
+    }
+    for (EnvPool* pool = arena->envs_young; pool; pool = pool->next_young) {
+        pool->young = 0;
+    }
+    arena->cells_young = 0;
+    arena->envs_young = 0;
+    arena->young = 0;
+    arena_forget_dirty(arena);
+
+    for (CellPool* pool = arena->cells; pool; pool = pool->next) {
+        pool->listed = 0;
+    }
     for (EnvPool* pool = arena->envs; pool; pool = pool->next) {
-        if (pool->slots <= env && env < (pool->slots + ARENA_POOL_SIZE)) {
-            return pool;
+        pool->listed = 0;
+    }
+    for (int k = 0; k < ARENA_CELL_CLASSES; ++k) {
+        arena->cells_free[k] = 0;
+    }
+    arena->envs_free = 0;
+
+    arena->cell_sweep = &arena->cells;
+    arena->env_sweep = &arena->envs;
+    arena->cell_empty = 0;
+    arena->env_empty = 0;
+}
+
+int arena_sweep_some(Arena* arena, int count, GCStats* stats)
+{
+    if (!arena->cell_sweep || !arena->env_sweep) {
+        return 0;
+    }
+
+    for (int j = 0; j < count && *arena->cell_sweep; ++j) {
+        CellPool* pool = *arena->cell_sweep;
+        cell_pool_sweep(arena, pool, pool->young, stats);
+        if (pool->mask == POOL_EMPTY && ++arena->cell_empty > arena->max_empty_pools) {
+            *arena->cell_sweep = pool->next;
+            stats->freed_bytes += cell_pool_destroy(arena, pool);
+            ++stats->freed_pools;
+            continue;
+        }
+        if (pool->mask && !pool->listed) {
+            pool->next_free = arena->cells_free[pool->cls];
+            arena->cells_free[pool->cls] = pool;
+            pool->listed = 1;
+        }
+        arena->cell_sweep = &pool->next;
+    }
+
+    for (int j = 0; j < count && *arena->env_sweep; ++j) {
+        EnvPool* pool = *arena->env_sweep;
+        env_pool_sweep(pool, pool->young, stats);
+        if (pool->mask == POOL_EMPTY && ++arena->env_empty > arena->max_empty_pools) {
+            *arena->env_sweep = pool->next;
+            stats->freed_bytes += env_pool_destroy(arena, pool);
+            ++stats->freed_pools;
+            continue;
+        }
+        if (pool->mask && !pool->listed) {
+            pool->next_free = arena->envs_free;
+            arena->envs_free = pool;
+            pool->listed = 1;
+        }
+        arena->env_sweep = &pool->next;
+    }
+
+    if (*arena->cell_sweep || *arena->env_sweep) {
+        return 1;
+    }
+    arena->cell_sweep = 0;
+    arena->env_sweep = 0;
+    string_heap_trim(arena);
+    LOG(DEBUG, ("arena: swept incrementally %ld cells, %ld envs, %ld pools, %ld bytes",
+                stats->freed_cells, stats->freed_envs, stats->freed_pools, stats->freed_bytes));
+    return 0;
+}
+
+void arena_remember_cell(Arena* arena, const Cell* cell)
+{
+    CellPool* pool = arena_get_pool_for_cell(arena, cell);
+    if (!pool) {
+        return;
+    }
+    uint64_t bit = 1ULL << CELL_POOL_POS(pool, cell);
+    if ((pool->young | pool->dirty) & bit) {
+        // young cells are always looked at, and dirty ones already will be
+        return;
+    }
+    if (!pool->dirty) {
+        pool->next_dirty = arena->cells_dirty;
+        arena->cells_dirty = pool;
+    }
+    pool->dirty |= bit;
+}
+
+void arena_remember_env(Arena* arena, const Env* env)
+{
+    EnvPool* pool = arena_get_pool_for_env(arena, env);
+    if (!pool) {
+        return;
+    }
+    uint64_t bit = 1ULL << (env - pool->slots);
+    if ((pool->young | pool->dirty) & bit) {
+        // young envs are always looked at, and dirty ones already will be
+        return;
+    }
+    if (!pool->dirty) {
+        pool->next_dirty = arena->envs_dirty;
+        arena->envs_dirty = pool;
+    }
+    pool->dirty |= bit;
+}
+
+// Pools without young slots have not been used since the last collection, so
+// their marks are still exactly their used slots, all of them old.
+void arena_mark_old(Arena* arena)
+{
+    for (CellPool* pool = arena->cells_young; pool; pool = pool->next_young) {
+        pool->mark = ~pool->mask & ~pool->young;
+    }
+    for (EnvPool* pool = arena->envs_young; pool; pool = pool->next_young) {
+        pool->mark = ~pool->mask & ~pool->young;
+    }
+}
+
+void arena_sweep_young(Arena* arena, GCStats* stats)
+{
+    GCStats local;
+    if (!stats) {
+        stats = &local;
+    }
+    memset(stats, 0, sizeof(GCStats));
+    stats->minor = 1;
+
+    for (CellPool* pool = arena->cells_young; pool; pool = pool->next_young) {
+        // young but not marked => garbage; free its data right now
+        uint64_t dead = pool->young & ~pool->mark;
+        pool->mask |= dead;
+        for (; dead; dead &= dead - 1) {
+            int pos = ffsll(dead) - 1;
+            stats->freed_bytes += cell_cleanup(arena, CELL_POOL_SLOT(pool, pos));
+            ++stats->freed_cells;
+        }
+        stats->live_cells += count_bits(pool->young & pool->mark);
+        pool->young = 0;
+        if (pool->mask && !pool->listed) {
+            pool->next_free = arena->cells_free[pool->cls];
+            arena->cells_free[pool->cls] = pool;
+            pool->listed = 1;
+        }
+    }
+    arena->cells_young = 0;
+
+    for (EnvPool* pool = arena->envs_young; pool; pool = pool->next_young) {
+        uint64_t dead = pool->young & ~pool->mark;
+        pool->mask |= dead;
+        for (; dead; dead &= dead - 1) {
+            int pos = ffsll(dead) - 1;
+            stats->freed_bytes += env_cleanup(&pool->slots[pos]);
+            ++stats->freed_envs;
+        }
+        stats->live_envs += count_bits(pool->young & pool->mark);
+        pool->young = 0;
+        if (pool->mask && !pool->listed) {
+            pool->next_free = arena->envs_free;
+            arena->envs_free = pool;
+            pool->listed = 1;
         }
+    }
+    arena->envs_young = 0;
+
+    arena->young = 0;
+    arena_forget_dirty(arena);
+    string_heap_trim(arena);
 
+    LOG(DEBUG, ("arena: swept young, %ld cells, %ld envs, %ld bytes",
+                stats->freed_cells, stats->freed_envs, stats->freed_bytes));
+}
+
+// Try the alignment of each size class, smallest first; masking a cell in a
+// bigger pool with a smaller alignment may give an address inside that pool,
+// but never the base of another pool.
+// A pool may not fill up all the memory up to its alignment, and malloc can
+// hand out the rest for anything else; so besides finding the pool, we also
+// check the pointer really falls among its slots.
+CellPool* arena_get_pool_for_cell(Arena* arena, const Cell* cell)
+{
+    for (int k = 0; k < ARENA_CELL_CLASSES; ++k) {
+        CellPool* pool = (CellPool*) ((uintptr_t) cell & ~(arena->cell_align[k] - 1));
+        if (pool_dir_has(&arena->cell_dir, pool) &&
+            (const char*) cell >= (const char*) pool->slots &&
+            (const char*) cell < (const char*) pool->slots + ARENA_POOL_SIZE * pool->size) {
+            return pool;
+        }
     }
-    LOG(DEBUG, ("ARENA: env %p out of bound -- WTF?", env));
+    LOG(DEBUG, ("ARENA: cell %p out of bound -- WTF?", cell));
     return 0;
 }
 
+EnvPool* arena_get_pool_for_env(Arena* arena, const Env* env)
+{
+    EnvPool* pool = (EnvPool*) ((uintptr_t) env & ~(arena->env_align - 1));
+    if (!pool_dir_has(&arena->env_dir, pool) || env >= pool->slots + ARENA_POOL_SIZE) {
+        LOG(DEBUG, ("ARENA: env %p out of bound -- WTF?", env));
+        return 0;
+    }
+    return pool;
+}
+
 void arena_dump(Arena* arena, FILE* fp)
 {
     int count = 0;
@@ -264,3 +859,287 @@ void arena_dump(Arena* arena, FILE* fp)
     }
     fprintf(fp, "===  EnvPool count: %d\n", count);
 }
+
+// We ran out of free slots, or the nursery is full; give a chance to collect
+// garbage.  Return
+// non-zero if garbage was collected.
+static int arena_collect(Arena* arena)
+{
+    if (!arena->collect) {
+        return 0;
+    }
+    return arena->collect(arena->collect_data);
+}
+
+// Skip (and forget about) any full pools at the front of the free list, and
+// return the first pool with free slots, if any.
+static CellPool* cell_pool_first_free(Arena* arena, int cls)
+{
+    CellPool* pool = arena->cells_free[cls];
+    while (pool && !pool->mask) {
+        pool->listed = 0;
+        pool = pool->next_free;
+    }
+    arena->cells_free[cls] = pool;
+    return pool;
+}
+
+static EnvPool* env_pool_first_free(Arena* arena)
+{
+    EnvPool* pool = arena->envs_free;
+    while (pool && !pool->mask) {
+        pool->listed = 0;
+        pool = pool->next_free;
+    }
+    arena->envs_free = pool;
+    return pool;
+}
+
+// Free all slots in a cell pool that are used but neither marked nor in keep.
+static void cell_pool_sweep(Arena* arena, CellPool* pool, uint64_t keep, GCStats* stats)
+{
+    uint64_t dead = ~pool->mask & ~pool->mark & ~keep;
+    pool->mask |= dead;
+    for (; dead; dead &= dead - 1) {
+        int pos = ffsll(dead) - 1;
+        stats->freed_bytes += cell_cleanup(arena, CELL_POOL_SLOT(pool, pos));
+        ++stats->freed_cells;
+    }
+    stats->live_cells += count_bits(~pool->mask);
+    stats->live_pools += pool->mask != POOL_EMPTY;
+}
+
+static void env_pool_sweep(EnvPool* pool, uint64_t keep, GCStats* stats)
+{
+    uint64_t dead = ~pool->mask & ~pool->mark & ~keep;
+    pool->mask |= dead;
+    for (; dead; dead &= dead - 1) {
+        int pos = ffsll(dead) - 1;
+        stats->freed_bytes += env_cleanup(&pool->slots[pos]);
+        ++stats->freed_envs;
+    }
+    stats->live_envs += count_bits(~pool->mask);
+    stats->live_pools += pool->mask != POOL_EMPTY;
+}
+
+// Clear all dirty slots, and the lists of pools that had them.
+static void arena_forget_dirty(Arena* arena)
+{
+    for (CellPool* pool = arena->cells_dirty; pool; pool = pool->next_dirty) {
+        pool->dirty = 0;
+    }
+    arena->cells_dirty = 0;
+    for (EnvPool* pool = arena->envs_dirty; pool; pool = pool->next_dirty) {
+        pool->dirty = 0;
+    }
+    arena->envs_dirty = 0;
+}
+
+// Free a cell pool and everything in it; the caller must have already
+// unlinked it from the list of pools.  Return how many bytes were freed.
+static long cell_pool_destroy(Arena* arena, CellPool* pool)
+{
+    long bytes = cell_pool_bytes(pool->size);
+    for (unsigned long j = 0; j < ARENA_POOL_SIZE; ++j) {
+        bytes += cell_cleanup(arena, CELL_POOL_SLOT(pool, j));
+    }
+    pool_dir_del(&arena->cell_dir, pool);
+    --arena->cell_pools;
+    LOG(DEBUG, ("arena: destroying cell pool %p", pool));
+    MEM_FREE_SIZE(pool, cell_pool_bytes(pool->size));
+    return bytes;
+}
+
+// Free an env pool and everything in it, including the env tables; the caller
+// must have already unlinked it from the list of pools.  Return how many
+// bytes were freed.
+static long env_pool_destroy(Arena* arena, EnvPool* pool)
+{
+    long bytes = sizeof(EnvPool);
+    for (unsigned long j = 0; j < ARENA_POOL_SIZE; ++j) {
+        Env* env = &pool->slots[j];
+        bytes += env_cleanup(env);
+        bytes += env->size * sizeof(Symbol*);
+        MEM_FREE_TYPE(env->table, env->size, Symbol*);
+        env->size = 0;
+        bytes += env->spill_size * sizeof(Cell*);
+        MEM_FREE_TYPE(env->spill, env->spill_size, Cell*);
+        env->spill_size = 0;
+    }
+    pool_dir_del(&arena->env_dir, pool);
+    --arena->env_pools;
+    LOG(DEBUG, ("arena: destroying env pool %p", pool));
+    MEM_FREE_TYPE(pool, 1, EnvPool);
+    return bytes;
+}
+
+// Smallest size class for a cell that uses a given number of bytes
+static int cell_class(int size)
+{
+    for (int k = 0; k < ARENA_CELL_CLASSES - 1; ++k) {
+        if (size <= cell_sizes[k]) {
+            return k;
+        }
+    }
+    return ARENA_CELL_CLASSES - 1;
+}
+
+// Size of a whole cell pool, header included, with slots of the given size
+static unsigned long cell_pool_bytes(int size)
+{
+    return offsetof(CellPool, slots) + ARENA_POOL_SIZE * size;
+}
+
+// Give back a string; once all strings in its chunk are given back, the
+// chunk can be reused from the start.  Return how many bytes were freed.
+static long string_put(Arena* arena, char* str, int size)
+{
+    if (arena->images) {
+        // strings in an image belong to it; nothing to free until all of them
+        // are given back
+        ArenaImage* image = image_find(arena, str);
+        if (image) {
+            if (--image->live == 0 && !image->held) {
+                image_unmap(arena, image);
+            }
+            return 0;
+        }
+    }
+    if (size > ARENA_STRING_MAX) {
+        MEM_FREE_SIZE(str, size);
+        return size;
+    }
+    StringChunk* chunk = (StringChunk*) ((uintptr_t) str & ~((uintptr_t) ARENA_STRING_CHUNK - 1));
+    if (--chunk->live == 0) {
+        chunk->used = sizeof(StringChunk);
+    }
+    return size;
+}
+
+// Free all string chunks without any strings, except the current one, which
+// will be used for the next strings anyway.
+static void string_heap_trim(Arena* arena)
+{
+    if (!arena->strings) {
+        return;
+    }
+    for (StringChunk** prev = &arena->strings->next; *prev; ) {
+        StringChunk* chunk = *prev;
+        if (chunk->live) {
+            prev = &chunk->next;
+            continue;
+        }
+        *prev = chunk->next;
+        --arena->string_chunks;
+        LOG(DEBUG, ("arena: destroying string chunk %p", chunk));
+        MEM_FREE_SIZE(chunk, ARENA_STRING_CHUNK);
+    }
+}
+
+static int count_bits(uint64_t mask)
+{
+    int count = 0;
+    for (; mask; mask &= mask - 1) {
+        ++count;
+    }
+    return count;
+}
+
+// Smallest power of two that can hold the given number of bytes.
+static uintptr_t pool_align(unsigned long bytes)
+{
+    uintptr_t align = sizeof(void*);
+    while (align < bytes) {
+        align <<= 1;
+    }
+    return align;
+}
+
+// Fibonacci hashing of a pool address; the low bits are always zero because
+// of the alignment, and multiplying spreads the rest over the top bits.
+static unsigned long pool_dir_bucket(const PoolDir* dir, uintptr_t key)
+{
+    return (unsigned long) ((uint64_t) key * 11400714819323198485ULL >> (64 - dir->bits));
+}
+
+static void pool_dir_init(PoolDir* dir)
+{
+    dir->bits = POOL_DIR_BITS;
+    dir->used = 0;
+    MEM_ALLOC_TYPE(dir->keys, 1 << dir->bits, uintptr_t);
+}
+
+static void pool_dir_fini(PoolDir* dir)
+{
+    MEM_FREE_TYPE(dir->keys, 1 << dir->bits, uintptr_t);
+    dir->bits = 0;
+    dir->used = 0;
+}
+
+static void pool_dir_insert(PoolDir* dir, uintptr_t key)
+{
+    unsigned long mask = (1UL << dir->bits) - 1;
+    unsigned long h = pool_dir_bucket(dir, key);
+    while (dir->keys[h]) {
+        h = (h + 1) & mask;
+    }
+    dir->keys[h] = key;
+    ++dir->used;
+}
+
+static void pool_dir_add(PoolDir* dir, const void* pool)
+{
+    // keep the load factor below 1/2, so that probe sequences stay short
+    if (2 * (dir->used + 1) > (1 << dir->bits)) {
+        int size = 1 << dir->bits;
+        uintptr_t* keys = dir->keys;
+        ++dir->bits;
+        dir->used = 0;
+        MEM_ALLOC_TYPE(dir->keys, 1 << dir->bits, uintptr_t);
+        for (int j = 0; j < size; ++j) {
+            if (keys[j]) {
+                pool_dir_insert(dir, keys[j]);
+            }
+        }
+        MEM_FREE_TYPE(keys, size, uintptr_t);
+    }
+    pool_dir_insert(dir, (uintptr_t) pool);
+}
+
+// Remove a pool from the directory; any keys after it in the same probe run
+// are shifted back into the hole, so that lookups never need tombstones.
+static void pool_dir_del(PoolDir* dir, const void* pool)
+{
+    uintptr_t key = (uintptr_t) pool;
+    unsigned long mask = (1UL << dir->bits) - 1;
+    unsigned long hole = pool_dir_bucket(dir, key);
+    while (dir->keys[hole] != key) {
+        if (!dir->keys[hole]) {
+            return;
+        }
+        hole = (hole + 1) & mask;
+    }
+    for (unsigned long j = (hole + 1) & mask; dir->keys[j]; j = (j + 1) & mask) {
+        // the key at j can fill the hole if the hole lies between its home
+        // bucket and j
+        unsigned long home = pool_dir_bucket(dir, dir->keys[j]);
+        if (((j - home) & mask) >= ((j - hole) & mask)) {
+            dir->keys[hole] = dir->keys[j];
+            hole = j;
+        }
+    }
+    dir->keys[hole] = 0;
+    --dir->used;
+}
+
+static int pool_dir_has(const PoolDir* dir, const void* pool)
+{
+    uintptr_t key = (uintptr_t) pool;
+    unsigned long mask = (1UL << dir->bits) - 1;
+    for (unsigned long h = pool_dir_bucket(dir, key); dir->keys[h]; h = (h + 1) & mask) {
+        if (dir->keys[h] == key) {
+            return 1;
+        }
+    }
+    return 0;
+}
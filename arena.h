@@ -2,12 +2,16 @@
 #define ARENA_H_
 
 #include <inttypes.h>   // for PRIx64
+#include <stddef.h>     // for offsetof
 #include <stdint.h>     // for uint64_t
 #include <stdio.h>      // for FILE*
 #include "cell.h"       // for struct Cell
 #include "env.h"        // for struct Env
 
 #define ARENA_POOL_SIZE (8*sizeof(uint64_t)) // basically, 64 bits
+#define ARENA_MAX_EMPTY_POOLS 16             // empty pools kept after a sweep
+#define ARENA_STRING_CHUNK 4096              // bytes in each string heap chunk
+#define ARENA_STRING_MAX   256               // longer strings get their own block
 #define POOL_EMPTY      UINT64_MAX // 1 bit in mask => a free slot
 #define POOL_MASK_FMT   PRIx64
 
@@ -15,30 +19,181 @@
 #define POOL_MARK_USED(m, x)  do { (m) &= ~(1ULL << x); } while (0)
 #define POOL_MARK_FREE(m, x)  do { (m) |=  (1ULL << x); } while (0)
 
+// Cells come in size classes, each with its own pools.  Most cells (numbers,
+// strings, conses, resolved references) only use two words after their tag,
+// so their slots are cut short right there; only procedures, lambdas and
+// natives get slots with room for a whole Cell.
+#define ARENA_CELL_SMALL   0
+#define ARENA_CELL_BIG     1
+#define ARENA_CELL_CLASSES 2
+
+#define ARENA_CELL_SMALL_SIZE (offsetof(Cell, cons) + sizeof(Cons))
+
+// Get the cell in a given slot of a pool, and the slot for a cell in its pool
+#define CELL_POOL_SLOT(p, x) ((Cell*) ((char*) (p)->slots + (x) * (p)->size))
+#define CELL_POOL_POS(p, c)  ((int) (((const char*) (c) - (const char*) (p)->slots) / (p)->size))
+
+// Pools are allocated aligned to a power of two that is at least as big as
+// the whole pool.  So the base address of the pool that owns a given cell/env
+// is found just by masking the low bits of its address.  Cell pools keep their
+// slots last, since their size depends on the size class of the pool; env
+// pools keep them first.
 typedef struct CellPool {
-    Cell slots[ARENA_POOL_SIZE];  // each pool has this many cells
     uint64_t mask;                // keep track of used slots
+    uint64_t mark;                // keep track of reachable slots during GC
+    uint64_t young;               // slots used since the last collection
+    uint64_t dirty;               // old slots changed since the last collection
     struct CellPool* next;        // link to next pool
+    struct CellPool* next_free;   // link to next pool with free slots
+    struct CellPool* next_young;  // link to next pool with young slots
+    struct CellPool* next_dirty;  // link to next pool with dirty slots
+    int listed;                   // whether pool is in the list of free pools
+    int cls;                      // size class of the cells in this pool
+    int size;                     // size of each slot, in bytes
+    Cell slots[];                 // ARENA_POOL_SIZE slots of size bytes each
 } CellPool;
 
 typedef struct EnvPool {
     Env slots[ARENA_POOL_SIZE];   // each pool has this many envs
     uint64_t mask;                // keep track of used slots
+    uint64_t mark;                // keep track of reachable slots during GC
+    uint64_t young;               // slots used since the last collection
+    uint64_t dirty;               // old slots changed since the last collection
     struct EnvPool* next;         // link to next pool
+    struct EnvPool* next_free;    // link to next pool with free slots
+    struct EnvPool* next_young;   // link to next pool with young slots
+    struct EnvPool* next_dirty;   // link to next pool with dirty slots
+    int listed;                   // whether pool is in the list of free pools
 } EnvPool;
 
+// Strings that do not fit inside their cell are carved out of chunks; a chunk
+// is aligned to its size, so the chunk for a string is found by masking its
+// address.  Strings are never moved: a chunk is reused once all the strings
+// in it were given back.
+typedef struct StringChunk {
+    struct StringChunk* next;   // link to next chunk
+    int used;                   // bytes handed out, header included
+    int live;                   // strings handed out and not given back
+} StringChunk;
+
+// A file mapped in memory, so that strings can be used right where they are in
+// it instead of being copied; the image is unmapped once it was released and
+// none of its strings are in use any more.
+typedef struct ArenaImage {
+    struct ArenaImage* next;    // link to next image
+    char* base;                 // the mapping; private, so it can be written
+    long size;                  // bytes in the mapping
+    long live;                  // strings in it still in use
+    int held;                   // non-zero until released
+} ArenaImage;
+
+// What happened during a garbage collection; for a minor collection, the live
+// counts only include the young cells/envs that survived
+typedef struct GCStats {
+    int minor;          // non-zero for a minor collection
+    long live_cells;    // cells still in use after the sweep
+    long freed_cells;   // cells freed by the sweep
+    long live_envs;     // envs still in use after the sweep
+    long freed_envs;    // envs freed by the sweep
+    long live_pools;    // pools with at least one used slot after the sweep
+    long freed_pools;   // empty pools given back to the OS
+    long freed_bytes;   // bytes given back: strings, symbols and pools
+    long pause_us;      // how long the whole collection took
+} GCStats;
+
+// A directory of pool base addresses, used to check whether a masked address
+// really is one of our pools; it is an open addressing hash set.
+typedef struct PoolDir {
+    uintptr_t* keys;    // pool base addresses; 0 means an empty bucket
+    int bits;           // log2 of the number of buckets
+    int used;           // number of pools stored
+} PoolDir;
+
+// Function the arena calls when it runs out of free slots, or when its nursery
+// is full; it may or may not collect garbage, and must return non-zero if it
+// did
+typedef int (ArenaCollect)(void* data);
+
+// Besides the list of all pools, the arena keeps a list of the pools that
+// (may) still have free slots, so that getting a cell/env never has to walk
+// over pools that are already full.  Full pools are dropped lazily from the
+// front of this list; pools get back into it whenever slots are freed.  Each
+// size class of cells has its own such list.
+//
+// For generational collection, cells/envs used since the last collection are
+// young, and all others are old.  The arena keeps lists of the pools with
+// young slots, and of the pools with dirty slots: old cells/envs that were
+// changed, and so may now point to young ones.  A minor collection then only
+// needs to look at young slots and dirty slots; old cells/envs that survive
+// keep their mark bit set between collections.
 typedef struct Arena {
-    CellPool* cells;    // linked list of cell pools
-    EnvPool* envs;      // linked list of env pools
+    CellPool* cells;        // linked list of cell pools
+    CellPool* cells_free[ARENA_CELL_CLASSES]; // per size class, cell pools with free slots
+    CellPool* cells_young;  // linked list of cell pools with young slots
+    CellPool* cells_dirty;  // linked list of cell pools with dirty slots
+    EnvPool* envs;          // linked list of env pools
+    EnvPool* envs_free;     // linked list of env pools with free slots
+    EnvPool* envs_young;    // linked list of env pools with young slots
+    EnvPool* envs_dirty;    // linked list of env pools with dirty slots
+    StringChunk* strings;   // linked list of string chunks; the first is current
+    ArenaImage* images;     // linked list of mapped files
+    long young;             // cells/envs used since the last collection
+    long nursery;           // ask for a collection after this many; 0 = never
+    CellPool** cell_sweep;  // next cell pool to sweep incrementally, if any
+    EnvPool** env_sweep;    // next env pool to sweep incrementally, if any
+    int cell_empty;         // empty cell pools found so far when sweeping
+    int env_empty;          // empty env pools found so far when sweeping
+    int cell_pools;         // number of cell pools
+    int env_pools;          // number of env pools
+    int string_chunks;      // number of string chunks
+    int max_empty_pools;    // empty pools of each kind kept after a sweep
+    ArenaCollect* collect;  // how to collect garbage; null means never
+    ArenaCollect* step;     // called on every allocation, unless null
+    void* collect_data;     // data passed to collect and step
+    uintptr_t cell_align[ARENA_CELL_CLASSES]; // per size class, alignment for cell pools
+    uintptr_t env_align;    // alignment for env pools, a power of two
+    PoolDir cell_dir;       // all cell pools of any size class, by address
+    PoolDir env_dir;        // all env pools, by address
 } Arena;
 
 Arena* arena_create(void);
 void arena_destroy(Arena* arena);
 
-// get an "empty" cell/env from the arena, as if created with malloc
+// get an "empty" cell/env from the arena, as if created with malloc; if there
+// are no free slots left, or the nursery is full, this may collect garbage
+// before growing the arena; it also calls step if set; for a cell, hint is how
+// many bytes of it will be used, which picks its size class (0 means a small
+// cell), and the cell must never use more than that
 Cell* arena_get_cell(Arena* arena, int hint);
 Env* arena_get_env(Arena* arena, int hint);
 
+// get memory for a string of size bytes, null included, from the string heap;
+// long strings get a block of their own; the string belongs to a cell, and is
+// given back when the cell is freed
+char* arena_get_string(Arena* arena, int size);
+
+// give back a string from arena_get_string, of size bytes; return how many
+// bytes were freed
+long arena_put_string(Arena* arena, char* str, int size);
+
+// map a whole file in memory, as an image whose strings can be used in place;
+// return 0 if the file cannot be mapped
+ArenaImage* arena_map_image(Arena* arena, const char* path);
+
+// say an image will not be read any more; it is unmapped right away if none of
+// its strings are in use, or else when the last of them is given back
+void arena_release_image(Arena* arena, ArenaImage* image);
+
+// if a string lives in an image, count it as in use there and return non-zero;
+// the string is then given back with arena_put_string, like any other
+int arena_hold_image_string(Arena* arena, const char* str);
+
+// get a frame from the arena, with count slots (all of them null) for the
+// given list of names; small frames need no heap memory, and bigger ones reuse
+// any big enough array from earlier frames in the same env slot; it may
+// collect garbage just like arena_get_env
+Env* arena_get_frame(Arena* arena, Cell* names, int count);
+
 // set all the cells/envs in the arena to "not used"
 void arena_reset_to_empty(Arena* arena);
 
@@ -50,6 +205,39 @@ int arena_is_env_used(Arena* arena, const Env* env);
 void arena_mark_cell_used(Arena* arena, const Cell* cell);
 void arena_mark_env_used(Arena* arena, const Env* env);
 
+// clear the GC marks for all the cells/envs in the arena
+void arena_clear_marks(Arena* arena);
+
+// mark a cell/env as reachable; return non-zero if it was not marked before
+int arena_mark_cell(Arena* arena, const Cell* cell);
+int arena_mark_env(Arena* arena, const Env* env);
+
+// free all used cells/envs that were not marked, and give back to the OS all
+// empty pools above max_empty_pools; optionally fill in some stats; after
+// this, all cells/envs still in use are old
+void arena_sweep(Arena* arena, GCStats* stats);
+
+// sweep incrementally: begin makes all slots used from now on young, and
+// sweep_some then sweeps up to count pools of each kind at a time, keeping
+// slots that are marked or young; it returns non-zero if there are still
+// pools left to sweep, and fills in stats, which must not be null
+void arena_sweep_begin(Arena* arena, GCStats* stats);
+int arena_sweep_some(Arena* arena, int count, GCStats* stats);
+
+// remember that an old cell/env was changed, and so must be looked at by the
+// next minor collection
+void arena_remember_cell(Arena* arena, const Cell* cell);
+void arena_remember_env(Arena* arena, const Env* env);
+
+// before a minor collection: mark all old cells/envs as reachable, and clear
+// the marks for all young ones
+void arena_mark_old(Arena* arena);
+
+// free all young cells/envs that were not marked, and forget all dirty slots;
+// optionally fill in some stats; after this, all cells/envs still in use are
+// old
+void arena_sweep_young(Arena* arena, GCStats* stats);
+
 // get the pool in the arena where a specific cell/env lives
 CellPool* arena_get_pool_for_cell(Arena* arena, const Cell* cell);
 EnvPool* arena_get_pool_for_env(Arena* arena, const Env* env);
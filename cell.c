@@ -1,7 +1,10 @@
+#include <stddef.h>
 #include <string.h>
 #include "us.h"
 #include "arena.h"
 #include "env.h"
+#include "gc.h"
+#include "intern.h"
 #include "cell.h"
 
 #if !defined(MEM_DEBUG)
@@ -16,16 +19,18 @@ static char dumper[10*1024];
 #endif
 
 // These are special values that have a single unique instance
-static Cell cell_nil    = { CELL_NONE, {0} };
-static Cell cell_bool_t = { CELL_INT , {1} };
-static Cell cell_bool_f = { CELL_INT , {0} };
+static Cell cell_nil    = { CELL_NONE, 0, {0} };
+static Cell cell_bool_t = { CELL_INT , 0, {1} };
+static Cell cell_bool_f = { CELL_INT , 0, {0} };
 
 // Global references to the special values
 Cell* nil    = &cell_nil;
 Cell* bool_t = &cell_bool_t;
 Cell* bool_f = &cell_bool_f;
 
+static int cell_size(int tag);
 static Cell* cell_build(US* us, int tag);
+static Cell* cell_build_size(US* us, int tag, int size);
 static Cell* cell_create_string_value(US* us, const char* value, int len, int tag);
 static int get_str_len(const char* str, int len);
 static int cell_printer(const Cell* cell, int debug, char* buf);
@@ -33,12 +38,18 @@ static int cell_print_all(const Cell* cell, char* buf);
 
 void cell_destroy(US* us, Cell* cell)
 {
-    (void) us;
     LOG(DEBUG, ("CELL: destroying %p tag %d", cell, cell->tag));
     switch (cell->tag) {
         case CELL_STRING:
-        case CELL_SYMBOL:
-            MEM_FREE_SIZE(cell->sval, 0);
+            if (cell->sval != CELL_STRING_INLINE(cell)) {
+                arena_put_string(us->arena, cell->sval, cell->len + 1);
+            }
+            break;
+        case CELL_CODE:
+            MEM_FREE_SIZE(cell->code, cell->code->bytes);
+            break;
+        case CELL_EXEC:
+            MEM_FREE_SIZE(cell->exec, cell->exec->bytes);
             break;
         case CELL_CONS:
             break;
@@ -50,6 +61,9 @@ void cell_destroy(US* us, Cell* cell)
 
 Cell* cell_create_int(US* us, long value)
 {
+    if (value >= CELL_FIXNUM_MIN && value <= CELL_FIXNUM_MAX) {
+        return CELL_FIXNUM(value);
+    }
     Cell* cell = cell_build(us, CELL_INT);
     cell->ival = value;
     LOG(DEBUG, ("CELL: created %p [%s]", cell, cell_dump(cell, 1, dumper)));
@@ -121,19 +135,92 @@ Cell* cell_create_string(US* us, const char* value, int len)
     return cell;
 }
 
+// Only strings that do not fit in their cell are worth keeping in place.
+Cell* cell_create_string_in_place(US* us, char* value, int len)
+{
+    if (offsetof(Cell, hash) + len + 1 <= sizeof(Cell) ||
+        !arena_hold_image_string(us->arena, value)) {
+        return cell_create_string(us, len ? value : "", len);
+    }
+    Cell* cell = cell_build(us, CELL_STRING);
+    cell->sval = value;
+    cell->len = len;
+    cell->hash = intern_hash(value, len);
+    LOG(DEBUG, ("CELL: created in place %p [%s]", cell, cell_dump(cell, 1, dumper)));
+    return cell;
+}
+
 Cell* cell_create_symbol(US* us, const char* value, int len)
 {
-    Cell* cell = cell_create_string_value(us, value, len, CELL_SYMBOL);
-    LOG(DEBUG, ("CELL: created %p [%s]", cell, cell_dump(cell, 1, dumper)));
+    Cell* cell = intern_symbol(us->intern, value, len);
+    LOG(DEBUG, ("CELL: interned %p [%s]", cell, cell_dump(cell, 1, dumper)));
     return cell;
 }
 
-Cell* cell_create_procedure(US* us, Cell* params, Cell* body, Env* env)
+Cell* cell_create_procedure(US* us, Cell* lambda, Env* env)
 {
+    // lambda and env must survive getting a new cell
+    gc_push_cell(us->gc, &lambda);
+    gc_push_env(us->gc, &env);
     Cell* cell = cell_build(us, CELL_PROC);
-    cell->pval.params = params;
-    cell->pval.body = body;
+    gc_pop(us->gc, 2);
+    cell->pval.lambda = lambda;
     cell->pval.env = env;  // I love you, lexical binding
+    cell->pval.code = 0;
+    cell->pval.exec = 0;
+    LOG(DEBUG, ("CELL: created %p [%s]", cell, cell_dump(cell, 1, dumper)));
+    return cell;
+}
+
+Cell* cell_create_lambda(US* us, Cell* names, Cell* body, int arity, int size)
+{
+    // names and body must survive getting a new cell
+    gc_push_cell(us->gc, &names);
+    gc_push_cell(us->gc, &body);
+    Cell* cell = cell_build(us, CELL_LAMBDA);
+    gc_pop(us->gc, 2);
+    cell->lval.names = names;
+    cell->lval.body = body;
+    cell->lval.arity = arity;
+    cell->lval.size = size;
+    cell->lval.exec = 0;
+    LOG(DEBUG, ("CELL: created %p [%s]", cell, cell_dump(cell, 1, dumper)));
+    return cell;
+}
+
+Cell* cell_create_local(US* us, Cell* name, int depth, int slot)
+{
+    // name is an interned symbol, so it is never collected
+    Cell* cell = cell_build(us, CELL_LOCAL);
+    cell->loc.name = name;
+    cell->loc.depth = depth;
+    cell->loc.slot = slot;
+    LOG(DEBUG, ("CELL: created %p [%s]", cell, cell_dump(cell, 1, dumper)));
+    return cell;
+}
+
+Cell* cell_create_global(US* us, Symbol* sym)
+{
+    Cell* cell = cell_build(us, CELL_GLOBAL);
+    cell->gsym = sym;
+    LOG(DEBUG, ("CELL: created %p [%s]", cell, cell_dump(cell, 1, dumper)));
+    return cell;
+}
+
+Cell* cell_create_code(US* us, Code* code)
+{
+    // whatever code refers to must be kept alive by the caller until now
+    Cell* cell = cell_build(us, CELL_CODE);
+    cell->code = code;
+    LOG(DEBUG, ("CELL: created %p [%s]", cell, cell_dump(cell, 1, dumper)));
+    return cell;
+}
+
+Cell* cell_create_exec(US* us, ExecBlock* exec)
+{
+    // whatever exec refers to must be kept alive by the caller until now
+    Cell* cell = cell_build(us, CELL_EXEC);
+    cell->exec = exec;
     LOG(DEBUG, ("CELL: created %p [%s]", cell, cell_dump(cell, 1, dumper)));
     return cell;
 }
@@ -143,13 +230,28 @@ Cell* cell_create_native(US* us, const char* label, NativeFunc* func)
     Cell* cell = cell_build(us, CELL_NATIVE);
     cell->nval.label = label;
     cell->nval.func = func;
+    cell->nval.vfunc = 0;
+    LOG(DEBUG, ("CELL: created %p [%s]", cell, cell_dump(cell, 1, dumper)));
+    return cell;
+}
+
+Cell* cell_create_native_vec(US* us, const char* label, NativeVecFunc* vfunc)
+{
+    Cell* cell = cell_build(us, CELL_NATIVE);
+    cell->nval.label = label;
+    cell->nval.func = 0;
+    cell->nval.vfunc = vfunc;
     LOG(DEBUG, ("CELL: created %p [%s]", cell, cell_dump(cell, 1, dumper)));
     return cell;
 }
 
 Cell* cell_cons(US* us, Cell* car, Cell* cdr)
 {
+    // car and cdr must survive getting a new cell
+    gc_push_cell(us->gc, &car);
+    gc_push_cell(us->gc, &cdr);
     Cell* cell = cell_build(us, CELL_CONS);
+    gc_pop(us->gc, 2);
     cell->cons.car = car;
     cell->cons.cdr = cdr;
     LOG(DEBUG, ("CELL: created %p [%s]", cell, cell_dump(cell, 1, dumper)));
@@ -158,7 +260,7 @@ Cell* cell_cons(US* us, Cell* car, Cell* cdr)
 
 Cell* cell_car(Cell* cell)
 {
-    if (cell->tag != CELL_CONS) {
+    if (CELL_TAG(cell) != CELL_CONS) {
         return 0;
     }
     return cell->cons.car;
@@ -166,12 +268,18 @@ Cell* cell_car(Cell* cell)
 
 Cell* cell_cdr(Cell* cell)
 {
-    if (cell->tag != CELL_CONS) {
+    if (CELL_TAG(cell) != CELL_CONS) {
         return 0;
     }
     return cell->cons.cdr;
 }
 
+void cell_set_cdr(US* us, Cell* cell, Cell* cdr)
+{
+    cell->cons.cdr = cdr;
+    gc_write_cell(us, cell, cdr);
+}
+
 void cell_print(const Cell* cell, FILE* fp, int eol)
 {
     char buf[10 * 1024];
@@ -183,37 +291,94 @@ void cell_print(const Cell* cell, FILE* fp, int eol)
     fflush(fp);
 }
 
+int cell_compare_strings(const Cell* a, const Cell* b)
+{
+    int len = a->len < b->len ? a->len : b->len;
+    int cmp = memcmp(a->sval, b->sval, len);
+    if (cmp) {
+        return cmp;
+    }
+    return (a->len > b->len) - (a->len < b->len);
+}
+
+int cell_equal_strings(const Cell* a, const Cell* b)
+{
+    if (a->len != b->len) {
+        return 0;
+    }
+    if (a->sval != CELL_STRING_INLINE(a) && b->sval != CELL_STRING_INLINE(b) && a->hash != b->hash) {
+        return 0;
+    }
+    return memcmp(a->sval, b->sval, a->len) == 0;
+}
+
 const char* cell_dump(const Cell* cell, int debug, char* buf)
 {
     cell_printer(cell, debug, buf);
     return buf;
 }
 
+// How many bytes a cell with a given tag uses; only procedures, lambdas and
+// natives need a whole cell
+static int cell_size(int tag)
+{
+    switch (tag) {
+        case CELL_PROC:
+            return offsetof(Cell, pval) + sizeof(Procedure);
+        case CELL_NATIVE:
+            return offsetof(Cell, nval) + sizeof(Native);
+        case CELL_LAMBDA:
+            return offsetof(Cell, lval) + sizeof(Lambda);
+        default:
+            return offsetof(Cell, cons) + sizeof(Cons);
+    }
+}
+
 static Cell* cell_build(US* us, int tag)
 {
-    Cell* cell = arena_get_cell(us->arena, 0);
+    return cell_build_size(us, tag, cell_size(tag));
+}
+
+static Cell* cell_build_size(US* us, int tag, int size)
+{
+    Cell* cell = arena_get_cell(us->arena, size);
     cell->tag = tag;
     return cell;
 }
 
+// A string short enough to fit in the cell, right after sval, is kept there,
+// using whichever size class has room for it; longer ones come from the arena
+// string heap.
 static Cell* cell_create_string_value(US* us, const char* value, int len, int tag)
 {
-    Cell* cell = cell_build(us, tag);
     len = get_str_len(value, len);
-    MEM_ALLOC_SIZE(cell->sval, len + 1);
+    int size = offsetof(Cell, hash) + len + 1;
+    Cell* cell = 0;
+    if (size <= (int) sizeof(Cell)) {
+        cell = cell_build_size(us, tag, size);
+        cell->sval = CELL_STRING_INLINE(cell);
+    } else {
+        cell = cell_build(us, tag);
+        cell->sval = arena_get_string(us->arena, len + 1);
+    }
     if (value && len) {
         memcpy(cell->sval, value, len);
     }
     cell->sval[len] = '\0';
+    cell->len = len;
+    if (cell->sval != CELL_STRING_INLINE(cell)) {
+        // there is room for the hash, which makes most comparisons quick
+        cell->hash = intern_hash(cell->sval, len);
+    }
     return cell;
 }
 
 static int get_str_len(const char* str, int len)
 {
-    if (!str || str[0] == '\0') {
-        len = 0;
+    if (!str) {
+        return 0;
     }
-    if (len == 0 && str && str[0] != '\0') {
+    if (len <= 0) {
         len = strlen(str);
     }
     return len;
@@ -230,6 +395,11 @@ static int cell_printer(const Cell* cell, int debug, char* buf)
         "CONS",
         "PROC",
         "NATIVE",
+        "LAMBDA",
+        "LOCAL",
+        "GLOBAL",
+        "CODE",
+        "EXEC",
     };
     int pos = 0;
 
@@ -239,17 +409,18 @@ static int cell_printer(const Cell* cell, int debug, char* buf)
     if (!cell) {
         pos += sprintf(buf + pos, "NULL");
     } else {
+        int tag = CELL_TAG(cell);
         if (debug) {
             const char* str = "???";
-            if (cell->tag < CELL_LAST) {
-                str = Tag[cell->tag];
+            if (tag < CELL_LAST) {
+                str = Tag[tag];
             }
-            pos += sprintf(buf + pos, "%d:%s:%p", cell->tag, str, cell);
-            if (cell->tag != CELL_NONE) {
+            pos += sprintf(buf + pos, "%d:%s:%p", tag, str, cell);
+            if (tag != CELL_NONE) {
                 pos += sprintf(buf + pos, ":");
             }
         }
-        if (cell->tag != CELL_CONS) {
+        if (tag != CELL_CONS) {
             pos += cell_print_all(cell, buf + pos);
         } else {
             pos += sprintf(buf + pos, "(");
@@ -280,13 +451,13 @@ static int cell_print_all(const Cell* cell, char* buf)
         return pos;
     }
 
-    switch (cell->tag) {
+    switch (CELL_TAG(cell)) {
         case CELL_NONE:
             pos += sprintf(buf + pos, "%s", CELL_STR_NIL);
             break;
 
         case CELL_INT:
-            pos += sprintf(buf + pos, "%ld", cell->ival);
+            pos += sprintf(buf + pos, "%ld", CELL_IVAL(cell));
             break;
 
         case CELL_REAL:
@@ -305,11 +476,11 @@ static int cell_print_all(const Cell* cell, char* buf)
 #if 1
             pos += sprintf(buf + pos, "<%s>", "*CODE*");
 #else
-            const Procedure* proc = &cell->pval;
+            const Lambda* lambda = &cell->pval.lambda->lval;
             pos += sprintf(buf + pos, "(");
-            pos += cell_print_all(proc->params, buf + pos);
+            pos += cell_print_all(lambda->names, buf + pos);
             pos += sprintf(buf + pos, "):(");
-            pos += cell_print_all(proc->body, buf + pos);
+            pos += cell_print_all(lambda->body, buf + pos);
             pos += sprintf(buf + pos, ")");
 #endif
             break;
@@ -319,9 +490,29 @@ static int cell_print_all(const Cell* cell, char* buf)
             pos += sprintf(buf + pos, "<%s>", cell->nval.label);
             break;
 
+        case CELL_LAMBDA:
+            pos += sprintf(buf + pos, "<%s>", "*LAMBDA*");
+            break;
+
+        case CELL_LOCAL:
+            pos += sprintf(buf + pos, "%s", cell->loc.name->sval);
+            break;
+
+        case CELL_GLOBAL:
+            pos += sprintf(buf + pos, "%s", cell->gsym->name);
+            break;
+
+        case CELL_CODE:
+            pos += sprintf(buf + pos, "<%s>", "*BYTECODE*");
+            break;
+
+        case CELL_EXEC:
+            pos += sprintf(buf + pos, "<%s>", "*EXEC*");
+            break;
+
         case CELL_CONS: {
             const Cons* cons = &cell->cons;
-            if (cons->car->tag == CELL_CONS) {
+            if (CELL_TAG(cons->car) == CELL_CONS) {
                 pos += sprintf(buf + pos, "(");
                 pos += cell_print_all(cons->car, buf + pos);
                 pos += sprintf(buf + pos, ")");
@@ -331,7 +522,7 @@ static int cell_print_all(const Cell* cell, char* buf)
 
             if (cons->cdr == nil) {
                 // end of list, nothing more to do
-            } else if (cons->cdr->tag == CELL_CONS) {
+            } else if (CELL_TAG(cons->cdr) == CELL_CONS) {
                 pos += sprintf(buf + pos, " ");
                 pos += cell_print_all(cons->cdr, buf + pos);
             } else {
@@ -1,7 +1,9 @@
 #ifndef CELL_H_
 #define CELL_H_
 
-#include <stdio.h> // need this for FILE*
+#include <limits.h> // need this for LONG_MIN, LONG_MAX
+#include <stdint.h> // need this for uintptr_t
+#include <stdio.h>  // need this for FILE*
 
 // A Cell stores any possible value (integer, conses, others) using a union.
 
@@ -13,7 +15,27 @@
 #define CELL_CONS   5  // Cons cells (car and cdr)
 #define CELL_PROC   6  // Procedures (interpreted code)
 #define CELL_NATIVE 7  // Native functions (compiled code)
-#define CELL_LAST   8
+#define CELL_LAMBDA 8  // Lambda expressions, once resolved (see resolve.h)
+#define CELL_LOCAL  9  // References to local variables, once resolved
+#define CELL_GLOBAL 10 // References to global variables, once resolved
+#define CELL_CODE   11 // Compiled bytecode (see compile.h)
+#define CELL_EXEC   12 // Executors for a lambda body (see analyze.h)
+#define CELL_LAST   13
+
+// Small integers (fixnums) are not stored in cells at all, but right in the
+// Cell* pointer, shifted left one bit, with the lowest bit set; real cells are
+// always aligned, so their lowest bit is never set.  Creating a fixnum never
+// allocates; only integers too big for this get a cell.  Anything that may be
+// an integer must be looked at with CELL_TAG() and CELL_IVAL().
+#define CELL_FIXNUM_MIN (LONG_MIN >> 1)
+#define CELL_FIXNUM_MAX (LONG_MAX >> 1)
+
+#define CELL_IS_FIXNUM(c)    ((int) (((uintptr_t) (c)) & 1))
+#define CELL_FIXNUM(v)       ((Cell*) ((((uintptr_t) (v)) << 1) | 1))
+#define CELL_FIXNUM_VALUE(c) ((long) (((intptr_t) (c)) >> 1))
+
+#define CELL_TAG(c)  (CELL_IS_FIXNUM(c) ? CELL_INT : (c)->tag)
+#define CELL_IVAL(c) (CELL_IS_FIXNUM(c) ? CELL_FIXNUM_VALUE(c) : (c)->ival)
 
 // Printable forms of these special values
 #define CELL_STR_NIL    "()"
@@ -25,12 +47,12 @@
         (e).frst = 0; (e).last = 0; \
     } while (0)
 
-#define LIST_APPEND(e, c) \
+#define LIST_APPEND(us, e, c) \
     do { \
         Cell* x = c; \
         if (!((e)->frst)) (e)->frst = x; \
         if ((e)->last) { \
-            (e)->last->cons.cdr = x; \
+            cell_set_cdr(us, (e)->last, x); \
         } \
         (e)->last = x; \
     } while (0)
@@ -39,9 +61,13 @@
 struct US;
 struct Cell;
 struct Env;
+struct Symbol;
+struct Exec;
 
-// Function prototype for native implementation of procs
+// Function prototypes for native implementation of procs: they either get all
+// their args as a list, or as an array, which saves creating the list
 typedef struct Cell* (NativeFunc)(struct US* us, struct Cell* args);
+typedef struct Cell* (NativeVecFunc)(struct US* us, int argc, struct Cell** argv);
 
 // A cons cell; guess what these members are...
 typedef struct Cons {
@@ -49,32 +75,89 @@ typedef struct Cons {
     struct Cell* cdr;
 } Cons;
 
+// A lambda expression, once resolved; when called, it gets a frame with one
+// slot for each of its names: first its params, then its local defines
+typedef struct Lambda {
+    struct Cell* names; // list of symbols, one per slot
+    struct Cell* body;  // resolved body
+    int arity;          // how many of the names are params
+    int size;           // how many names there are
+    struct Cell* exec;  // its body analyzed into executors, once it was
+} Lambda;
+
+// A reference to a local variable: the frame it lives in, counting how many
+// frames up from the current one, and its slot in that frame
+typedef struct Local {
+    struct Cell* name;  // only for printing
+    int depth;
+    int slot;
+} Local;
+
+// Compiled bytecode, allocated as a single block: this header, then the array
+// of constants, then the ops
+typedef struct Code {
+    int bytes;              // size of the whole block
+    int size;               // how many bytes of ops there are
+    int count;              // how many constants there are
+    int stack;              // how deep the value stack can get
+    struct Cell* lambda;    // for a procedure body, its resolved lambda
+    struct Cell** consts;   // constants used by the ops
+    unsigned char* ops;     // the bytecode itself
+} Code;
+
+// The executors for a lambda body, allocated as a single block: this header,
+// then the executors, then the arrays of executors for the args of each call
+typedef struct ExecBlock {
+    int bytes;                  // size of the whole block
+    int count;                  // how many executors there are
+    struct Cell* lambda;        // the lambda, which keeps alive all cells used
+    const struct Exec* entry;   // the executor for the whole body
+} ExecBlock;
+
 // A procedure
 typedef struct Procedure {
-    struct Cell* params;
-    struct Cell* body;
+    struct Cell* lambda;    // a resolved lambda expression
     struct Env* env;
+    struct Cell* code;      // its body compiled to bytecode, if it ever was
+    struct Cell* exec;      // its body analyzed into executors, if it ever was
 } Procedure;
 
 // A native cell
 typedef struct Native {
     const char* label;
-    NativeFunc* func;
+    NativeFunc* func;       // one of these two is set
+    NativeVecFunc* vfunc;
 } Native;
 
 // Finally, definition of a cell
 typedef struct Cell {
     unsigned char tag;  // type of cell
+    int len;            // for strings and symbols, length of sval, not
+                        // counting the null always put after it; this sits
+                        // where there would be padding anyway
     union {
         long ival;      // an integer value
         double rval;    // a real value
-        char* sval;     // a string value (string or symbol)
+        struct {
+            char* sval;         // a string value (string or symbol)
+            unsigned long hash; // hash of sval, set when interned for symbols,
+                                // and when created for strings not kept inline
+        };
         Cons cons;      // a cons cell with car and cdr
         Procedure pval; // an interpreted (scheme) function
         Native nval;    // a native (C) function
+        Lambda lval;    // a resolved lambda expression
+        Local loc;      // a resolved reference to a local variable
+        struct Symbol* gsym; // a resolved reference to a global variable
+        Code* code;     // compiled bytecode
+        ExecBlock* exec;// executors for a lambda body
     };
 } Cell;
 
+// Short strings are kept right in their cell, starting where the hash would
+// be, since only symbols use it; sval then points there (see cell.c)
+#define CELL_STRING_INLINE(c) ((char*) &(c)->hash)
+
 // Let's just have a single global value for nil, #t and #f
 extern Cell* nil;
 extern Cell* bool_t;
@@ -83,7 +166,7 @@ extern Cell* bool_f;
 // Destroy a cell
 void cell_destroy(struct US* us, Cell* cell);
 
-// Create a cell with an integer value
+// Create a cell with an integer value; for a fixnum, this does not allocate
 Cell* cell_create_int(struct US* us, long value);
 Cell* cell_create_int_from_string(struct US* us, const char* value, int len);
 
@@ -91,17 +174,36 @@ Cell* cell_create_int_from_string(struct US* us, const char* value, int len);
 Cell* cell_create_real(struct US* us, double value);
 Cell* cell_create_real_from_string(struct US* us, const char* value, int len);
 
-// Create a cell with a string value
+// Create a cell with a string value; if len is zero, value must be
+// null-terminated, otherwise it may contain nulls
 Cell* cell_create_string(struct US* us, const char* value, int len);
 
-// Create a cell with a symbol value
+// Create a cell with a string value of len chars, followed by a null; if the
+// value lives in an arena image, it is used right there instead of copied
+Cell* cell_create_string_in_place(struct US* us, char* value, int len);
+
+// Get the (interned, unique) cell for a symbol value
 Cell* cell_create_symbol(struct US* us, const char* value, int len);
 
-// Create a cell with a procedure
-Cell* cell_create_procedure(struct US* us, Cell* params, Cell* body, struct Env* env);
+// Create a cell with a procedure, given a resolved lambda expression
+Cell* cell_create_procedure(struct US* us, Cell* lambda, struct Env* env);
+
+// Create cells for resolved code: a lambda expression, and references to
+// local and global variables
+Cell* cell_create_lambda(struct US* us, Cell* names, Cell* body, int arity, int size);
+Cell* cell_create_local(struct US* us, Cell* name, int depth, int slot);
+Cell* cell_create_global(struct US* us, struct Symbol* sym);
+
+// Create a cell that owns a block of compiled bytecode
+Cell* cell_create_code(struct US* us, Code* code);
 
-// Create a cell with a native function
+// Create a cell that owns a block of executors
+Cell* cell_create_exec(struct US* us, ExecBlock* exec);
+
+// Create a cell with a native function, which gets its args as a list, or as
+// an array
 Cell* cell_create_native(struct US* us, const char* label, NativeFunc* func);
+Cell* cell_create_native_vec(struct US* us, const char* label, NativeVecFunc* vfunc);
 
 // Implementation of cons
 Cell* cell_cons(struct US* us, Cell* car, Cell* cdr);
@@ -110,6 +212,17 @@ Cell* cell_cons(struct US* us, Cell* car, Cell* cdr);
 Cell* cell_car(Cell* cell);
 Cell* cell_cdr(Cell* cell);
 
+// Change the cdr of an existing cons cell
+void cell_set_cdr(struct US* us, Cell* cell, Cell* cdr);
+
+// Compare the contents of two string (or symbol) cells, like memcmp would; a
+// shorter string goes first when it is a prefix of the other one
+int cell_compare_strings(const Cell* a, const Cell* b);
+
+// Check whether two string (or symbol) cells have the same contents; this is
+// quick when their lengths, or their cached hashes, differ
+int cell_equal_strings(const Cell* a, const Cell* b);
+
 // Print contents of cell to given stream, optionally adding a \n
 void cell_print(const Cell* cell, FILE* fp, int eol);
 
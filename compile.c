@@ -0,0 +1,300 @@
+#include "us.h"
+#include "cell.h"
+#include "gc.h"
+#include "intern.h"
+#include "parser.h"
+#include "compile.h"
+
+#if !defined(MEM_DEBUG)
+#define MEM_DEBUG 0
+#endif
+#include "mem.h"
+
+// #define LOG_LEVEL LOG_LEVEL_DEBUG
+#include "log.h"
+
+// Initial number of bytes for the ops being compiled
+#define COMPILE_DEFAULT_OPS 64
+
+// Largest value for an operand
+#define COMPILE_MAX_OPERAND 0xffff
+
+// Everything we need while compiling one lambda body, or a top level
+// expression
+typedef struct Builder {
+    US* us;
+    unsigned char* ops;     // ops so far
+    int size;               // how many bytes of ops there are
+    int cap;                // how many bytes of ops were allocated
+    Expression consts;      // list of constants so far
+    int count;              // how many constants there are
+    int depth;              // current depth of the value stack
+    int stack;              // maximum depth of the value stack
+    int ok;                 // zero once something could not be compiled
+} Builder;
+
+static Cell* compile_body(US* us, Cell* cell, Cell* lambda);
+static void compile(Builder* b, Cell* cell, int tail);
+static void compile_if(Builder* b, Cell* cell, int tail);
+static void compile_set(Builder* b, Cell* cell, int create);
+static void compile_call(Builder* b, Cell* cell, int tail);
+static int add_const(Builder* b, Cell* cell);
+static void emit(Builder* b, int op, int depth);
+static void emit_operand(Builder* b, int value);
+static void reserve(Builder* b, int bytes);
+static void patch(Builder* b, int at, int value);
+static Cell* finish(Builder* b, Cell* lambda);
+
+Cell* cell_compile(US* us, Cell* cell)
+{
+    return compile_body(us, cell, 0);
+}
+
+Cell* cell_compile_lambda(US* us, Cell* lambda)
+{
+    return compile_body(us, lambda->lval.body, lambda);
+}
+
+static Cell* compile_body(US* us, Cell* cell, Cell* lambda)
+{
+    Builder b;
+    b.us = us;
+    b.cap = COMPILE_DEFAULT_OPS;
+    MEM_ALLOC_TYPE(b.ops, b.cap, unsigned char);
+    b.size = 0;
+    LIST_RESET(b.consts);
+    b.count = 0;
+    b.depth = 0;
+    b.stack = 0;
+    b.ok = 1;
+
+    // constants and lambda must survive compiling (and creating the code cell)
+    gc_push_cell(us->gc, &b.consts.frst);
+    gc_push_cell(us->gc, &lambda);
+    compile(&b, cell, 1);
+    emit(&b, OP_RETURN, -1);
+    Cell* code = b.ok ? finish(&b, lambda) : 0;
+    gc_pop(us->gc, 2);
+    MEM_FREE_TYPE(b.ops, b.cap, unsigned char);
+    LOG(DEBUG, ("COMPILE: %s, %d bytes, %d constants", code ? "compiled" : "could not compile", b.size, b.count));
+    return code;
+}
+
+static void compile(Builder* b, Cell* cell, int tail)
+{
+    switch (CELL_TAG(cell)) {
+        case CELL_LOCAL:
+            if (cell->loc.depth == 0) {
+                emit(b, OP_LOCAL0, +1);
+            } else {
+                emit(b, OP_LOCAL, +1);
+                emit_operand(b, cell->loc.depth);
+            }
+            emit_operand(b, cell->loc.slot);
+            return;
+
+        case CELL_GLOBAL:
+            emit(b, OP_GLOBAL, +1);
+            emit_operand(b, add_const(b, cell));
+            return;
+
+        case CELL_LAMBDA: {
+            Cell* code = cell_compile_lambda(b->us, cell);
+            if (!code) {
+                b->ok = 0;
+                return;
+            }
+            emit(b, OP_CLOSURE, +1);
+            emit_operand(b, add_const(b, code));
+            return;
+        }
+
+        case CELL_SYMBOL:
+            // not resolved, so it would have to be looked up by name
+            LOG(WARNING, ("COMPILE: cannot compile unresolved symbol [%s]", cell->sval));
+            b->ok = 0;
+            return;
+
+        case CELL_CONS:
+            break;
+
+        default:
+            // anything else is self-evaluating
+            emit(b, OP_CONST, +1);
+            emit_operand(b, add_const(b, cell));
+            return;
+    }
+
+    Cell* car = cell->cons.car;
+    if (car == sym_quote) {
+        Cell* rest = cell->cons.cdr;
+        emit(b, OP_CONST, +1);
+        emit_operand(b, add_const(b, CELL_TAG(rest) == CELL_CONS ? rest->cons.car : nil));
+        return;
+    }
+    if (car == sym_if) {
+        compile_if(b, cell, tail);
+        return;
+    }
+    if (car == sym_define || car == sym_set) {
+        compile_set(b, cell, car == sym_define);
+        return;
+    }
+    if (car == sym_lambda) {
+        // the resolver turns these into lambda cells, unless they are broken
+        b->ok = 0;
+        return;
+    }
+    compile_call(b, cell, tail);
+}
+
+static void compile_if(Builder* b, Cell* cell, int tail)
+{
+    Cell* args[4];
+    int n = 0;
+    for (Cell* c = cell; CELL_TAG(c) == CELL_CONS && n < 4; c = c->cons.cdr) {
+        args[n++] = c->cons.car;
+    }
+    if (n != 4) {
+        emit(b, OP_CONST, +1);
+        emit_operand(b, add_const(b, nil));
+        return;
+    }
+
+    compile(b, args[1], 0);
+    emit(b, OP_JUMP_UNLESS, -1);
+    int to_else = b->size;
+    emit_operand(b, 0);
+
+    int depth = b->depth;
+    compile(b, args[2], tail);
+    emit(b, OP_JUMP, 0);
+    int to_end = b->size;
+    emit_operand(b, 0);
+
+    b->depth = depth;
+    patch(b, to_else, b->size);
+    compile(b, args[3], tail);
+    patch(b, to_end, b->size);
+}
+
+static void compile_set(Builder* b, Cell* cell, int create)
+{
+    Cell* args[3];
+    int n = 0;
+    for (Cell* c = cell; CELL_TAG(c) == CELL_CONS && n < 3; c = c->cons.cdr) {
+        args[n++] = c->cons.car;
+    }
+    if (n != 3) {
+        emit(b, OP_CONST, +1);
+        emit_operand(b, add_const(b, nil));
+        return;
+    }
+
+    Cell* var = args[1];
+    if (CELL_TAG(var) != CELL_LOCAL && CELL_TAG(var) != CELL_GLOBAL) {
+        LOG(WARNING, ("COMPILE: cannot compile setting an unresolved variable"));
+        b->ok = 0;
+        return;
+    }
+    compile(b, args[2], 0);
+    if (CELL_TAG(var) == CELL_LOCAL) {
+        emit(b, OP_SET_LOCAL, 0);
+        emit_operand(b, var->loc.depth);
+        emit_operand(b, var->loc.slot);
+    } else {
+        emit(b, create ? OP_DEFINE_GLOBAL : OP_SET_GLOBAL, 0);
+        emit_operand(b, add_const(b, var));
+    }
+}
+
+static void compile_call(Builder* b, Cell* cell, int tail)
+{
+    int n = 0;
+    compile(b, cell->cons.car, 0);
+    for (Cell* a = cell->cons.cdr; CELL_TAG(a) == CELL_CONS; a = a->cons.cdr, ++n) {
+        compile(b, a->cons.car, 0);
+    }
+    emit(b, tail ? OP_TAIL_CALL : OP_CALL, -n);
+    emit_operand(b, n);
+}
+
+// Add a constant, and return its index
+static int add_const(Builder* b, Cell* cell)
+{
+    Cell* cons = cell_cons(b->us, cell, nil);
+    LIST_APPEND(b->us, &b->consts, cons);
+    return b->count++;
+}
+
+// Emit an op that changes the depth of the value stack by depth
+static void emit(Builder* b, int op, int depth)
+{
+    reserve(b, 1);
+    b->ops[b->size++] = op;
+    b->depth += depth;
+    if (b->stack < b->depth) {
+        b->stack = b->depth;
+    }
+}
+
+static void emit_operand(Builder* b, int value)
+{
+    if (value < 0 || value > COMPILE_MAX_OPERAND) {
+        LOG(WARNING, ("COMPILE: operand %d is too big", value));
+        b->ok = 0;
+        value = 0;
+    }
+    reserve(b, 2);
+    b->ops[b->size++] = value & 0xff;
+    b->ops[b->size++] = value >> 8;
+}
+
+// Make sure there is room for some more bytes of ops
+static void reserve(Builder* b, int bytes)
+{
+    if (b->size + bytes <= b->cap) {
+        return;
+    }
+    unsigned char* ops = 0;
+    MEM_ALLOC_TYPE(ops, b->cap * 2, unsigned char);
+    memcpy(ops, b->ops, b->size);
+    MEM_FREE_TYPE(b->ops, b->cap, unsigned char);
+    b->ops = ops;
+    b->cap *= 2;
+}
+
+// Set the operand at a given address, for a jump we now know where to go to
+static void patch(Builder* b, int at, int value)
+{
+    if (value > COMPILE_MAX_OPERAND) {
+        b->ok = 0;
+        return;
+    }
+    b->ops[at] = value & 0xff;
+    b->ops[at + 1] = value >> 8;
+}
+
+// Create the code cell, with all the ops and constants in a single block
+static Cell* finish(Builder* b, Cell* lambda)
+{
+    int bytes = sizeof(Code) + b->count * sizeof(Cell*) + b->size;
+    char* block = 0;
+    MEM_ALLOC_SIZE(block, bytes);
+    Code* code = (Code*) block;
+    code->bytes = bytes;
+    code->size = b->size;
+    code->count = b->count;
+    code->stack = b->stack;
+    code->lambda = lambda;
+    code->consts = (Cell**) (block + sizeof(Code));
+    code->ops = (unsigned char*) (code->consts + b->count);
+    int j = 0;
+    for (Cell* c = b->consts.frst; c && c != nil; c = c->cons.cdr) {
+        code->consts[j++] = c->cons.car;
+    }
+    memcpy(code->ops, b->ops, b->size);
+
+    // constants are still reachable from the builder while we do this
+    return cell_create_code(b->us, code);
+}
@@ -0,0 +1,38 @@
+#ifndef COMPILE_H_
+#define COMPILE_H_
+
+// Compiler from resolved expressions (see resolve.h) to bytecode for our VM
+// (see vm.h).  Each op is one byte, followed by its operands, each of them an
+// unsigned 16-bit number, stored little endian.  Each lambda gets its own
+// bytecode, compiled once along with the code that creates it; its bytecode
+// then runs in a frame, exactly like a resolved lambda does in cell_eval.
+
+// Define our structures
+struct US;
+struct Cell;
+
+// All the ops, with their operands
+#define OP_CONST         0  // k    push constant k
+#define OP_LOCAL0        1  // s    push slot s of the current frame
+#define OP_LOCAL         2  // d s  push slot s of the frame d levels up
+#define OP_GLOBAL        3  // k    push the value of global constant k
+#define OP_SET_LOCAL     4  // d s  set slot s of the frame d levels up to the top
+#define OP_SET_GLOBAL    5  // k    set global constant k to the top, if bound
+#define OP_DEFINE_GLOBAL 6  // k    set global constant k to the top
+#define OP_JUMP          7  // a    go on at address a
+#define OP_JUMP_UNLESS   8  // a    pop the top; go on at address a unless #t
+#define OP_CLOSURE       9  // k    push a procedure for code constant k
+#define OP_CALL         10  // n    call what is below the top n values, on them
+#define OP_TAIL_CALL    11  // n    same, in tail position: never comes back
+#define OP_RETURN       12  //      return the top
+#define OP_LAST         13
+
+// Compile a resolved expression, to be run at the top level; return a code
+// cell, or null if the expression cannot be compiled (and must then be
+// evaluated with cell_eval); the expression must be reachable by the GC
+struct Cell* cell_compile(struct US* us, struct Cell* cell);
+
+// Compile the body of a resolved lambda, just like above
+struct Cell* cell_compile_lambda(struct US* us, struct Cell* lambda);
+
+#endif
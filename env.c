@@ -17,8 +17,6 @@ static char dumper[10*1024];
 // It is a prime number below 1024.
 #define ENV_DEFAULT_SIZE 1021
 
-static unsigned long hash(const char* str);
-
 void env_destroy(Env* env)
 {
     LOG(INFO, ("ENV: destroying %p, %d buckets, parent %p", env, env->size, env->parent));
@@ -27,7 +25,6 @@ void env_destroy(Env* env)
             LOG(INFO, ("ENV: %5d: [%s] => [%s]\n", j, sym->name, cell_dump(sym->value, 1, dumper)));
             Symbol* tmp = sym;
             sym = sym->next;
-            MEM_FREE_SIZE(tmp->name, 0);
             MEM_FREE_TYPE(tmp, 1, Symbol);
         }
     }
@@ -58,32 +55,40 @@ void env_chain(Env* env, Env* parent)
     LOG(DEBUG, ("ENV: chained %p to parent %p", env, env->parent));
 }
 
-Symbol* env_lookup(Env* env, const char* name, int create)
+Symbol* env_lookup(Env* env, const Cell* name, int create)
+{
+    Env* owner = 0;
+    return env_lookup_owner(env, name, create, &owner);
+}
+
+Symbol* env_lookup_owner(Env* env, const Cell* name, int create, Env** owner)
 {
-    // Search for name in current env
-    int h = hash(name) % env->size;
+    // Search for name in current env, unless it is a frame
+    int h = env->table ? name->hash % env->size : 0;
     Symbol* sym = 0;
-    for (sym = env->table[h]; sym != 0; sym = sym->next) {
-        if (strcmp(name, sym->name) == 0) {
+    *owner = env;
+    for (sym = env->table ? env->table[h] : 0; sym != 0; sym = sym->next) {
+        if (sym->name == name->sval) {
             return sym;
         }
     }
 
     // Name not found, search for it up in the chain, but NEVER create it there
     if (env->parent) {
-        sym = env_lookup(env->parent, name, 0);
+        sym = env_lookup_owner(env->parent, name, 0, owner);
         if (sym) {
             return sym;
         }
+        *owner = env;
     }
 
     // Not found so far, maybe create it?
-    if (create) {
+    if (create && env->table) {
         MEM_ALLOC_TYPE(sym, 1, Symbol);
-        MEM_ALLOC_STRDUP(sym->name, name);
+        sym->name = name->sval;
         sym->next = env->table[h];
         env->table[h] = sym;
-        LOG(DEBUG, ("Created sym [%s]", name));
+        LOG(DEBUG, ("Created sym [%s]", name->sval));
     }
 
     // Return what we got, if anything
@@ -92,6 +97,14 @@ Symbol* env_lookup(Env* env, const char* name, int create)
 
 void env_dump(Env* env, FILE* fp)
 {
+    if (!env->table) {
+        fprintf(fp, "Frame %p, %d slots, parent %p\n", env, env->count, env->parent);
+        Cell* name = env->names;
+        for (int j = 0; j < env->count; ++j, name = name->cons.cdr) {
+            fprintf(fp, "%5d: [%s] => [%s]\n", j, name->cons.car->sval, cell_dump(env->slots[j], 1, dumper));
+        }
+        return;
+    }
     fprintf(fp, "Env %p, %d buckets, parent %p\n", env, env->size, env->parent);
     for (int j = 0; j < env->size; ++j) {
         for (Symbol* sym = env->table[j]; sym != 0; sym = sym->next) {
@@ -99,14 +112,3 @@ void env_dump(Env* env, FILE* fp)
         }
     }
 }
-
-// I've had nice results with djb2 by Dan Bernstein.
-static unsigned long hash(const char* str)
-{
-    unsigned long hash = 5381;
-    int c;
-    while ((c = *str++)) {
-        hash = ((hash << 5) + hash) + c; // hash * 33 + c
-    }
-    return hash;
-}
@@ -6,6 +6,19 @@
 // An environment is a hash table that stores associations of name => value.
 // It also can have a parent environment.
 // When names hash to the same bucket, use a singly linked list.
+// Names are always interned symbol cells (see intern.h), so they are compared
+// by address, and they are not owned by the environment; lookups start from
+// the hash already stored in the symbol cell.
+//
+// A procedure call instead gets a frame: an environment with no hash table,
+// just an array of slots, one for each name in the procedure's resolved
+// lambda (see resolve.h).  Resolved code reaches its variables by depth and
+// slot, and never by name; looking up a name skips over frames.  Small
+// frames keep their slots inline, so that most calls need no heap memory at
+// all; bigger ones use a separate array, which is kept when the env is reused.
+
+// Frames with up to this many slots keep them inline
+#define ENV_FRAME_SLOTS 4
 
 // Define our structures
 struct US;
@@ -14,16 +27,22 @@ struct Env;
 
 // An entry in the hash table
 typedef struct Symbol {
-    char* name;
+    const char* name;
     struct Cell* value;
     struct Symbol* next;
 } Symbol;
 
 // The environment itself:
 typedef struct Env {
-    Symbol** table;     // hash table buckets
+    Symbol** table;     // hash table buckets; null for a frame
     int size;           // size for hash table
     struct Env* parent; // pointer to (possible) parent environment
+    struct Cell** slots;// for a frame, the value in each slot: values or spill
+    struct Cell* names; // for a frame, list of the names for each slot
+    int count;          // for a frame, how many slots there are
+    int spill_size;     // how many slots fit in spill
+    struct Cell** spill;// slots for a frame too big for values
+    struct Cell* values[ENV_FRAME_SLOTS]; // slots for a small frame
 } Env;
 
 // Destroy an environment
@@ -35,11 +54,15 @@ Env* env_create(int size);
 // Chain an environment with a parent
 void env_chain(Env* env, Env* parent);
 
-// Search for a given name in the environment.
+// Search for a given name (an interned symbol cell) in the environment.
 // If not found, search up the chain of parents.
 // If not found anywhere and create is non-zero, create a new entry.
 // Return the Symbol (valid but possibly empty) associated with this name.
-Symbol* env_lookup(Env* env, const char* name, int create);
+Symbol* env_lookup(Env* env, const struct Cell* name, int create);
+
+// Same as env_lookup, but also set *owner to the environment where the
+// Symbol was found or created.
+Symbol* env_lookup_owner(Env* env, const struct Cell* name, int create, Env** owner);
 
 // Dump environmnet
 void env_dump(Env* env, FILE* fp);
@@ -3,83 +3,132 @@
 #include "arena.h"
 #include "cell.h"
 #include "env.h"
+#include "gc.h"
+#include "intern.h"
 #include "parser.h"
+#include "resolve.h"
+#include "analyze.h"
+#include "native.h"
 #include "eval.h"
 
+#if !defined(MEM_DEBUG)
+#define MEM_DEBUG 0
+#endif
+#include "mem.h"
+
 // #define LOG_LEVEL LOG_LEVEL_DEBUG
 #include "log.h"
 #if defined(LOG_LEVEL) && LOG_LEVEL <= LOG_LEVEL_DEBUG
 static char dumper[10*1024];
 #endif
 
-// special forms we need to recognize
-#define EVAL_QUOTE  "quote"
-#define EVAL_IF     "if"
-#define EVAL_DEFINE "define"
-#define EVAL_SET    "set!"
-#define EVAL_LAMBDA "lambda"
+// How many args a native call can keep on the C stack; calls with more than
+// this get them from the heap
+#define EVAL_MAX_STACK_ARGS 8
 
 static Cell* cell_quote(US* us, Cell* cell);  // no need for env
 static Cell* cell_symbol(US* us, Cell* cell, Env* env);
+static Cell* cell_local(US* us, Cell* cell, Env* env);
+static Cell* cell_global(US* us, Cell* cell);
 static Cell* cell_apply(US* us, Cell* cell, Env* env);
-static Cell* cell_apply_proc(US* us, Cell* cell, Env* env, Cell* proc);
+static Env* cell_apply_proc(US* us, Cell* cell, Env* env, Cell* proc);
 static Cell* cell_apply_native(US* us, Cell* cell, Env* env, Cell* proc);
 static Cell* cell_set_value(US* us, Cell* cell, Env* env, int create);
-static Cell* cell_if(US* us, Cell* cell, Env* env);
+static Cell* cell_if(US* us, Cell* cell, Env* env);  // returns a tail
 static Cell* cell_lambda(US* us, Cell* cell, Env* env);
 static int gather_args(Cell* cell, int wanted, Cell* args[]);
+static Env* frame_at(Env* env, int depth);
 
+// This is a loop, not just a recursion: when the value of an expression is
+// the value of an if branch, in tail position, we go on with that one right
+// here, without growing the C stack.  Procedure bodies run as executors (see
+// analyze.h), which do the same for their own tail calls.
 Cell* cell_eval(US* us, Cell* cell, Env* env)
 {
-    if (cell->tag == CELL_SYMBOL) {
-        // a symbol => get it from the environment
-        return cell_symbol(us, cell, env);
-    }
+    Cell* ret = 0;
+    while (!ret) {
+        if (CELL_IS_FIXNUM(cell)) {
+            // a small integer => self-evaluating, and not even a cell
+            ret = cell;
+            break;
+        }
 
-    if (cell->tag != CELL_CONS) {
-        // anything not a cons => self-evaluating
-        return cell;
-    }
+        if (cell->tag == CELL_LOCAL) {
+            // a local variable => get it straight from its frame
+            ret = cell_local(us, cell, env);
+            break;
+        }
+
+        if (cell->tag == CELL_GLOBAL) {
+            // a global variable => get it straight from its symbol
+            ret = cell_global(us, cell);
+            break;
+        }
+
+        if (cell->tag == CELL_LAMBDA) {
+            // This is where lexical scope happens: we keep the environment
+            // that was extant at the time of the lambda *creation*, as opposed
+            // to its *usage* (the latter would be dynamic scope).
+            ret = exec_create_procedure(us, cell, env);
+            break;
+        }
 
-    // we know for sure we have a cons cell
-    Cell* car = cell->cons.car;
-    LOG(DEBUG, ("EVAL: evaluating a cons cell, car is %s", cell_dump(car, 1, dumper)));
+        if (cell->tag == CELL_SYMBOL) {
+            // a symbol that was not resolved => look it up by name
+            ret = cell_symbol(us, cell, env);
+            break;
+        }
+
+        if (cell->tag != CELL_CONS) {
+            // anything not a cons => self-evaluating
+            ret = cell;
+            break;
+        }
 
-    // is it a special form?
-    if (car->tag == CELL_SYMBOL) {
-        if (strcmp(car->sval, EVAL_QUOTE) == 0) {
+        // we know for sure we have a cons cell
+        Cell* car = cell->cons.car;
+        LOG(DEBUG, ("EVAL: evaluating a cons cell, car is %s", cell_dump(car, 1, dumper)));
+
+        // is it a special form?  symbols are interned, so just compare them
+        if (car == sym_quote) {
             // a quote special form
-            return cell_quote(us, cell);
+            ret = cell_quote(us, cell);
+            break;
         }
-        if (strcmp(car->sval, EVAL_DEFINE) == 0) {
+        if (car == sym_define) {
             // a define special form
-            return cell_set_value(us, cell, env, 1);
+            ret = cell_set_value(us, cell, env, 1);
+            break;
         }
-        if (strcmp(car->sval, EVAL_SET) == 0) {
+        if (car == sym_set) {
             // a set! special form
-            return cell_set_value(us, cell, env, 0);
+            ret = cell_set_value(us, cell, env, 0);
+            break;
         }
-        if (strcmp(car->sval, EVAL_IF) == 0) {
-            // an if special form
-            return cell_if(us, cell, env);
+        if (car == sym_if) {
+            // an if special form; go on with the branch it picked
+            cell = cell_if(us, cell, env);
+            continue;
         }
-        if (strcmp(car->sval, EVAL_LAMBDA) == 0 ) {
+        if (car == sym_lambda) {
             // a lambda special form
-            return cell_lambda(us, cell, env);
+            ret = cell_lambda(us, cell, env);
+            break;
         }
-    }
 
-    // treat the cell as a function invocation
-    return cell_apply(us, cell, env);
+        // treat the cell as a function invocation
+        ret = cell_apply(us, cell, env);
+    }
+    return ret;
 }
 
-// Eval a symbol cell
+// Eval a symbol cell; this only ever finds names in environments, not frames
 static Cell* cell_symbol(US* us, Cell* cell, Env* env)
 {
     (void) us;
     Cell* ret = nil;
     LOG(DEBUG, ("EVAL: looking up symbol [%s] in env %p", cell->sval, env));
-    Symbol* sym = env_lookup(env, cell->sval, 0);
+    Symbol* sym = env_lookup(env, cell, 0);
     if (sym) {
         ret = sym->value;
     }
@@ -87,6 +136,25 @@ static Cell* cell_symbol(US* us, Cell* cell, Env* env)
     return ret;
 }
 
+// Eval a reference to a local variable
+static Cell* cell_local(US* us, Cell* cell, Env* env)
+{
+    (void) us;
+    Env* frame = frame_at(env, cell->loc.depth);
+    Cell* ret = frame->slots[cell->loc.slot];
+    LOG(DEBUG, ("EVAL: local [%s] at %d:%d => %s", cell->loc.name->sval, cell->loc.depth, cell->loc.slot, cell_dump(ret, 1, dumper)));
+    return ret ? ret : nil;
+}
+
+// Eval a reference to a global variable
+static Cell* cell_global(US* us, Cell* cell)
+{
+    (void) us;
+    Cell* ret = cell->gsym->value;
+    LOG(DEBUG, ("EVAL: global [%s] => %s", cell->gsym->name, cell_dump(ret, 1, dumper)));
+    return ret ? ret : nil;
+}
+
 // Execute a quote special form
 static Cell* cell_quote(US* us, Cell* cell)
 {
@@ -106,15 +174,22 @@ static Cell* cell_apply(US* us, Cell* cell, Env* env)
     Cell* ret = 0;
     Cell* proc = cell_eval(us, cell->cons.car, env);
     if (proc) {
-        switch (proc->tag) {
-            case CELL_PROC:
-                ret = cell_apply_proc(us, cell, env, proc);
+        // proc must survive evaluating its args
+        gc_push_cell(us->gc, &proc);
+        switch (CELL_TAG(proc)) {
+            case CELL_PROC: {
+                Env* local = cell_apply_proc(us, cell, env, proc);
+                if (local) {
+                    ret = exec_run(us, proc, local);
+                }
                 break;
+            }
 
             case CELL_NATIVE:
                 ret = cell_apply_native(us, cell, env, proc);
                 break;
         }
+        gc_pop(us->gc, 1);
     }
     if (!ret) {
         ret = nil;
@@ -122,99 +197,81 @@ static Cell* cell_apply(US* us, Cell* cell, Env* env)
     return ret;
 }
 
-static Cell* cell_apply_proc(US* us, Cell* cell, Env* env, Cell* proc)
+// Create the frame for a procedure call, with all args bound; return null if
+// something went wrong
+static Env* cell_apply_proc(US* us, Cell* cell, Env* env, Cell* proc)
 {
-    int pos = 0;
-    Cell* p = 0; // pointer to current parameter
+    const Lambda* lambda = &proc->pval.lambda->lval;
     Cell* a = 0; // pointer to current argument
-    Cell* ret = 0;
-
-    // count how many arguments we have
-    for (p = proc->pval.params, a = cell->cons.cdr, pos = 0;
-         p && p != nil && a && a != nil;
-         p = p->cons.cdr, a = a->cons.cdr, ++pos) {
-    }
 
-    // We create a new small-ish environment where we can bind all evaled args
-    // in fresh slots for the params (see *COMMENT* below)
-    Env* local = arena_get_env(us->arena, pos + 1);
-    LOG(DEBUG, ("EVAL: proc with %d args: %s", pos, cell_dump(proc, 1, dumper)));
+    // We create a new frame, with a slot for each of the lambda's names, and
+    // bind all evaled args to the slots for the params (see *COMMENT* below);
+    // any other slots stay unbound until something defines them
+    Env* local = arena_get_frame(us->arena, lambda->names, lambda->size);
+    gc_push_env(us->gc, &local);
+    LOG(DEBUG, ("EVAL: proc with %d params, %d slots: %s", lambda->arity, lambda->size, cell_dump(proc, 1, dumper)));
     LOG(DEBUG, ("EVAL: proc on: %s", cell_dump(cell, 1, dumper)));
     int ok = 1;
-    for (p = proc->pval.params, a = cell->cons.cdr, pos= 0;
-         p && p != nil && a && a != nil;
-         p = p->cons.cdr, a = a->cons.cdr, ++pos) {
-        Cell* par = p->cons.car;
-        if (!par) {
-            LOG(ERROR, ("Could not get parameter #%d", pos));
-            ok = 0;
-            break;
-        }
-        LOG(DEBUG, ("Got parameter #%d: %s", pos, cell_dump(par, 1, dumper)));
+    int pos = 0;
+    for (a = cell->cons.cdr;
+         pos < lambda->arity && a && a != nil;
+         a = a->cons.cdr, ++pos) {
         // we eval each arg in the caller's environment
         Cell* arg = cell_eval(us, a->cons.car, env);
         if (!arg) {
-            LOG(ERROR, ("Could not evaluate arg #%d [%s]", pos, par->sval));
-            ok = 0;
-            break;
-        }
-        LOG(DEBUG, ("Evaluated arg #%d [%s]", pos, par->sval));
-        // now we create a symbol with the correct name=value association
-        Symbol* sym = env_lookup(local, par->sval, 1);
-        if (!sym) {
-            LOG(ERROR, ("Could not create binding for arg #%d [%s]", pos, par->sval));
+            LOG(ERROR, ("Could not evaluate arg #%d", pos));
             ok = 0;
             break;
         }
-        sym->value = arg;
-        LOG(DEBUG, ("Proc, setting arg #%d [%s] to %s", pos, par->sval, cell_dump(arg, 1, dumper)));
+        local->slots[pos] = arg;
+        gc_write_env(us, local, arg);
+        LOG(DEBUG, ("Proc, setting arg #%d to %s", pos, cell_dump(arg, 1, dumper)));
     }
     // *COMMENT* only *now* we chain our local env with its parent, which is
     // the env that we captured when the lamdba was created.
-    env_chain(local, proc->pval.env);
+    gc_chain_env(us, local, proc->pval.env);
+    gc_pop(us->gc, 1);
 
-    if (ok) {
-        // finally eval the proc body in this newly created env
-        ret = cell_eval(us, proc->pval.body, local);
-    }
-    if (!ret) {
-        ret = nil;
-    }
-    return ret;
+    // the caller will run the proc body in this newly created env
+    return ok ? local : 0;
 }
 
 static Cell* cell_apply_native(US* us, Cell* cell, Env* env, Cell* proc)
 {
-    // We create a new list with all evaled args
-    Cell* a = 0; // pointer to current argument
-    Expression exp;
-    LIST_RESET(exp);
-    Cell* ret = 0;
+    // We evaluate all args into an array, on the C stack unless there are
+    // too many of them
+    Cell* stack[EVAL_MAX_STACK_ARGS];
+    Cell** argv = stack;
+    int size = 0;
+    for (Cell* a = cell->cons.cdr; a && a != nil; a = a->cons.cdr) {
+        ++size;
+    }
+    if (size > EVAL_MAX_STACK_ARGS) {
+        MEM_ALLOC_TYPE(argv, size, Cell*);
+    }
     LOG(DEBUG, ("EVAL: native [%s] on %s", proc->nval.label, cell_dump(cell, 1, dumper)));
-    int pos = 0;
+
+    // the args we already have must survive evaluating the others
+    int argc = 0;
+    gc_push_cells(us->gc, &argv, &argc);
     int ok = 1;
-    for (a = cell->cons.cdr;
-         a && a != nil;
-         a = a->cons.cdr, ++pos) {
+    for (Cell* a = cell->cons.cdr; a && a != nil; a = a->cons.cdr) {
         // we eval each arg in the caller's environment
         Cell* arg = cell_eval(us, a->cons.car, env);
         if (!arg) {
-            LOG(ERROR, ("Native, could not evaluate arg #%d for [%s]", pos, proc->nval.label));
+            LOG(ERROR, ("Native, could not evaluate arg #%d for [%s]", argc, proc->nval.label));
             ok = 0;
             break;
         }
-        Cell* cons = cell_cons(us, arg, nil);
-        LIST_APPEND(&exp, cons);
-        LOG(DEBUG, ("Native, arg #%d for [%s] is %s", pos, proc->nval.label, cell_dump(arg, 1, dumper)));
+        LOG(DEBUG, ("Native, arg #%d for [%s] is %s", argc, proc->nval.label, cell_dump(arg, 1, dumper)));
+        argv[argc++] = arg;
     }
 
     // finally eval the proc function with its args
-    if (ok) {
-        LOG(DEBUG, ("Native, calling with args %s", cell_dump(exp.frst, 1, dumper)));
-        ret = proc->nval.func(us, exp.frst);
-    }
-    if (!ret) {
-        ret = nil;
+    Cell* ret = ok ? native_apply(us, proc, argc, argv) : nil;
+    gc_pop(us->gc, 1);
+    if (argv != stack) {
+        MEM_FREE_TYPE(argv, size, Cell*);
     }
     return ret;
 }
@@ -225,14 +282,37 @@ static Cell* cell_set_value(US* us, Cell* cell, Env* env, int create)
 {
     Cell* ret = 0;
     Cell* args[3];
-    if (gather_args(cell, 3, args)) {
+    if (!gather_args(cell, 3, args)) {
+        return nil;
+    }
+    if (CELL_TAG(args[1]) == CELL_LOCAL) {
+        // the resolver already made room for this in a frame
+        Env* frame = frame_at(env, args[1]->loc.depth);
+        ret = cell_eval(us, args[2], env);
+        frame->slots[args[1]->loc.slot] = ret;
+        gc_write_env(us, frame, ret);
+        LOG(DEBUG, ("Setting local [%s] to %s", args[1]->loc.name->sval, cell_dump(ret, 1, dumper)));
+    } else if (CELL_TAG(args[1]) == CELL_GLOBAL) {
+        // the resolver already created the symbol, but it may be unbound
+        Symbol* sym = args[1]->gsym;
+        if (!create && !sym->value) {
+            LOG(ERROR, ("EVAL: symbol [%s] not found", sym->name));
+        } else {
+            ret = cell_eval(us, args[2], env);
+            sym->value = ret;
+            gc_write_env(us, us->env, ret);
+            LOG(DEBUG, ("Setting global [%s] to %s", sym->name, cell_dump(ret, 1, dumper)));
+        }
+    } else if (CELL_TAG(args[1]) == CELL_SYMBOL) {
         LOG(DEBUG, ("EVAL: %s value for [%s] to %s", create ? "define" : "set", args[1]->sval, cell_dump(args[2], 1, dumper)));
-        Symbol* sym = env_lookup(env, args[1]->sval, create);
+        Env* owner = 0;
+        Symbol* sym = env_lookup_owner(env, args[1], create, &owner);
         if (!sym) {
             LOG(ERROR, ("EVAL: symbol [%s] not found", args[1]->sval));
         } else {
             ret = cell_eval(us, args[2], env);
             sym->value = ret;
+            gc_write_env(us, owner, ret);
             LOG(DEBUG, ("Setting value [%s] to %s", args[1]->sval, cell_dump(ret, 1, dumper)));
         }
     }
@@ -242,7 +322,8 @@ static Cell* cell_set_value(US* us, Cell* cell, Env* env, int create)
     return ret;
 }
 
-// Execute an if special form
+// Execute an if special form, up to picking a branch; return the branch, which
+// the caller must then eval (it is in tail position)
 static Cell* cell_if(US* us, Cell* cell, Env* env)
 {
     Cell* ret = 0;
@@ -253,8 +334,7 @@ static Cell* cell_if(US* us, Cell* cell, Env* env)
         LOG(DEBUG, ("EVAL: if : %s", cell_dump(args[3], 1, dumper)));
 
         Cell* tst = cell_eval(us, args[1], env);
-        ret = cell_eval(us, tst == bool_t ? args[2] : args[3], env);
-        LOG(DEBUG, ("EVAL: if => %s", cell_dump(ret, 1, dumper)));
+        ret = tst == bool_t ? args[2] : args[3];
     }
     if (!ret) {
         ret = nil;
@@ -262,7 +342,8 @@ static Cell* cell_if(US* us, Cell* cell, Env* env)
     return ret;
 }
 
-// Execute a lambda special form
+// Execute a lambda special form that was not resolved; it can then only see
+// its own params and globals
 static Cell* cell_lambda(US* us, Cell* cell, Env* env)
 {
     Cell* ret = 0;
@@ -270,11 +351,10 @@ static Cell* cell_lambda(US* us, Cell* cell, Env* env)
     if (gather_args(cell, 3, args)) {
         LOG(DEBUG, ("EVAL: lambda args %s", cell_dump(args[1], 1, dumper)));
         LOG(DEBUG, ("EVAL: lambda body %s", cell_dump(args[2], 1, dumper)));
-
-        // This is where lexical scope happens: we keep the environment that
-        // was extant at the time of the lambda *creation*, as opposed to its
-        // *usage* (the latter would be dynamic scope).
-        ret = cell_create_procedure(us, args[1], args[2], env);
+        Cell* lambda = cell_resolve(us, cell);
+        if (lambda->tag == CELL_LAMBDA) {
+            ret = exec_create_procedure(us, lambda, env);
+        }
     }
     if (!ret) {
         ret = nil;
@@ -294,3 +374,12 @@ static int gather_args(Cell* cell, int wanted, Cell* args[])
     }
     return pos == wanted;
 }
+
+// Get the frame a given number of levels up from env
+static Env* frame_at(Env* env, int depth)
+{
+    for (; depth > 0; --depth) {
+        env = env->parent;
+    }
+    return env;
+}
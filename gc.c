@@ -0,0 +1,511 @@
+#include <strings.h>
+#include "arena.h"
+#include "cell.h"
+#include "env.h"
+#include "timer.h"
+#include "us.h"
+#include "gc.h"
+
+#if !defined(MEM_DEBUG)
+#define MEM_DEBUG 0
+#endif
+#include "mem.h"
+
+// #define LOG_LEVEL LOG_LEVEL_DEBUG
+#include "log.h"
+
+// Initial number of roots we have space for
+#define GC_DEFAULT_ROOTS 64
+
+// Default policy for collecting on our own
+#define GC_DEFAULT_GROWTH    2.0
+#define GC_DEFAULT_MIN_POOLS 64
+
+// Initial number of pending cells/envs we have space for while marking
+#define GC_DEFAULT_MARKS 1024
+
+// Possible types for a root, and for a pending object when marking
+#define ROOT_CELL 0
+#define ROOT_ENV  1
+
+static void gc_push(GC* gc, void** ptr, int type, int* count);
+static void mark_push(GC* gc, void* ptr, int type);
+static void mark_roots(US* us);
+static void mark_dirty(US* us);
+static int mark_drain(US* us, long budget);
+static long mark_cell(US* us, const Cell* cell, long budget);
+static long mark_env(US* us, Env* env, long budget);
+static void mark_symbols(US* us, Env* env);
+static void incremental_start(US* us);
+static void incremental_stop(US* us);
+static int step(void* data);
+static void schedule(GC* gc);
+static long pause(GC* gc, long t0);
+static void collected(US* us, GCStats* stats);
+
+GC* gc_create(void)
+{
+    GC* gc = 0;
+    MEM_ALLOC_TYPE(gc, 1, GC);
+    gc->root_size = GC_DEFAULT_ROOTS;
+    MEM_ALLOC_TYPE(gc->roots, gc->root_size, Root);
+    gc->mark_size = GC_DEFAULT_MARKS;
+    MEM_ALLOC_TYPE(gc->marks, gc->mark_size, Mark);
+    gc_set_policy(gc, GC_DEFAULT_GROWTH, GC_DEFAULT_MIN_POOLS);
+    LOG(INFO, ("GC: created %p", gc));
+    return gc;
+}
+
+void gc_destroy(GC* gc)
+{
+    LOG(INFO, ("GC: destroying %p, %d roots still in use", gc, gc->root_used));
+    MEM_FREE_TYPE(gc->roots, gc->root_size, Root);
+    MEM_FREE_TYPE(gc->marks, gc->mark_size, Mark);
+    MEM_FREE_TYPE(gc, 1, GC);
+}
+
+void gc_push_cell(GC* gc, Cell** cell)
+{
+    gc_push(gc, (void**) cell, ROOT_CELL, 0);
+}
+
+void gc_push_env(GC* gc, Env** env)
+{
+    gc_push(gc, (void**) env, ROOT_ENV, 0);
+}
+
+void gc_push_cells(GC* gc, Cell*** cells, int* count)
+{
+    gc_push(gc, (void**) cells, ROOT_CELL, count);
+}
+
+void gc_push_envs(GC* gc, Env*** envs, int* count)
+{
+    gc_push(gc, (void**) envs, ROOT_ENV, count);
+}
+
+void gc_pop(GC* gc, int count)
+{
+    if (count > gc->root_used) {
+        LOG(ERROR, ("GC: popping %d roots but only %d in use", count, gc->root_used));
+        count = gc->root_used;
+    }
+    gc->root_used -= count;
+}
+
+void gc_set_policy(GC* gc, double growth, int min_pools)
+{
+    gc->growth = growth < 1.0 ? 1.0 : growth;
+    gc->min_pools = min_pools < 0 ? 0 : min_pools;
+    if (gc->collect_at < gc->min_pools) {
+        gc->collect_at = gc->min_pools;
+    }
+    LOG(INFO, ("GC: policy set to growth %.2f, min %d pools", gc->growth, gc->min_pools));
+}
+
+void gc_set_incremental(US* us, int slice)
+{
+    us->gc->slice = slice < 0 ? 0 : slice;
+    LOG(INFO, ("GC: incremental slice set to %d", us->gc->slice));
+}
+
+// While marking incrementally, the stored value turns gray: that way no black
+// cell/env ever points to a white one.
+void gc_write_cell(US* us, Cell* cell, Cell* value)
+{
+    arena_remember_cell(us->arena, cell);
+    if (us->gc->phase == GC_PHASE_MARK) {
+        mark_push(us->gc, value, ROOT_CELL);
+    }
+}
+
+void gc_write_env(US* us, Env* env, Cell* value)
+{
+    arena_remember_env(us->arena, env);
+    if (us->gc->phase == GC_PHASE_MARK) {
+        mark_push(us->gc, value, ROOT_CELL);
+    }
+}
+
+// No need to remember env: if it is old, some collection happened after
+// creating it, and that made the (reachable) parent old as well.
+void gc_chain_env(US* us, Env* env, Env* parent)
+{
+    env_chain(env, parent);
+    if (us->gc->phase == GC_PHASE_MARK) {
+        mark_push(us->gc, parent, ROOT_ENV);
+    }
+}
+
+// The nursery gets room of its own on top of the old heap, so that filling it
+// up does not trigger a major collection.
+int gc_maybe_collect(US* us)
+{
+    GC* gc = us->gc;
+    Arena* arena = us->arena;
+    if (gc->phase != GC_PHASE_NONE) {
+        // the arena grows until the incremental collection is done
+        return 0;
+    }
+    int room = arena->nursery / ARENA_POOL_SIZE;
+    if (arena->cell_pools + arena->env_pools >= gc->collect_at + room) {
+        if (gc->slice) {
+            incremental_start(us);
+            return 0;
+        }
+        gc_collect(us, 0);
+        return 1;
+    }
+    if (arena->nursery && arena->young >= arena->nursery) {
+        gc_collect_minor(us, 0);
+        return 1;
+    }
+    return 0;
+}
+
+int gc_collect(US* us, GCStats* stats)
+{
+    GCStats* last = &us->gc->last;
+    long t0 = timer_now_us();
+    incremental_stop(us);
+    arena_clear_marks(us->arena);
+    mark_roots(us);
+    mark_drain(us, 0);
+    arena_sweep(us->arena, last);
+    ++us->gc->collections;
+    schedule(us->gc);
+
+    last->pause_us = pause(us->gc, t0);
+    collected(us, stats);
+    return last->freed_cells;
+}
+
+// Old cells/envs already have their mark set, so marking stops as soon as it
+// reaches one of them; the only way to get from an old cell/env to a young one
+// is through a dirty slot.  An incremental collection under way needs the
+// marks, so then we collect everything instead.
+int gc_collect_minor(US* us, GCStats* stats)
+{
+    if (us->gc->phase != GC_PHASE_NONE) {
+        return gc_collect(us, stats);
+    }
+
+    GCStats* last = &us->gc->last;
+    long t0 = timer_now_us();
+    arena_mark_old(us->arena);
+    mark_roots(us);
+    mark_dirty(us);
+    mark_drain(us, 0);
+    arena_sweep_young(us->arena, last);
+    ++us->gc->minors;
+
+    last->pause_us = pause(us->gc, t0);
+    collected(us, stats);
+    return last->freed_cells;
+}
+
+void gc_step(US* us)
+{
+    GC* gc = us->gc;
+    long t0 = timer_now_us();
+    int done = 0;
+    switch (gc->phase) {
+        case GC_PHASE_MARK:
+            if (mark_drain(us, gc->slice)) {
+                break;
+            }
+            // nothing gray is left; look at the roots again, and this time
+            // finish marking in one go
+            mark_roots(us);
+            mark_drain(us, 0);
+            arena_sweep_begin(us->arena, &gc->last);
+            gc->phase = GC_PHASE_SWEEP;
+            break;
+
+        case GC_PHASE_SWEEP:
+            if (arena_sweep_some(us->arena, 1 + gc->slice / ARENA_POOL_SIZE, &gc->last)) {
+                break;
+            }
+            incremental_stop(us);
+            ++gc->collections;
+            schedule(gc);
+            done = 1;
+            break;
+
+        default:
+            return;
+    }
+    gc->cycle_us += pause(gc, t0);
+    if (done) {
+        gc->last.pause_us = gc->cycle_us;
+        collected(us, 0);
+    }
+}
+
+static void gc_push(GC* gc, void** ptr, int type, int* count)
+{
+    if (gc->root_used >= gc->root_size) {
+        Root* roots = gc->roots;
+        int size = gc->root_size;
+        gc->root_size *= 2;
+        MEM_ALLOC_TYPE(gc->roots, gc->root_size, Root);
+        memcpy(gc->roots, roots, size * sizeof(Root));
+        MEM_FREE_TYPE(roots, size, Root);
+    }
+    Root* root = &gc->roots[gc->root_used++];
+    root->ptr = ptr;
+    root->type = type;
+    root->count = count;
+}
+
+// Remember a cell/env that must be marked, unless it is null
+static void mark_push(GC* gc, void* ptr, int type)
+{
+    // fixnums are not cells, so there is nothing to mark
+    if (!ptr || (type == ROOT_CELL && CELL_IS_FIXNUM(ptr))) {
+        return;
+    }
+    if (gc->mark_used >= gc->mark_size) {
+        Mark* marks = gc->marks;
+        int size = gc->mark_size;
+        gc->mark_size *= 2;
+        MEM_ALLOC_TYPE(gc->marks, gc->mark_size, Mark);
+        memcpy(gc->marks, marks, size * sizeof(Mark));
+        MEM_FREE_TYPE(marks, size, Mark);
+    }
+    Mark* mark = &gc->marks[gc->mark_used++];
+    mark->ptr = ptr;
+    mark->type = type;
+}
+
+// Start an incremental collection: from now on, every allocation does some
+// marking; everything allocated meanwhile starts white.
+static void incremental_start(US* us)
+{
+    GC* gc = us->gc;
+    long t0 = timer_now_us();
+    arena_clear_marks(us->arena);
+    gc->mark_used = 0;
+    mark_roots(us);
+    gc->phase = GC_PHASE_MARK;
+    us->arena->step = step;
+    gc->cycle_us = pause(gc, t0);
+    LOG(DEBUG, ("GC: incremental collection started, %d pending", gc->mark_used));
+}
+
+// Forget about any incremental collection under way; if it was sweeping, the
+// caller must sweep everything
+static void incremental_stop(US* us)
+{
+    us->gc->phase = GC_PHASE_NONE;
+    us->gc->mark_used = 0;
+    us->arena->step = 0;
+}
+
+// Called by the arena on every allocation during an incremental collection
+static int step(void* data)
+{
+    gc_step((US*) data);
+    return 0;
+}
+
+// After a major collection, decide when we will collect again
+static void schedule(GC* gc)
+{
+    int at = gc->growth * gc->last.live_pools;
+    gc->collect_at = at < gc->min_pools ? gc->min_pools : at;
+}
+
+// Account for a pause that started at t0; return how long it was
+static long pause(GC* gc, long t0)
+{
+    long elapsed = timer_now_us() - t0;
+    int bucket = 0;
+    for (long t = elapsed; t > 0 && bucket < GC_PAUSE_BUCKETS - 1; t >>= 1) {
+        ++bucket;
+    }
+    ++gc->pauses[bucket];
+    if (gc->pause_max_us < elapsed) {
+        gc->pause_max_us = elapsed;
+    }
+    return elapsed;
+}
+
+// Wrap up a collection
+static void collected(US* us, GCStats* stats)
+{
+    GCStats* last = &us->gc->last;
+    LOG(DEBUG, ("GC: %s freed %ld cells, %ld envs, %ld pools, %ld bytes in %ld us, next at %d pools",
+                last->minor ? "minor" : "major",
+                last->freed_cells, last->freed_envs, last->freed_pools, last->freed_bytes,
+                last->pause_us, us->gc->collect_at));
+    if (stats) {
+        *stats = *last;
+    }
+}
+
+// Queue the global env and all roots for marking
+static void mark_roots(US* us)
+{
+    mark_push(us->gc, us->env, ROOT_ENV);
+    for (int j = 0; j < us->gc->root_used; ++j) {
+        Root* root = &us->gc->roots[j];
+        if (!root->count) {
+            mark_push(us->gc, *root->ptr, root->type);
+            continue;
+        }
+        void** items = *(void***) root->ptr;
+        for (int k = 0; k < *root->count; ++k) {
+            mark_push(us->gc, items[k], root->type);
+        }
+    }
+}
+
+// Queue for marking everything that dirty cells/envs point to; they are old,
+// and therefore already marked, so we must look inside them here.
+static void mark_dirty(US* us)
+{
+    for (CellPool* pool = us->arena->cells_dirty; pool; pool = pool->next_dirty) {
+        for (uint64_t dirty = pool->dirty; dirty; dirty &= dirty - 1) {
+            const Cell* cell = CELL_POOL_SLOT(pool, ffsll(dirty) - 1);
+            switch (cell->tag) {
+                case CELL_CONS:
+                    mark_push(us->gc, cell->cons.car, ROOT_CELL);
+                    mark_push(us->gc, cell->cons.cdr, ROOT_CELL);
+                    break;
+                case CELL_PROC:
+                    // the VM stores compiled code in procedures
+                    mark_push(us->gc, cell->pval.code, ROOT_CELL);
+                    mark_push(us->gc, cell->pval.exec, ROOT_CELL);
+                    break;
+                case CELL_LAMBDA:
+                    // executors are cached in lambdas
+                    mark_push(us->gc, cell->lval.exec, ROOT_CELL);
+                    break;
+            }
+        }
+    }
+    for (EnvPool* pool = us->arena->envs_dirty; pool; pool = pool->next_dirty) {
+        for (uint64_t dirty = pool->dirty; dirty; dirty &= dirty - 1) {
+            Env* env = &pool->slots[ffsll(dirty) - 1];
+            mark_symbols(us, env);
+            mark_push(us->gc, env->parent, ROOT_ENV);
+        }
+    }
+}
+
+// Mark everything reachable from the pending cells/envs, but if budget is
+// positive stop after marking that many; return non-zero if there is still
+// work pending.
+static int mark_drain(US* us, long budget)
+{
+    GC* gc = us->gc;
+    long left = budget;
+    while (gc->mark_used > 0) {
+        if (budget > 0 && left <= 0) {
+            return 1;
+        }
+        Mark* mark = &gc->marks[--gc->mark_used];
+        switch (mark->type) {
+            case ROOT_CELL:
+                left -= mark_cell(us, mark->ptr, left);
+                break;
+            case ROOT_ENV:
+                left -= mark_env(us, mark->ptr, left);
+                break;
+        }
+    }
+    return 0;
+}
+
+// Mark a cell; for conses we loop along the cdr, so that marking a long list
+// only ever needs one pending entry at a time (for its car).  If budget is
+// positive, stop after marking that many and leave the rest pending.  Return
+// how many cells we marked.
+static long mark_cell(US* us, const Cell* cell, long budget)
+{
+    long count = 0;
+    for (; cell && !CELL_IS_FIXNUM(cell); cell = cell->cons.cdr) {
+        if (budget > 0 && count >= budget) {
+            mark_push(us->gc, (Cell*) cell, ROOT_CELL);
+            return count;
+        }
+        if (!arena_mark_cell(us->arena, cell)) {
+            LOG(DEBUG, ("=== MARKING cell already marked"));
+            return count;
+        }
+        ++count;
+        LOG(DEBUG, ("=== MARKING cell"));
+        switch (cell->tag) {
+            case CELL_CONS:
+                LOG(DEBUG, ("=== MARKING cell cons"));
+                mark_push(us->gc, cell->cons.car, ROOT_CELL);
+                continue;
+            case CELL_PROC:
+                LOG(DEBUG, ("=== MARKING cell proc"));
+                mark_push(us->gc, cell->pval.lambda, ROOT_CELL);
+                mark_push(us->gc, cell->pval.env, ROOT_ENV);
+                mark_push(us->gc, cell->pval.code, ROOT_CELL);
+                mark_push(us->gc, cell->pval.exec, ROOT_CELL);
+                return count;
+            case CELL_LAMBDA:
+                LOG(DEBUG, ("=== MARKING cell lambda"));
+                mark_push(us->gc, cell->lval.names, ROOT_CELL);
+                mark_push(us->gc, cell->lval.body, ROOT_CELL);
+                mark_push(us->gc, cell->lval.exec, ROOT_CELL);
+                return count;
+            case CELL_CODE:
+                LOG(DEBUG, ("=== MARKING cell code"));
+                mark_push(us->gc, cell->code->lambda, ROOT_CELL);
+                for (int j = 0; j < cell->code->count; ++j) {
+                    mark_push(us->gc, cell->code->consts[j], ROOT_CELL);
+                }
+                return count;
+            case CELL_EXEC:
+                LOG(DEBUG, ("=== MARKING cell exec"));
+                mark_push(us->gc, cell->exec->lambda, ROOT_CELL);
+                return count;
+        }
+        return count;
+    }
+    return count;
+}
+
+// Mark an env; we loop along the chain of parents, with a budget just like
+// for cells.  Return how many envs we marked.
+static long mark_env(US* us, Env* env, long budget)
+{
+    long count = 0;
+    for (; env; env = env->parent) {
+        if (budget > 0 && count >= budget) {
+            mark_push(us->gc, env, ROOT_ENV);
+            return count;
+        }
+        if (!arena_mark_env(us->arena, env)) {
+            LOG(DEBUG, ("=== MARKING env already marked"));
+            return count;
+        }
+        ++count;
+        LOG(DEBUG, ("=== MARKING env"));
+        mark_symbols(us, env);
+    }
+    return count;
+}
+
+// Queue for marking the values of all symbols in an env, or of all slots in
+// a frame
+static void mark_symbols(US* us, Env* env)
+{
+    if (!env->table) {
+        mark_push(us->gc, env->names, ROOT_CELL);
+        for (int j = 0; j < env->count; ++j) {
+            mark_push(us->gc, env->slots[j], ROOT_CELL);
+        }
+        return;
+    }
+    for (int j = 0; j < env->size; ++j) {
+        for (Symbol* sym = env->table[j]; sym; sym = sym->next) {
+            mark_push(us->gc, sym->value, ROOT_CELL);
+        }
+    }
+}
@@ -0,0 +1,141 @@
+#ifndef GC_H_
+#define GC_H_
+
+#include "arena.h"  // for struct GCStats
+
+// Mark & sweep garbage collection for all cells and envs in an arena.
+//
+// Everything reachable from the global env, or from any of the registered
+// roots, is kept alive.  C code that holds a Cell* or Env* in a local variable
+// across anything that could allocate (and therefore collect) must register
+// the address of that variable as a root, and pop it when done:
+//
+//   Cell* list = ...;
+//   gc_push_cell(us->gc, &list);
+//   ... allocate ...
+//   gc_pop(us->gc, 1);
+//
+// Collections are generational: a minor collection only looks at the cells and
+// envs used since the previous collection (the nursery), plus any older ones
+// that were changed since then; survivors become old, and only a major
+// collection ever frees old cells/envs.  For this to work, any code that
+// stores a pointer into an existing cell/env must tell us about it:
+//
+//   sym->value = cell;
+//   gc_write_env(us, env, cell);
+//
+// Major collections can also be incremental: instead of stopping the world to
+// mark and sweep everything, we do a small slice of work on every allocation.
+// We use the usual three colors: white cells/envs are not marked, gray ones
+// are marked and waiting in the mark stack, black ones are marked and done.
+// While marking, the same calls above make sure that no black cell/env ever
+// points to a white one, by turning the stored cell gray.  Roots are not
+// covered by this, so when nothing gray is left we look at them again and
+// finish marking in one go; then we sweep a few pools at a time.
+
+// Define our structures
+struct US;
+struct Cell;
+struct Env;
+
+// A root is the address of a variable holding a Cell* or an Env*, or of a
+// variable pointing to an array of them, together with how many are in use
+typedef struct Root {
+    void** ptr;     // address of the variable
+    int type;       // type of the variable, see ROOT_* in gc.c
+    int* count;     // for an array, address of how many are in use
+} Root;
+
+// A cell/env that still has to be marked during a collection
+typedef struct Mark {
+    void* ptr;      // the cell/env
+    int type;       // type of ptr, same as for a root
+} Mark;
+
+// What an incremental collection is doing
+#define GC_PHASE_NONE  0
+#define GC_PHASE_MARK  1
+#define GC_PHASE_SWEEP 2
+
+// Default number of cells/envs allocated between minor collections
+#define GC_DEFAULT_NURSERY 4096
+
+// Number of buckets in the histogram of pause times: bucket 0 counts pauses
+// below 1 us, and bucket j counts pauses of at least 2^(j-1) us and less than
+// 2^j us; the last bucket also counts any longer pauses
+#define GC_PAUSE_BUCKETS 24
+
+// When the arena runs out of free slots, we collect garbage only if the arena
+// has grown to at least min_pools pools, and to growth times the number of
+// pools that were still in use after the previous collection.  This way the
+// cost of collecting is proportional to the live heap, amortized over the
+// allocations made since the previous collection; the nursery gets room on
+// top of that.  Otherwise, whenever the nursery fills up, we run a minor
+// collection; but not while an incremental collection is under way.
+typedef struct GC {
+    Root* roots;        // stack of roots
+    int root_used;      // number of roots in use
+    int root_size;      // number of roots allocated
+    Mark* marks;        // stack of cells/envs still to be marked
+    int mark_used;      // number of marks in use
+    int mark_size;      // number of marks allocated
+    double growth;      // heap growth factor between collections
+    int min_pools;      // never collect on our own below this many pools
+    int collect_at;     // collect on our own when reaching this many pools
+    long collections;   // number of major collections so far
+    long minors;        // number of minor collections so far
+    int slice;          // incremental work per allocation; 0 = stop the world
+    int phase;          // what an incremental collection is doing
+    long cycle_us;      // time spent so far in this incremental collection
+    long pause_max_us;  // longest pause for any collection so far
+    long pauses[GC_PAUSE_BUCKETS];  // histogram of pause times
+    GCStats last;       // stats for the last collection, major or minor
+} GC;
+
+GC* gc_create(void);
+void gc_destroy(GC* gc);
+
+// Register the address of a Cell*/Env* variable as a root
+void gc_push_cell(GC* gc, struct Cell** cell);
+void gc_push_env(GC* gc, struct Env** env);
+
+// Register the address of a variable pointing to an array of Cell*/Env*,
+// which may be moved as it grows, and of how many of them are in use
+void gc_push_cells(GC* gc, struct Cell*** cells, int* count);
+void gc_push_envs(GC* gc, struct Env*** envs, int* count);
+
+// Unregister the last count roots
+void gc_pop(GC* gc, int count);
+
+// Change the policy for collecting garbage on our own
+void gc_set_policy(GC* gc, double growth, int min_pools);
+
+// Make major collections on our own incremental, marking slice cells/envs (or
+// sweeping as many slots) on every allocation; 0 means stop the world instead
+void gc_set_incremental(struct US* us, int slice);
+
+// Tell the GC that a cell/env was changed to point to value
+void gc_write_cell(struct US* us, struct Cell* cell, struct Cell* value);
+void gc_write_env(struct US* us, struct Env* env, struct Cell* value);
+
+// Chain an env with a parent, telling the GC about it
+void gc_chain_env(struct US* us, struct Env* env, struct Env* parent);
+
+// Collect all garbage (a major collection), stopping the world, even if an
+// incremental collection is under way; return how many cells were freed and,
+// if stats is not null, fill it in with the details
+int gc_collect(struct US* us, GCStats* stats);
+
+// Collect garbage only among young cells/envs (a minor collection); return how
+// many cells were freed and, if stats is not null, fill it in with the details
+int gc_collect_minor(struct US* us, GCStats* stats);
+
+// Collect all garbage if the arena has grown enough since the last major
+// collection, or only young garbage if the nursery is full; return non-zero if
+// we did collect (just starting an incremental collection does not count)
+int gc_maybe_collect(struct US* us);
+
+// Do one slice of work for an incremental collection, if one is under way
+void gc_step(struct US* us);
+
+#endif
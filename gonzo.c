@@ -1,9 +1,17 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include "arena.h"
 #include "cell.h"
 #include "parser.h"
 #include "env.h"
+#include "gc.h"
+#include "intern.h"
+#include "resolve.h"
+#include "scan.h"
+#include "compile.h"
+#include "timer.h"
 #include "us.h"
 
 // #define LOG_LEVEL LOG_LEVEL_DEBUG
@@ -116,6 +124,118 @@ static void test_arena(void)
     arena_destroy(arena);
 }
 
+// Allocate cells in rounds; each round adds the same number of pools, so if
+// getting a cell is O(1) the time per cell must stay flat across rounds.
+// Envs in the arena are reused as hash tables or as frames, and should always
+// come out with the right shape for what they are asked for
+static void test_arena_frames(void)
+{
+    Arena* arena = arena_create();
+    Env* env = arena_get_env(arena, 0);
+    arena_reset_to_empty(arena);
+    Env* frame = arena_get_frame(arena, nil, 2);
+    if (frame == env && !frame->table && frame->slots == frame->values) {
+        printf("ok arena small frame reuses an env, with inline slots\n");
+    } else {
+        printf("BAD arena small frame %p, table %p, slots %p\n", frame, frame->table, frame->slots);
+    }
+
+    arena_reset_to_empty(arena);
+    frame = arena_get_frame(arena, nil, ENV_FRAME_SLOTS + 2);
+    Cell** spill = frame->spill;
+    arena_reset_to_empty(arena);
+    frame = arena_get_frame(arena, nil, ENV_FRAME_SLOTS + 1);
+    if (frame == env && spill && frame->slots == spill && frame->count == ENV_FRAME_SLOTS + 1) {
+        printf("ok arena big frame reuses its spilled slots\n");
+    } else {
+        printf("BAD arena big frame slots %p, expected %p\n", frame->slots, spill);
+    }
+
+    arena_reset_to_empty(arena);
+    env = arena_get_env(arena, 7);
+    if (env == frame && env->table && env->size == 7) {
+        printf("ok arena env reused from a frame has %d buckets\n", env->size);
+    } else {
+        printf("BAD arena env reused from a frame has %d buckets\n", env->size);
+    }
+    arena_reset_to_empty(arena);
+    env = arena_get_env(arena, 3);
+    if (env == frame && env->size == 3) {
+        printf("ok arena env reused with a different size has %d buckets\n", env->size);
+    } else {
+        printf("BAD arena env reused with a different size has %d buckets\n", env->size);
+    }
+    arena_destroy(arena);
+}
+
+// Conses and numbers live in pools with small slots, procedures in pools with
+// slots for a whole cell; every cell must still be found in its own pool
+static void test_arena_classes(void)
+{
+    Arena* arena = arena_create();
+    Cell* conses[ARENA_POOL_SIZE];
+    Cell* procs[ARENA_POOL_SIZE];
+    for (unsigned long j = 0; j < ARENA_POOL_SIZE; ++j) {
+        conses[j] = arena_get_cell(arena, 0);
+        procs[j] = arena_get_cell(arena, sizeof(Cell));
+    }
+    CellPool* small = arena_get_pool_for_cell(arena, conses[0]);
+    CellPool* big = arena_get_pool_for_cell(arena, procs[0]);
+    if (small && big && small->size == ARENA_CELL_SMALL_SIZE && big->size == sizeof(Cell)) {
+        printf("ok arena conses get %d byte slots, procs %d\n", small->size, big->size);
+    } else {
+        printf("BAD arena conses get %d byte slots, procs %d\n", small ? small->size : -1, big ? big->size : -1);
+    }
+
+    int found = 0;
+    for (unsigned long j = 0; j < ARENA_POOL_SIZE; ++j) {
+        found += arena_get_pool_for_cell(arena, conses[j]) == small && CELL_POOL_POS(small, conses[j]) == (int) j;
+        found += arena_get_pool_for_cell(arena, procs[j]) == big && CELL_POOL_POS(big, procs[j]) == (int) j;
+    }
+    if (found == 2 * ARENA_POOL_SIZE) {
+        printf("ok arena finds the pool and slot for all %d cells\n", found);
+    } else {
+        printf("BAD arena finds the pool and slot for %d cells, expected %d\n", found, (int) (2 * ARENA_POOL_SIZE));
+    }
+
+    arena_clear_marks(arena);
+    arena_mark_cell(arena, conses[5]);
+    arena_mark_cell(arena, procs[9]);
+    if (small->mark == 1ULL << 5 && big->mark == 1ULL << 9) {
+        printf("ok arena marks each size class in its own bitmap\n");
+    } else {
+        printf("BAD arena marks %" POOL_MASK_FMT " and %" POOL_MASK_FMT "\n", small->mark, big->mark);
+    }
+
+    unsigned long per_cons = arena->cell_align[ARENA_CELL_SMALL] / ARENA_POOL_SIZE;
+    if (per_cons < sizeof(Cell)) {
+        printf("ok arena uses %lu bytes per cons, a whole cell is %lu\n", per_cons, (unsigned long) sizeof(Cell));
+    } else {
+        printf("BAD arena uses %lu bytes per cons, a whole cell is %lu\n", per_cons, (unsigned long) sizeof(Cell));
+    }
+    arena_destroy(arena);
+}
+
+static void bench_arena(void)
+{
+    static const int rounds = 8;
+    static const int pools_per_round = 2048;
+    Arena* arena = arena_create();
+    int pools = 0;
+    for (int r = 0; r < rounds; ++r) {
+        int count = pools_per_round * ARENA_POOL_SIZE;
+        long t0 = timer_now_us();
+        for (int j = 0; j < count; ++j) {
+            arena_get_cell(arena, 0);
+        }
+        long t1 = timer_now_us();
+        pools += pools_per_round;
+        printf("bench arena round %d: %6d pools, %7.2f ns/cell\n",
+               r, pools, (t1 - t0) * 1000.0 / count);
+    }
+    arena_destroy(arena);
+}
+
 static int test_cell(const char* label, const Cell* cell, const char* expected)
 {
     char dumper[10*1024];
@@ -155,6 +275,48 @@ static void test_strings(US* us)
         Cell* c = cell_create_string(us, value, 0);
         test_cell("string", c, expected);
     }
+
+    // short strings live in their cell, longer ones in the string heap, and
+    // the longest ones get a block of their own
+    static struct {
+        int len;
+        int inside;
+    } sizes[] = {
+        { 1, 1 },
+        { 7, 1 },
+        { 23, 1 },
+        { 24, 0 },
+        { ARENA_STRING_MAX - 1, 0 },
+        { ARENA_STRING_MAX, 0 },
+        { 1000, 0 },
+    };
+    char value[1024];
+    n = sizeof(sizes) / sizeof(sizes[0]);
+    for (int j = 0; j < n; ++j) {
+        int len = sizes[j].len;
+        memset(value, 'a' + j, len);
+        value[len] = '\0';
+        Cell* c = cell_create_string(us, value, len);
+        int inside = c->sval == CELL_STRING_INLINE(c);
+        if (strcmp(c->sval, value) == 0 && inside == sizes[j].inside) {
+            printf("ok string of %d chars is %s\n", len, inside ? "inside its cell" : "outside its cell");
+        } else {
+            printf("BAD string of %d chars, inside %d, expected %d\n", len, inside, sizes[j].inside);
+        }
+    }
+
+    // strings know their length, so they can hold nulls
+    Cell* a = cell_create_string(us, "ab\0cd", 5);
+    gc_push_cell(us->gc, &a);
+    Cell* b = cell_create_string(us, "ab\0cd", 5);
+    gc_push_cell(us->gc, &b);
+    Cell* c = cell_create_string(us, "ab\0ce", 5);
+    gc_pop(us->gc, 2);
+    if (a->len == 5 && cell_equal_strings(a, b) && !cell_equal_strings(a, c) && cell_compare_strings(a, c) < 0) {
+        printf("ok string with a null has %d chars and compares whole\n", a->len);
+    } else {
+        printf("BAD string with a null has %d chars\n", a->len);
+    }
 }
 
 static void test_integers(US* us)
@@ -178,6 +340,29 @@ static void test_integers(US* us)
         Cell* c = cell_create_int(us, value);
         test_cell("int", c, expected);
     }
+
+    // small integers are fixnums, bigger ones still need a cell; make sure
+    // the arena does not collect on its own, not even a step at a time, while
+    // we count
+    ArenaCollect* collect = us->arena->collect;
+    ArenaCollect* step = us->arena->step;
+    us->arena->collect = 0;
+    us->arena->step = 0;
+    long values[] = { 0, -1, CELL_FIXNUM_MIN, CELL_FIXNUM_MAX, CELL_FIXNUM_MIN - 1, CELL_FIXNUM_MAX + 1, LONG_MIN, LONG_MAX };
+    for (int j = 0; j < (int) (sizeof(values) / sizeof(values[0])); ++j) {
+        long young = us->arena->young;
+        Cell* c = cell_create_int(us, values[j]);
+        int fixnum = values[j] >= CELL_FIXNUM_MIN && values[j] <= CELL_FIXNUM_MAX;
+        long used = us->arena->young - young;
+        if (CELL_TAG(c) == CELL_INT && CELL_IVAL(c) == values[j] &&
+            CELL_IS_FIXNUM(c) == fixnum && used == !fixnum) {
+            printf("ok int %ld is %s\n", values[j], fixnum ? "a fixnum" : "a cell");
+        } else {
+            printf("BAD int %ld is %s, value %ld\n", values[j], CELL_IS_FIXNUM(c) ? "a fixnum" : "a cell", CELL_IVAL(c));
+        }
+    }
+    us->arena->collect = collect;
+    us->arena->step = step;
 }
 
 static void test_reals(US* us)
@@ -204,29 +389,42 @@ static void test_reals(US* us)
     }
 }
 
+// When building lists by hand, every cell must be reachable from a root while
+// we allocate the next one, because allocating may collect garbage.
+
 static void test_simple_list(US* us)
 {
-    Cell* c = cell_cons(us, cell_create_int(us, 1),
-                  cell_cons(us, cell_create_int(us, 2),
-                            cell_cons(us, cell_create_int(us, 3), nil)));
+    Cell* c = nil;
+    gc_push_cell(us->gc, &c);
+    for (int j = 3; j >= 1; --j) {
+        c = cell_cons(us, cell_create_int(us, j), c);
+    }
     test_cell("simple_list", c, "(1 2 3)");
+    gc_pop(us->gc, 1);
 }
 
 static void test_nested_list(US* us)
 {
-    Cell* c23 = cell_cons(us, cell_create_int(us, 2),
-                    cell_cons(us, cell_create_int(us, 3), nil));
-    Cell* c = cell_cons(us, cell_create_int(us, 1),
-                  cell_cons(us, c23,
-                            cell_cons(us, cell_create_int(us, 4), nil)));
+    Cell* c23 = nil;
+    Cell* c = nil;
+    gc_push_cell(us->gc, &c23);
+    gc_push_cell(us->gc, &c);
+    c23 = cell_cons(us, cell_create_int(us, 3), c23);
+    c23 = cell_cons(us, cell_create_int(us, 2), c23);
+    c = cell_cons(us, cell_create_int(us, 4), c);
+    c = cell_cons(us, c23, c);
+    c = cell_cons(us, cell_create_int(us, 1), c);
     test_cell("nested_list", c, "(1 (2 3) 4)");
+    gc_pop(us->gc, 2);
 }
 
 static void test_dotted_list(US* us)
 {
-    Cell* c = cell_cons(us, cell_create_int(us, 1),
-                  cell_create_int(us, 2));
+    Cell* c = cell_create_int(us, 2);
+    gc_push_cell(us->gc, &c);
+    c = cell_cons(us, cell_create_int(us, 1), c);
     test_cell("dotted_list", c, "(1 . 2)");
+    gc_pop(us->gc, 1);
 }
 
 static void test_lists(US* us)
@@ -249,9 +447,11 @@ static void test_symbol(US* us)
             break;
         }
 
-        const char* name = "set-gonzo!";
+        // env names must be interned
+        Cell* symbol = cell_create_symbol(us, "set-gonzo!", 0);
+        const char* name = symbol->sval;
 
-        Symbol* s1 = env_lookup(parent, name, 1);
+        Symbol* s1 = env_lookup(parent, symbol, 1);
         if (s1) {
             printf("ok symbol created sym [%s]\n", name);
         } else {
@@ -262,15 +462,15 @@ static void test_symbol(US* us)
         const long value = 11;
         Cell* c = cell_create_int(us, value);
         if (c) {
-            printf("ok symbol created cell [%ld]\n", c->ival);
+            printf("ok symbol created cell [%ld]\n", CELL_IVAL(c));
         } else {
-            printf("BAD symbol created cell [%ld] [%ld]\n", c->ival, value);
+            printf("BAD symbol created cell [%ld] [%ld]\n", CELL_IVAL(c), value);
             break;
         }
 
         s1->value = c;
 
-        Symbol* s2 = env_lookup(parent, name, 0);
+        Symbol* s2 = env_lookup(parent, symbol, 0);
         if (s2) {
             printf("ok symbol fetched sym [%s]\n", name);
         } else {
@@ -288,7 +488,7 @@ static void test_symbol(US* us)
 
         env_chain(child, parent);
 
-        Symbol* s3 = env_lookup(child, name, 0);
+        Symbol* s3 = env_lookup(child, symbol, 0);
         if (s3) {
             printf("ok symbol fetched sym [%s]\n", name);
         } else {
@@ -297,9 +497,9 @@ static void test_symbol(US* us)
         }
 
         if (s3->value == c) {
-            printf("ok symbol values match [%ld]\n", s3->value->ival);
+            printf("ok symbol values match [%ld]\n", CELL_IVAL(s3->value));
         } else {
-            printf("BAD symbol values match [%ld] [%ld]\n", s3->value->ival, value);
+            printf("BAD symbol values match [%ld] [%ld]\n", CELL_IVAL(s3->value), value);
             break;
         }
     } while (0);
@@ -309,6 +509,65 @@ static void test_symbol(US* us)
     env_destroy(parent);
 }
 
+static void test_intern(US* us)
+{
+    char buf[] = "gonzo-symbol and more";
+    Cell* s1 = cell_create_symbol(us, "gonzo-symbol", 0);
+    Cell* s2 = cell_create_symbol(us, buf, 12);
+    Cell* s3 = cell_create_symbol(us, "gonzo-symbo", 0);
+    if (s1 == s2 && strcmp(s1->sval, "gonzo-symbol") == 0) {
+        printf("ok intern same name gives same symbol [%s]\n", s1->sval);
+    } else {
+        printf("BAD intern same name gives different symbols [%s] [%s]\n", s1->sval, s2->sval);
+    }
+    if (s1 != s3) {
+        printf("ok intern different names give different symbols\n");
+    } else {
+        printf("BAD intern different names give same symbol [%s]\n", s3->sval);
+    }
+    if (cell_create_symbol(us, "lambda", 0) == sym_lambda) {
+        printf("ok intern special form symbols are unique\n");
+    } else {
+        printf("BAD intern special form symbols are not unique\n");
+    }
+
+    // the hash is computed once, when a symbol is interned, the same way for
+    // every symbol, including the special forms
+    unsigned long h = 5381;
+    for (const char* p = "gonzo-symbol"; *p; ++p) {
+        h = h * 33 + (unsigned char) *p;
+    }
+    if (s1->hash == h && s3->hash != h) {
+        printf("ok intern symbol caches its hash [%lu]\n", s1->hash);
+    } else {
+        printf("BAD intern symbol hash [%lu], expected [%lu]\n", s1->hash, h);
+    }
+    h = 5381;
+    for (const char* p = "lambda"; *p; ++p) {
+        h = h * 33 + (unsigned char) *p;
+    }
+    if (sym_lambda->hash == h) {
+        printf("ok intern special form symbol caches its hash [%lu]\n", h);
+    } else {
+        printf("BAD intern special form symbol hash [%lu], expected [%lu]\n", sym_lambda->hash, h);
+    }
+
+    // symbols live outside the arena, so collecting never touches them
+    Cell* c = us_eval_str(us, "(quote gonzo-symbol)");
+    us_gc(us, 0);
+    if (c == s1 && !arena_is_cell_used(us->arena, c) && strcmp(c->sval, "gonzo-symbol") == 0) {
+        printf("ok intern parsed symbol is interned and survives gc\n");
+    } else {
+        printf("BAD intern parsed symbol %p, expected %p\n", c, s1);
+    }
+    c = us_eval_str(us, "(= (quote gonzo-symbol) (quote gonzo-symbol))");
+    if (c == bool_t) {
+        printf("ok intern symbols compare equal\n");
+    } else {
+        printf("BAD intern symbols do not compare equal\n");
+    }
+}
+
 static void test_parser(US* us)
 {
     static struct {
@@ -364,7 +623,7 @@ static void test_parser(US* us)
         },
     };
 
-    Parser* parser = parser_create(0);
+    Parser* parser = parser_create(us->gc, 0);
     int n = sizeof(data) / sizeof(data[0]);
     for (int j = 0; j < n; ++j) {
         const char* code = data[j].code;
@@ -372,8 +631,236 @@ static void test_parser(US* us)
         parser_parse(us, parser, code);
         Cell* c = parser_result(parser);
         test_cell("parse", c, expected);
+
+        // the same, fed one char at a time, cutting every token
+        parser_reset(parser);
+        for (int k = 0; code[k]; ++k) {
+            parser_feed(us, parser, code + k, 1);
+        }
+        parser_finish(us, parser);
+        c = parser_next(parser);
+        test_cell("parse chunks", c, expected);
+    }
+    parser_destroy(parser, us->gc);
+
+    // forms come out in order, as soon as they are complete, even when a chunk
+    // ends in the middle of a token, and nested lists can go deeper than the
+    // parser was created for
+    static const char* chunks[] = {
+        " 1 (2 3) \"fo", "ur five\" ((((si", "x)))) 7", 0,
+    };
+    static const int ready[] = { 2, 3, 4, 5 };
+    static const char* forms[] = { "1", "(2 3)", "\"four five\"", "((((six))))", "7" };
+    parser = parser_create(us->gc, 2);
+    int ok = 1;
+    for (int j = 0; j < 4; ++j) {
+        int count = chunks[j] ? parser_feed(us, parser, chunks[j], -1) : parser_finish(us, parser);
+        ok = ok && count == ready[j];
+    }
+    if (ok) {
+        printf("ok parse chunks have %d forms ready at the end\n", ready[3]);
+    } else {
+        printf("BAD parse chunks did not have the right number of forms ready\n");
+    }
+    for (int j = 0; j < 5; ++j) {
+        test_cell("parse chunks form", parser_next(parser), forms[j]);
+    }
+    if (!parser_next(parser)) {
+        printf("ok parse chunks has no forms left\n");
+    } else {
+        printf("BAD parse chunks has forms left\n");
+    }
+    parser_destroy(parser, us->gc);
+}
+
+// All the forms in some code are evaluated in order, and the value of the
+// last one is returned; a file is read in chunks, and forms can span them
+static void test_eval_forms(US* us)
+{
+    test_cell("eval_forms", us_eval_str(us, "(define fa 3) (define fb 4) (+ fa fb)"), "7");
+    test_cell("eval_forms", us_eval_buffer(us, "(+ 1 2) (+ 3 4) not evaled", 15), "7");
+
+    static const int lines = 10000;
+    char path[] = "/tmp/gonzo-XXXXXX";
+    int fd = mkstemp(path);
+    FILE* fp = fd < 0 ? 0 : fdopen(fd, "w");
+    if (!fp) {
+        printf("BAD eval_forms could not create script %s\n", path);
+        return;
+    }
+    fprintf(fp, "(define fn 0)\n");
+    for (int j = 0; j < lines; ++j) {
+        fprintf(fp, "(set! fn\n  (+ fn 1))\n");
+    }
+    fprintf(fp, "fn");
+    fclose(fp);
+    char expected[32];
+    sprintf(expected, "%d", lines);
+    test_cell("eval_forms file", us_eval_file(us, path), expected);
+    unlink(path);
+
+    if (!us_eval_file(us, path)) {
+        printf("ok eval_forms missing file has no value\n");
+    } else {
+        printf("BAD eval_forms missing file has a value\n");
+    }
+}
+
+// Long strings in a loaded file stay in its mapping, which must go away once
+// they are garbage, and must never change the file itself.
+static void test_load_file(US* us)
+{
+    static const char* str = "a string far too long to fit inside of its cell";
+    static const int count = 100000;
+    char path[] = "/tmp/gonzo-XXXXXX";
+    int fd = mkstemp(path);
+    FILE* fp = fd < 0 ? 0 : fdopen(fd, "w");
+    if (!fp) {
+        printf("BAD load_file could not create script %s\n", path);
+        return;
+    }
+    fprintf(fp, "(define ls \"%s\")\n(define ns (quote (", str);
+    for (int j = 0; j < count; ++j) {
+        fprintf(fp, " %d", j);
+    }
+    fprintf(fp, ")))\n(define ss \"short\")\n(string-length ls)");
+    fclose(fp);
+
+    char expected[32];
+    sprintf(expected, "%d", (int) strlen(str));
+    test_cell("load_file", us_load_file(us, path), expected);
+    test_cell("load_file", us_eval_str(us, "(+ (car ns) (car (cdr ns)))"), "1");
+    test_cell("load_file", us_eval_str(us, "ss"), "\"short\"");
+
+    Cell* ls = us_eval_str(us, "ls");
+    ArenaImage* image = us->arena->images;
+    if (image && ls->sval >= image->base && ls->sval < image->base + image->size && strcmp(ls->sval, str) == 0) {
+        printf("ok load_file long string kept in place\n");
+    } else {
+        printf("BAD load_file long string not kept in place\n");
+    }
+
+    us_eval_str(us, "(set! ls 0)");
+    us_gc(us, 0);
+    if (!us->arena->images) {
+        printf("ok load_file image unmapped once its strings are garbage\n");
+    } else {
+        printf("BAD load_file image still mapped, %ld strings live\n", us->arena->images->live);
     }
-    parser_destroy(parser);
+
+    char buf[128];
+    fp = fopen(path, "r");
+    if (fp && fgets(buf, sizeof(buf), fp) && strstr(buf, "cell\")")) {
+        printf("ok load_file left the file alone\n");
+    } else {
+        printf("BAD load_file changed the file\n");
+    }
+    if (fp) {
+        fclose(fp);
+    }
+    unlink(path);
+
+    if (!us_load_file(us, path)) {
+        printf("ok load_file missing file has no value\n");
+    } else {
+        printf("BAD load_file missing file has a value\n");
+    }
+    us_eval_str(us, "(set! ns 0)");
+}
+
+// Every way of scanning must find the same ends as going one char at a time,
+// wherever the strings start and however long they are, and the parser must
+// get the same tokens with each of them.
+static void test_scan(US* us)
+{
+    static const char* ends = "\" ()\t\n\v\f\r";
+    static const char* others = "abc+-.09#\x08\x0e\x1f!~\x80\xff";
+    char buf[100];
+    int current = scan_current();
+    printf("ok scan using %s by default\n", scan_name(current));
+    for (int kind = 0; kind < SCAN_LAST; ++kind) {
+        if (scan_use(kind) != kind) {
+            printf("ok scan %s not supported here\n", scan_name(kind));
+            continue;
+        }
+        int bad = 0;
+        int count = 0;
+        for (int len = 0; len <= 80; ++len) {
+            for (int end = 0; end <= len; ++end) {
+                for (int j = 0; j < len; ++j) {
+                    buf[j] = others[(j * 7 + end) % strlen(others)];
+                }
+                char e = ends[(len + end) % strlen(ends)];
+                if (end < len) {
+                    buf[end] = e;
+                }
+                for (int pos = 0; pos <= end && pos < 40; ++pos) {
+                    int string = e == '"' ? end : len;
+                    if (scan_string(buf, pos, len) != string || scan_symbol(buf, pos, len) != end) {
+                        ++bad;
+                    }
+                    ++count;
+                }
+            }
+        }
+        if (bad) {
+            printf("BAD scan %s: %d of %d scans wrong\n", scan_name(kind), bad, count);
+        } else {
+            printf("ok scan %s: %d scans\n", scan_name(kind), count);
+        }
+        test_cell("scan parse", us_eval_str(us, "(string-length \"a string long enough to be scanned ahead\")"), "40");
+        test_cell("scan parse", us_eval_str(us, "(quote (a-symbol-long-enough-to-be-scanned-ahead 1))"),
+                  "(a-symbol-long-enough-to-be-scanned-ahead 1)");
+    }
+    scan_use(current);
+}
+
+// Parse a few MB of typical data (numbers, strings, symbols, nested lists)
+// fed in chunks, taking and dropping the forms as they are ready.
+static void bench_parser(US* us)
+{
+    static const int size = 8*1024*1024;
+    static const int chunk = 64*1024;
+    static const int rounds = 3;
+    int current = scan_current();
+    char* text = malloc(size + 256);
+    int len = 0;
+    for (int j = 0; len < size; ++j) {
+        len += sprintf(text + len, "(define item-%d (quote (%d -%d %d.25 \"string number %d\" label-%d (nested (%d %d)) #t\n"
+                       "  \"a longer description for item number %d, as found in data files\")))\n",
+                       j % 100, j, j * 7, j, j, j % 100, j * 3, j * 5, j);
+    }
+
+    for (int kind = 0; kind < SCAN_LAST; ++kind) {
+        if (scan_use(kind) != kind) {
+            continue;
+        }
+        double best = 0;
+        for (int r = 0; r < rounds; ++r) {
+            us_gc(us, 0);
+            parser_reset(us->parser);
+            long t0 = timer_now_us();
+            long forms = 0;
+            for (int pos = 0; pos < len; pos += chunk) {
+                parser_feed(us, us->parser, text + pos, len - pos < chunk ? len - pos : chunk);
+                for (Cell* c = parser_next(us->parser); c; c = parser_next(us->parser)) {
+                    ++forms;
+                }
+            }
+            parser_finish(us, us->parser);
+            long t1 = timer_now_us();
+            double mbs = t1 > t0 ? len / (double) (t1 - t0) : 0;
+            if (best < mbs) {
+                best = mbs;
+            }
+            printf("bench parser %-6s round %d: %ld forms, %d bytes, %7ld us, %6.1f MB/s\n",
+                   scan_name(kind), r, forms, len, t1 - t0, mbs);
+        }
+        printf("bench parser %-6s best: %6.1f MB/s\n", scan_name(kind), best);
+    }
+    scan_use(current);
+    free(text);
+    us_gc(us, 0);
 }
 
 static void test_eval_simple(US* us)
@@ -470,6 +957,16 @@ static void test_eval_simple(US* us)
         { "#t", " (= 7 7 7) " },
         { "#t", " (= \"Bilbo\" \"Bilbo\") " },
         { "#f", " (= \"Bilbo\" \"Frodo\") " },
+        { "#f", " (= \"Bilbo\" \"Bilb\") " },
+        { "#t", " (= \"In a hole in the ground\" \"In a hole in the ground\") " },
+        { "#f", " (= \"In a hole in the ground\" \"In a hole in the groung\") " },
+        { "#t", " (< \"Bilb\" \"Bilbo\") " },
+        { "#f", " (> \"Bilb\" \"Bilbo\") " },
+        { "#t", " (> \"Frodo\" \"Bilbo\") " },
+        { "6", " (string-length \"hobbit\") " },
+        { "0", " (string-length \"\") " },
+        { "47", " (string-length \"In a hole in the ground there lived a hobbit...\") " },
+        { "()", " (string-length 6) " },
         { "#t", " (= + +) " },
         { "#f", " (= + *) " },
         { "11", " 11 " },
@@ -488,7 +985,7 @@ static void test_eval_simple(US* us)
         const char* expected = data[j].expected;
         Cell* c = us_eval_str(us, code);
         test_cell("eval_simple", c, expected);
-        us_gc(us);
+        us_gc(us, 0);
     }
 }
 
@@ -579,8 +1076,537 @@ static void test_eval_complex(US* us)
         const char* expected = data[j].expected;
         Cell* c = us_eval_str(us, code);
         test_cell("eval_complex", c, expected);
-        us_gc(us);
+        us_gc(us, 0);
+    }
+}
+
+static void test_resolve(US* us)
+{
+    char dumper[10*1024];
+
+    // resolve by hand, to look at what comes out
+    parser_parse(us, us->parser, "(lambda (x y) (begin (define z (+ x y)) (lambda (w) (+ w z x))))");
+    Cell* c = parser_result(us->parser);
+    gc_push_cell(us->gc, &c);
+    c = cell_resolve(us, c);
+    if (c->tag == CELL_LAMBDA && c->lval.arity == 2 && c->lval.size == 3) {
+        printf("ok resolve lambda has 2 params and 3 slots\n");
+    } else {
+        printf("BAD resolve lambda [%s]\n", cell_dump(c, 1, dumper));
+    }
+    Cell* inner = cell_car(cell_cdr(cell_cdr(c->lval.body)));
+    Cell* body = inner && inner->tag == CELL_LAMBDA ? inner->lval.body : nil;
+    static struct {
+        int tag;
+        int depth;
+        int slot;
+    } refs[] = {
+        { CELL_GLOBAL, 0, 0 }, // +
+        { CELL_LOCAL , 0, 0 }, // w
+        { CELL_LOCAL , 1, 2 }, // z
+        { CELL_LOCAL , 1, 0 }, // x
+    };
+    int n = sizeof(refs) / sizeof(refs[0]);
+    int j = 0;
+    for (Cell* r = body; r->tag == CELL_CONS && j < n; r = r->cons.cdr, ++j) {
+        Cell* v = r->cons.car;
+        if (v->tag != refs[j].tag) {
+            break;
+        }
+        if (v->tag == CELL_LOCAL && (v->loc.depth != refs[j].depth || v->loc.slot != refs[j].slot)) {
+            break;
+        }
+    }
+    if (j == n) {
+        printf("ok resolve inner lambda refers to its own and enclosing slots\n");
+    } else {
+        printf("BAD resolve inner lambda reference #%d [%s]\n", j, cell_dump(body, 1, dumper));
+    }
+    gc_pop(us->gc, 1);
+
+    static struct {
+        const char* expected;
+        const char* code;
+    } data[] = {
+        { "1", "(define gonzo-x 1)" },
+        { "<*CODE*>", "(define gonzo-shadow (lambda (gonzo-x) (begin (define gonzo-y (* gonzo-x 10)) (+ gonzo-x gonzo-y))))" },
+        { "22", "(gonzo-shadow 2)" },
+        { "1", "gonzo-x" },
+        { "()", "gonzo-y" },
+        { "6", "((lambda (a) ((lambda (b) ((lambda (c) (+ a b c)) 3)) 2)) 1)" },
+        { "<*CODE*>", "(define gonzo-counter (lambda () (begin (define n 0) (lambda () (begin (set! n (+ n 1)) n)))))" },
+        { "<*CODE*>", "(define gonzo-tick (gonzo-counter))" },
+        { "1", "(gonzo-tick)" },
+        { "2", "(gonzo-tick)" },
+        { "1", "((gonzo-counter))" },
+    };
+    n = sizeof(data) / sizeof(data[0]);
+    for (j = 0; j < n; ++j) {
+        c = us_eval_str(us, data[j].code);
+        test_cell("resolve", c, data[j].expected);
+        us_gc(us, 0);
+    }
+}
+
+// Loops are written as tail calls, and must run in constant stack space: a
+// million levels deep would blow up the C stack otherwise
+static void test_tail_calls(US* us)
+{
+    static struct {
+        const char* expected;
+        const char* code;
+    } data[] = {
+        { "<*CODE*>", "(define gonzo-loop (lambda (n acc) (if (< n 1) acc (gonzo-loop (- n 1) (+ acc 2)))))" },
+        { "2000000", "(gonzo-loop 1000000 0)" },
+        { "<*CODE*>", "(define gonzo-even? (lambda (n) (if (= n 0) #t (gonzo-odd? (- n 1)))))" },
+        { "<*CODE*>", "(define gonzo-odd? (lambda (n) (if (= n 0) #f (gonzo-even? (- n 1)))))" },
+        { "#t", "(gonzo-even? 1000000)" },
+        { "#f", "(gonzo-odd? 1000000)" },
+        { "499500", "((lambda (n) (begin (define sum (lambda (k acc) (if (= k n) acc (sum (+ k 1) (+ acc k))))) (sum 0 0))) 1000)" },
+    };
+
+    int n = sizeof(data) / sizeof(data[0]);
+    for (int j = 0; j < n; ++j) {
+        Cell* c = us_eval_str(us, data[j].code);
+        test_cell("tail calls", c, data[j].expected);
+        us_gc(us, 0);
+    }
+}
+
+// A native that still wants its args as a list
+static Cell* gonzo_length(US* us, Cell* args)
+{
+    long length = 0;
+    for (Cell* c = args; c && c != nil; c = c->cons.cdr) {
+        ++length;
+    }
+    return cell_create_int(us, length);
+}
+
+static void test_natives(US* us)
+{
+    Cell* symbol = intern_symbol(us->intern, "gonzo-length", 0);
+    Symbol* sym = env_lookup(us->env, symbol, 1);
+    sym->value = cell_create_native(us, "gonzo-length", gonzo_length);
+    gc_write_env(us, us->env, sym->value);
+    test_cell("natives list args", us_eval_str(us, "(gonzo-length 1 (+ 1 1) 3)"), "3");
+    test_cell("natives list args in proc", us_eval_str(us, "((lambda (x) (gonzo-length x x)) 1)"), "2");
+    test_cell("natives no args", us_eval_str(us, "(gonzo-length)"), "0");
+    test_cell("natives many args", us_eval_str(us, "(+ 1 2 3 4 5 6 7 8 9 10 11)"), "66");
+    test_cell("natives cons arity", us_eval_str(us, "(cons 1 2 3)"), "()");
+
+    // natives get their args in an array, and integers are fixnums, so a loop
+    // only creates a frame on each iteration, and never a cell
+    static const int loops = 1000;
+    us_eval_str(us, "(define gonzo-down (lambda (n) (if (= n 0) 0 (gonzo-down (- n 1)))))");
+    ArenaCollect* collect = us->arena->collect;
+    us->arena->collect = 0;
+    long young = us->arena->young;
+    int pools = us->arena->cell_pools;
+    us_eval_str(us, "(gonzo-down 1000)");
+    long used = us->arena->young - young;
+    us->arena->collect = collect;
+    if (used <= loops + 16 && us->arena->cell_pools == pools) {
+        printf("ok natives %ld cells/envs for %d calls\n", used, loops);
+    } else {
+        printf("BAD natives %ld cells/envs for %d calls\n", used, loops);
+    }
+    us_gc(us, 0);
+}
+
+static void test_analyze(US* us)
+{
+    // all procedures created for a lambda share the executors for its body,
+    // which are created only once
+    us_eval_str(us, "(define gonzo-make (lambda (n) (lambda () n)))");
+    Cell* one = us_eval_str(us, "(define gonzo-one (gonzo-make 1))");
+    Cell* two = us_eval_str(us, "(define gonzo-two (gonzo-make 2))");
+    if (one->tag == CELL_PROC && two->tag == CELL_PROC &&
+        one->pval.exec && one->pval.exec->tag == CELL_EXEC &&
+        one->pval.exec == two->pval.exec &&
+        one->pval.exec == one->pval.lambda->lval.exec) {
+        printf("ok analyze shared %d executors between procedures\n", one->pval.exec->exec->count);
+    } else {
+        printf("BAD analyze did not share executors between procedures\n");
+    }
+    test_cell("analyze", us_eval_str(us, "(+ (gonzo-one) (gonzo-two))"), "3");
+
+    // a call with more args than fit on the C stack
+    us_eval_str(us, "(define gonzo-ten (lambda (a b c d e f g h i j) (+ a b c d e f g h i j)))");
+    test_cell("analyze many args", us_eval_str(us, "(gonzo-ten 1 2 3 4 5 6 7 8 9 10)"), "55");
+    test_cell("analyze native many args", us_eval_str(us, "((lambda () (+ 1 2 3 4 5 6 7 8 9 10 11)))"), "66");
+    us_gc(us, 0);
+}
+
+static void test_vm(US* us)
+{
+    static struct {
+        const char* expected;
+        const char* code;
+    } data[] = {
+        { "<*CODE*>", "(define gonzo-adder (lambda (n) (lambda (k) (begin (set! n (+ n k)) n))))" },
+        { "<*CODE*>", "(define gonzo-add (gonzo-adder 10))" },
+        { "15", "(gonzo-add 5)" },
+        { "22", "(gonzo-add 7)" },
+        { "()", "(set! gonzo-not-defined 1)" },
+        { "()", "(gonzo-not-defined 1)" },
+        { "(1 . 2)", "((lambda (f) (f 1 2)) cons)" },
+        { "3", "((lambda (a b) (if b a 3)) 1)" },
+    };
+
+    // the same tests as for cell_eval must pass when running in the VM
+    us_set_vm(us, 1);
+    parser_parse(us, us->parser, "(if (< 1 2) (quote yes) 0)");
+    Cell* c = parser_result(us->parser);
+    gc_push_cell(us->gc, &c);
+    c = cell_resolve(us, c);
+    Cell* code = cell_compile(us, c);
+    gc_pop(us->gc, 1);
+    if (code && code->tag == CELL_CODE && code->code->count > 0) {
+        printf("ok vm compiled %d bytes, %d constants\n", code->code->size, code->code->count);
+    } else {
+        printf("BAD vm could not compile a simple expression\n");
+    }
+    test_eval_simple(us);
+    test_eval_complex(us);
+    test_tail_calls(us);
+
+    int n = sizeof(data) / sizeof(data[0]);
+    for (int j = 0; j < n; ++j) {
+        Cell* c = us_eval_str(us, data[j].code);
+        test_cell("vm", c, data[j].expected);
+    }
+
+    // a procedure created by cell_eval gets compiled once, when first called
+    us_set_vm(us, 0);
+    Cell* proc = us_eval_str(us, "(define gonzo-twice (lambda (n) (* n 2)))");
+    us_set_vm(us, 1);
+    test_cell("vm procedure from eval", us_eval_str(us, "(gonzo-twice 21)"), "42");
+    if (proc->tag == CELL_PROC && proc->pval.code && proc->pval.code->tag == CELL_CODE) {
+        printf("ok vm kept compiled code for procedure\n");
+    } else {
+        printf("BAD vm did not keep compiled code for procedure\n");
+    }
+    us_set_vm(us, 0);
+    test_cell("vm compiled procedure in eval", us_eval_str(us, "(gonzo-twice 4)"), "8");
+
+    // a procedure the VM cannot compile still runs, in the interpreter
+    us_eval_str(us, "(define gonzo-thrice (lambda (n) (if (< n 0) (set! 3 n) (* n 3))))");
+    us_set_vm(us, 1);
+    test_cell("vm procedure it cannot compile", us_eval_str(us, "(gonzo-thrice 7)"), "21");
+    test_cell("vm tail call it cannot compile", us_eval_str(us, "((lambda (n) (gonzo-thrice n)) 5)"), "15");
+    us_set_vm(us, 0);
+    us_gc(us, 0);
+}
+
+static void bench_vm(US* us)
+{
+    us_eval_str(us, "(define gonzo-fib (lambda (n) (if (< n 2) n (+ (gonzo-fib (- n 1)) (gonzo-fib (- n 2))))))");
+    us_eval_str(us, "(define gonzo-count (lambda (n) (if (= n 0) 0 (gonzo-count (- n 1)))))");
+    static const char* names[] = { "eval", "vm" };
+    for (int j = 0; j < 2; ++j) {
+        us_set_vm(us, j);
+        us_gc(us, 0);
+        long t0 = timer_now_us();
+        us_eval_str(us, "(gonzo-fib 22)");
+        long t1 = timer_now_us();
+        us_eval_str(us, "(gonzo-count 1000000)");
+        long t2 = timer_now_us();
+        printf("bench %-4s: fib 22 %7ld us, loop 1000000 %7ld us\n", names[j], t1 - t0, t2 - t1);
+    }
+    us_set_vm(us, 0);
+}
+
+static void test_gc(US* us)
+{
+    static const int garbage = 10000;
+    GCStats stats;
+
+    // start from a clean heap, then make lots of string garbage, making sure
+    // the arena does not collect any of it on its own
+    us_gc(us, &stats);
+    long live = stats.live_cells;
+    ArenaCollect* collect = us->arena->collect;
+    us->arena->collect = 0;
+    for (int j = 0; j < garbage; ++j) {
+        cell_create_string(us, "In a hole in the ground there lived a hobbit...", 0);
+    }
+    us->arena->collect = collect;
+    int pools = us->arena->cell_pools;
+    int chunks = us->arena->string_chunks;
+
+    int freed = us_gc(us, &stats);
+    if (freed == garbage && stats.freed_cells == garbage && stats.live_cells == live) {
+        printf("ok gc freed %d cells, %ld live\n", freed, stats.live_cells);
+    } else {
+        printf("BAD gc freed %d cells, %ld live, expected %d and %ld\n", freed, stats.live_cells, garbage, live);
+    }
+    int empty = 0;
+    for (CellPool* pool = us->arena->cells; pool; pool = pool->next) {
+        empty += pool->mask == POOL_EMPTY;
+    }
+    if (stats.freed_pools > 0 && us->arena->cell_pools < pools && empty <= us->arena->max_empty_pools) {
+        printf("ok gc released %ld pools, %ld bytes\n", stats.freed_pools, stats.freed_bytes);
+    } else {
+        printf("BAD gc released %ld pools, %d of %d remain, %d empty\n", stats.freed_pools, us->arena->cell_pools, pools, empty);
+    }
+    if (us->arena->string_chunks < chunks / 2) {
+        printf("ok gc released string chunks, %d of %d remain\n", us->arena->string_chunks, chunks);
+    } else {
+        printf("BAD gc released string chunks, %d of %d remain\n", us->arena->string_chunks, chunks);
+    }
+
+    freed = us_gc(us, &stats);
+    if (freed == 0 && stats.freed_bytes == 0 && stats.live_cells == live) {
+        printf("ok gc nothing left to free\n");
+    } else {
+        printf("BAD gc freed %d cells, %ld bytes on a clean heap\n", freed, stats.freed_bytes);
+    }
+}
+
+// Evaluating (fib 20) creates hundreds of thousands of cells, almost all of
+// them garbage right away; the arena must collect them while evaluating.
+static void test_gc_during_eval(US* us)
+{
+    static const int max_pools = 256;
+    us_gc(us, 0);
+    Cell* c = us_eval_str(us, "((lambda (n) (begin (define fib (lambda (n) (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2)))))) (fib n))) 20)");
+    test_cell("gc_during_eval", c, "6765");
+    int pools = us->arena->cell_pools + us->arena->env_pools;
+    if (pools <= max_pools) {
+        printf("ok gc during eval kept arena at %d pools\n", pools);
+    } else {
+        printf("BAD gc during eval grew arena to %d pools, expected at most %d\n", pools, max_pools);
+    }
+}
+
+// Marking must not recurse along a list, or this would blow the C stack.
+static void test_gc_long_list(US* us)
+{
+    static const int length = 1000000;
+    GCStats stats;
+
+    us_gc(us, &stats);
+    long live = stats.live_cells;
+    Cell* list = nil;
+    gc_push_cell(us->gc, &list);
+    for (int j = 0; j < length; ++j) {
+        list = cell_cons(us, cell_create_int(us, j), list);
+    }
+    // the integers are fixnums, so each element is just its cons cell
+    us_gc(us, &stats);
+    if (stats.live_cells == live + length) {
+        printf("ok gc kept list of %d elements, %ld live cells, %ld us\n", length, stats.live_cells, stats.pause_us);
+    } else {
+        printf("BAD gc kept %ld live cells, expected %ld\n", stats.live_cells, live + length);
+    }
+    gc_pop(us->gc, 1);
+
+    us_gc(us, &stats);
+    if (stats.live_cells == live && stats.freed_cells == length) {
+        printf("ok gc freed list of %d elements, %ld us\n", length, stats.pause_us);
+    } else {
+        printf("BAD gc freed %ld cells, expected %d\n", stats.freed_cells, length);
+    }
+}
+
+static void test_gc_policy(US* us)
+{
+    static const char* define = "(define fib (lambda (n) (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2))))))";
+    us_eval_str(us, define);
+
+    // this is only about major collections
+    us_set_gc_nursery(us, 0);
+
+    // with a big enough minimum heap, we never collect on our own
+    us_set_gc_policy(us, 2.0, 100000);
+    us_gc(us, 0);
+    long collections = us->gc->collections;
+    Cell* c = us_eval_str(us, "(fib 15)");
+    test_cell("gc_policy", c, "610");
+    int pools = us->arena->cell_pools + us->arena->env_pools;
+    if (us->gc->collections == collections && pools > us->gc->last.live_pools) {
+        printf("ok gc policy did not collect below minimum heap, %d pools\n", pools);
+    } else {
+        printf("BAD gc policy collected %ld times below minimum heap, %d pools\n", us->gc->collections - collections, pools);
+    }
+
+    // with a small minimum heap, we collect whenever the heap grows by the
+    // given factor over the live heap; on top of that, each sweep may keep
+    // some empty pools around
+    us_set_gc_policy(us, 1.5, 8);
+    us_gc(us, 0);
+    collections = us->gc->collections;
+    c = us_eval_str(us, "(fib 15)");
+    test_cell("gc_policy", c, "610");
+    pools = us->arena->cell_pools + us->arena->env_pools;
+    if (us->gc->collections > collections &&
+        pools <= us->gc->collect_at + 2 * us->arena->max_empty_pools + 1) {
+        printf("ok gc policy collected %ld times, %d pools\n", us->gc->collections - collections, pools);
+    } else {
+        printf("BAD gc policy collected %ld times, %d pools, next at %d\n", us->gc->collections - collections, pools, us->gc->collect_at);
+    }
+
+    us_set_gc_policy(us, 2.0, 64);
+    us_set_gc_nursery(us, GC_DEFAULT_NURSERY);
+}
+
+static void test_gc_minor(US* us)
+{
+    static const char* define = "(define fib (lambda (n) (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2))))))";
+    us_eval_str(us, define);
+    us_eval_str(us, "(define make-box (lambda (v) (lambda (x) (if (= x 0) v (set! v x)))))");
+    us_eval_str(us, "(define box (make-box 0))");
+
+    // make everything old, then only do minor collections, and lots of them
+    us_set_gc_policy(us, 2.0, 100000);
+    us_set_gc_nursery(us, 256);
+    us_gc(us, 0);
+    long collections = us->gc->collections;
+    long minors = us->gc->minors;
+
+    // old envs now point to young cells: the global env and the box's env
+    us_eval_str(us, "(define keep (cons 1 (cons 2 3)))");
+    us_eval_str(us, "(box 1234567)");
+
+    Cell* c = us_eval_str(us, "(fib 15)");
+    test_cell("gc_minor", c, "610");
+    if (us->gc->minors > minors && us->gc->collections == collections) {
+        printf("ok gc minor ran %ld minor collections and no major ones\n", us->gc->minors - minors);
+    } else {
+        printf("BAD gc minor ran %ld minor and %ld major collections\n", us->gc->minors - minors, us->gc->collections - collections);
+    }
+    c = us_eval_str(us, "(car (cdr keep))");
+    test_cell("gc_minor remembered define", c, "2");
+    c = us_eval_str(us, "(box 0)");
+    test_cell("gc_minor remembered set!", c, "1234567");
+
+    GCStats stats;
+    gc_collect_minor(us, &stats);
+    if (stats.minor && stats.freed_cells >= 0) {
+        printf("ok gc minor stats, freed %ld cells, promoted %ld\n", stats.freed_cells, stats.live_cells);
+    } else {
+        printf("BAD gc minor stats, minor is %d\n", stats.minor);
+    }
+
+    us_set_gc_policy(us, 2.0, 64);
+    us_set_gc_nursery(us, GC_DEFAULT_NURSERY);
+}
+
+// Run some allocation-heavy code while holding on to a big live heap, which a
+// major collection has to mark every time and a minor collection never does.
+static void bench_gc_nursery(US* us)
+{
+    static const char* define = "(define fib (lambda (n) (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2))))))";
+    static const int length = 100000;
+    us_eval_str(us, define);
+    Cell* list = nil;
+    gc_push_cell(us->gc, &list);
+    for (int j = 0; j < length; ++j) {
+        list = cell_cons(us, cell_create_int(us, j), list);
+    }
+    long sizes[] = { 0, GC_DEFAULT_NURSERY };
+    for (int j = 0; j < (int) (sizeof(sizes) / sizeof(sizes[0])); ++j) {
+        us_set_gc_nursery(us, sizes[j]);
+        us_gc(us, 0);
+        long collections = us->gc->collections;
+        long minors = us->gc->minors;
+        us->gc->pause_max_us = 0;
+        long t0 = timer_now_us();
+        us_eval_str(us, "(fib 22)");
+        long t1 = timer_now_us();
+        printf("bench gc nursery %5ld: %7ld us, %4ld minor, %3ld major collections, max pause %5ld us\n",
+               sizes[j], t1 - t0, us->gc->minors - minors, us->gc->collections - collections, us->gc->pause_max_us);
+    }
+    gc_pop(us->gc, 1);
+    us_set_gc_nursery(us, GC_DEFAULT_NURSERY);
+}
+
+static long count_pauses(US* us)
+{
+    long counts[GC_PAUSE_BUCKETS];
+    int n = us_gc_pauses(us, counts, GC_PAUSE_BUCKETS);
+    long total = 0;
+    for (int j = 0; j < n; ++j) {
+        total += counts[j];
+    }
+    return total;
+}
+
+static void test_gc_incremental(US* us)
+{
+    static const char* define = "(define fib (lambda (n) (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2))))))";
+    us_eval_str(us, define);
+    us_eval_str(us, "(define make-box (lambda (v) (lambda (x) (if (= x 0) v (set! v x)))))");
+    us_eval_str(us, "(define box (make-box 0))");
+    us_eval_str(us, "(define keep (cons 1 (cons 2 3)))");
+
+    // only major collections, all of them incremental, and often
+    us_set_gc_nursery(us, 0);
+    us_set_gc_policy(us, 1.5, 8);
+    us_set_gc_incremental(us, 32);
+    us_gc(us, 0);
+    long collections = us->gc->collections;
+    long pauses = count_pauses(us);
+
+    // values stored while marking must survive
+    Cell* c = us_eval_str(us, "(begin (fib 12) (box 7654321) (set! keep (cons 4 (cons 5 6))) (fib 15))");
+    test_cell("gc_incremental", c, "610");
+    c = us_eval_str(us, "(car (cdr keep))");
+    test_cell("gc_incremental stored by set!", c, "5");
+    c = us_eval_str(us, "(box 0)");
+    test_cell("gc_incremental stored in closure", c, "7654321");
+
+    collections = us->gc->collections - collections;
+    pauses = count_pauses(us) - pauses;
+    if (collections > 0 && pauses > collections) {
+        printf("ok gc incremental ran %ld collections in %ld pauses\n", collections, pauses);
+    } else {
+        printf("BAD gc incremental ran %ld collections in %ld pauses\n", collections, pauses);
+    }
+
+    // a full collection can happen in the middle of an incremental one
+    us_eval_str(us, "(fib 10)");
+    us_gc(us, 0);
+    c = us_eval_str(us, "(fib 10)");
+    test_cell("gc_incremental full collection", c, "55");
+
+    us_set_gc_incremental(us, 0);
+    us_set_gc_policy(us, 2.0, 64);
+    us_set_gc_nursery(us, GC_DEFAULT_NURSERY);
+}
+
+// Same as bench_gc_nursery, but comparing major collections that stop the
+// world to incremental ones.
+static void bench_gc_incremental(US* us)
+{
+    static const char* define = "(define fib (lambda (n) (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2))))))";
+    static const int length = 100000;
+    us_eval_str(us, define);
+    Cell* list = nil;
+    gc_push_cell(us->gc, &list);
+    for (int j = 0; j < length; ++j) {
+        list = cell_cons(us, cell_create_int(us, j), list);
+    }
+    us_set_gc_nursery(us, 0);
+    us_set_gc_policy(us, 1.2, 64);
+    int slices[] = { 0, 256 };
+    for (int j = 0; j < (int) (sizeof(slices) / sizeof(slices[0])); ++j) {
+        us_set_gc_incremental(us, slices[j]);
+        us_gc(us, 0);
+        long collections = us->gc->collections;
+        long pauses = count_pauses(us);
+        us->gc->pause_max_us = 0;
+        long t0 = timer_now_us();
+        us_eval_str(us, "(fib 22)");
+        long t1 = timer_now_us();
+        printf("bench gc incremental %3d: %7ld us, %3ld collections, %6ld pauses, max pause %5ld us\n",
+               slices[j], t1 - t0, us->gc->collections - collections, count_pauses(us) - pauses, us->gc->pause_max_us);
     }
+    gc_pop(us->gc, 1);
+    us_set_gc_incremental(us, 0);
+    us_set_gc_policy(us, 2.0, 64);
+    us_set_gc_nursery(us, GC_DEFAULT_NURSERY);
 }
 
 int main(int argc, char* argv[])
@@ -591,15 +1617,37 @@ int main(int argc, char* argv[])
     US* us = us_create();
 
     test_arena();
+    test_arena_frames();
+    test_arena_classes();
+    bench_arena();
     test_globals();
     test_strings(us);
     test_integers(us);
     test_reals(us);
     test_lists(us);
     test_symbol(us);
+    test_intern(us);
+    test_scan(us);
     test_parser(us);
+    test_eval_forms(us);
+    test_load_file(us);
+    bench_parser(us);
     test_eval_simple(us);
     test_eval_complex(us);
+    test_resolve(us);
+    test_tail_calls(us);
+    test_natives(us);
+    test_analyze(us);
+    test_vm(us);
+    bench_vm(us);
+    test_gc(us);
+    test_gc_during_eval(us);
+    test_gc_long_list(us);
+    test_gc_policy(us);
+    test_gc_minor(us);
+    bench_gc_nursery(us);
+    test_gc_incremental(us);
+    bench_gc_incremental(us);
 
     us_destroy(us);
     return 0;
@@ -0,0 +1,153 @@
+#include <string.h>
+#include "cell.h"
+#include "intern.h"
+
+#if !defined(MEM_DEBUG)
+#define MEM_DEBUG 0
+#endif
+#include "mem.h"
+
+// #define LOG_LEVEL LOG_LEVEL_DEBUG
+#include "log.h"
+
+// Initial number of buckets (as a power of two) for an intern table
+#define INTERN_BITS 8
+
+// These are the special form symbols, with a single unique instance
+static Cell cell_quote  = { CELL_SYMBOL, 5, { .sval = "quote"  } };
+static Cell cell_if     = { CELL_SYMBOL, 2, { .sval = "if"     } };
+static Cell cell_define = { CELL_SYMBOL, 6, { .sval = "define" } };
+static Cell cell_set    = { CELL_SYMBOL, 4, { .sval = "set!"   } };
+static Cell cell_lambda = { CELL_SYMBOL, 6, { .sval = "lambda" } };
+
+// Global references to the special form symbols
+Cell* sym_quote  = &cell_quote;
+Cell* sym_if     = &cell_if;
+Cell* sym_define = &cell_define;
+Cell* sym_set    = &cell_set;
+Cell* sym_lambda = &cell_lambda;
+
+static int is_special(const Cell* cell);
+static void seed(Intern* intern, Cell* cell);
+static void insert(Intern* intern, Cell* cell);
+static void grow(Intern* intern);
+
+Intern* intern_create(void)
+{
+    Intern* intern = 0;
+    MEM_ALLOC_TYPE(intern, 1, Intern);
+    intern->bits = INTERN_BITS;
+    MEM_ALLOC_TYPE(intern->cells, 1 << intern->bits, Cell*);
+    seed(intern, sym_quote);
+    seed(intern, sym_if);
+    seed(intern, sym_define);
+    seed(intern, sym_set);
+    seed(intern, sym_lambda);
+    LOG(INFO, ("INTERN: created %p", intern));
+    return intern;
+}
+
+void intern_destroy(Intern* intern)
+{
+    int size = 1 << intern->bits;
+    LOG(INFO, ("INTERN: destroying %p, %d symbols", intern, intern->used));
+    for (int j = 0; j < size; ++j) {
+        Cell* cell = intern->cells[j];
+        if (!cell || is_special(cell)) {
+            continue;
+        }
+        MEM_FREE_SIZE(cell, sizeof(Cell) + cell->len + 1);
+    }
+    MEM_FREE_TYPE(intern->cells, size, Cell*);
+    MEM_FREE_TYPE(intern, 1, Intern);
+}
+
+Cell* intern_symbol(Intern* intern, const char* name, int len)
+{
+    if (len <= 0) {
+        len = name ? strlen(name) : 0;
+    }
+
+    unsigned long full = intern_hash(name, len);
+    unsigned long mask = (1UL << intern->bits) - 1;
+    for (unsigned long h = full & mask; intern->cells[h]; h = (h + 1) & mask) {
+        Cell* cell = intern->cells[h];
+        if (cell->hash == full && cell->len == len && memcmp(cell->sval, name, len) == 0) {
+            return cell;
+        }
+    }
+
+    // Not found, so create it; keep the load factor below 1/2, so that
+    // probe sequences stay short
+    if (2 * (intern->used + 1) > (1 << intern->bits)) {
+        grow(intern);
+    }
+    // the name is kept right after the cell, in the same block
+    char* mem = 0;
+    MEM_ALLOC_SIZE(mem, sizeof(Cell) + len + 1);
+    Cell* cell = (Cell*) mem;
+    cell->tag = CELL_SYMBOL;
+    cell->sval = (char*) (cell + 1);
+    cell->len = len;
+    if (len) {
+        memcpy(cell->sval, name, len);
+    }
+    cell->sval[len] = '\0';
+    cell->hash = full;
+    insert(intern, cell);
+    LOG(DEBUG, ("INTERN: created symbol [%s]", cell->sval));
+    return cell;
+}
+
+static int is_special(const Cell* cell)
+{
+    return (cell == sym_quote  ||
+            cell == sym_if     ||
+            cell == sym_define ||
+            cell == sym_set    ||
+            cell == sym_lambda);
+}
+
+// Add one of the special form symbols
+static void seed(Intern* intern, Cell* cell)
+{
+    cell->hash = intern_hash(cell->sval, cell->len);
+    insert(intern, cell);
+}
+
+// I've had nice results with djb2 by Dan Bernstein.
+unsigned long intern_hash(const char* str, int len)
+{
+    unsigned long hash = 5381;
+    for (int j = 0; j < len; ++j) {
+        hash = ((hash << 5) + hash) + (unsigned char) str[j]; // hash * 33 + c
+    }
+    return hash;
+}
+
+static void insert(Intern* intern, Cell* cell)
+{
+    unsigned long mask = (1UL << intern->bits) - 1;
+    unsigned long h = cell->hash & mask;
+    while (intern->cells[h]) {
+        h = (h + 1) & mask;
+    }
+    intern->cells[h] = cell;
+    ++intern->used;
+}
+
+static void grow(Intern* intern)
+{
+    Cell** cells = intern->cells;
+    int size = 1 << intern->bits;
+    ++intern->bits;
+    intern->used = 0;
+    MEM_ALLOC_TYPE(intern->cells, 1 << intern->bits, Cell*);
+    for (int j = 0; j < size; ++j) {
+        if (cells[j]) {
+            insert(intern, cells[j]);
+        }
+    }
+    MEM_FREE_TYPE(cells, size, Cell*);
+    LOG(DEBUG, ("INTERN: grew to %d buckets", 1 << intern->bits));
+}
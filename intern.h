@@ -0,0 +1,39 @@
+#ifndef INTERN_H_
+#define INTERN_H_
+
+// An intern table makes sure that each distinct symbol name exists only once,
+// as a single symbol cell; so symbols, and their names, can be compared just
+// by address.  These cells live outside the arena, are never collected, and
+// are owned by the table; each one is allocated in a single block together
+// with its name.  Each symbol cell also keeps the hash of its name, computed
+// only once, when it is interned.
+
+// Define our structures
+struct Cell;
+
+// An open addressing hash set of symbol cells, keyed by name
+typedef struct Intern {
+    struct Cell** cells;    // symbol cells; 0 means an empty bucket
+    int bits;               // log2 of the number of buckets
+    int used;               // number of symbols stored
+} Intern;
+
+// Symbols for the special forms; they have a single unique instance, shared
+// by all intern tables
+extern struct Cell* sym_quote;
+extern struct Cell* sym_if;
+extern struct Cell* sym_define;
+extern struct Cell* sym_set;
+extern struct Cell* sym_lambda;
+
+Intern* intern_create(void);
+void intern_destroy(Intern* intern);
+
+// Get the unique symbol cell for a name, creating it if necessary; if len is
+// zero, name must be null-terminated, otherwise it may contain nulls
+struct Cell* intern_symbol(Intern* intern, const char* name, int len);
+
+// Hash len bytes of a name; strings cache it too
+unsigned long intern_hash(const char* name, int len);
+
+#endif
@@ -20,6 +20,23 @@ void* mem_alloc(const char* file, int line, int count, int size, int zero)
     return mem;
 }
 
+void* mem_alloc_aligned(const char* file, int line, int align, int count, int size)
+{
+    mem_check_and_register();
+
+    int total = count * size;
+    void* mem = 0;
+    if (posix_memalign(&mem, align, total) != 0) {
+        mem = 0;
+    }
+    if (mem) {
+        memset(mem, 0, total);
+    }
+    fprintf(stderr, "MEM A %d %d %d %p %s %d\n", count, size, total, mem, file, line);
+    mem_total_alloc += total;
+    return mem;
+}
+
 void mem_free(const char* file, int line, int count, int size, void* mem)
 {
     mem_check_and_register();
@@ -17,6 +17,10 @@
     do { \
         v = (char*) mem_alloc(__FILE__, __LINE__, 1, s, 0); \
     } while (0)
+#define MEM_ALLOC_ALIGNED(v, a, c, t) \
+    do { \
+        v = (t*) mem_alloc_aligned(__FILE__, __LINE__, a, c, sizeof(t)); \
+    } while (0)
 #define MEM_ALLOC_STRDUP(v, s) \
     do { \
         int l = strlen(s) + 1; \
@@ -46,6 +50,13 @@
     do { \
         v = (char*) malloc(s); \
     } while (0)
+#define MEM_ALLOC_ALIGNED(v, a, c, t) \
+    do { \
+        void* m = 0; \
+        if (posix_memalign(&m, a, (c) * sizeof(t)) != 0) m = 0; \
+        if (m) memset(m, 0, (c) * sizeof(t)); \
+        v = (t*) m; \
+    } while (0)
 #define MEM_ALLOC_STRDUP(v, s) \
     do { \
         int l = strlen(s) + 1; \
@@ -67,6 +78,7 @@
 #endif
 
 void* mem_alloc(const char* file, int line, int count, int size, int zero);
+void* mem_alloc_aligned(const char* file, int line, int align, int count, int size);
 void mem_free(const char* file, int line, int count, int size, void* mem);
 
 #endif
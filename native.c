@@ -1,6 +1,7 @@
 #include <string.h>
 #include "us.h"
 #include "cell.h"
+#include "gc.h"
 #include "native.h"
 
 // #define LOG_LEVEL LOG_LEVEL_DEBUG
@@ -9,18 +10,36 @@
 static char dumper[10*1024];
 #endif
 
-#define CELL_LOOP(name, pos, args, body) \
+#define ARGS_LOOP(name, pos, argc, argv, body) \
     do { \
         LOG(DEBUG, ("Entering native %s", name)); \
-        for (Cell* c = args; c && c != nil; c = c->cons.cdr, ++pos) { \
-            Cell* arg = c->cons.car; \
+        for (pos = 0; pos < argc; ++pos) { \
+            Cell* arg = argv[pos]; \
             LOG(DEBUG, ("Arg #%d %s", pos, cell_dump(arg, 1, dumper))); \
-            do body while (0); \
+            body \
         } \
         LOG(DEBUG, ("Leaving native %s", name)); \
     } while (0)
 
-Cell* func_add(US* us, Cell* args)
+Cell* native_apply(US* us, Cell* proc, int argc, Cell** argv)
+{
+    Cell* ret = 0;
+    if (proc->nval.vfunc) {
+        ret = proc->nval.vfunc(us, argc, argv);
+    } else {
+        // the args are safe, and cell_cons keeps the list built so far safe
+        Cell* args = nil;
+        for (int j = argc - 1; j >= 0; --j) {
+            args = cell_cons(us, argv[j], args);
+        }
+        gc_push_cell(us->gc, &args);
+        ret = proc->nval.func(us, args);
+        gc_pop(us->gc, 1);
+    }
+    return ret ? ret : nil;
+}
+
+Cell* func_add(US* us, int argc, Cell** argv)
 {
     long iret = 0;
     double rret = 0.0;
@@ -28,9 +47,9 @@ Cell* func_add(US* us, Cell* args)
     int rsaw = 0;
     int ok = 1;
     int pos = 0;
-    CELL_LOOP("add", pos, args, {
-        switch (arg->tag) {
-            case CELL_INT : isaw = 1; iret += arg->ival; break;
+    ARGS_LOOP("add", pos, argc, argv, {
+        switch (CELL_TAG(arg)) {
+            case CELL_INT : isaw = 1; iret += CELL_IVAL(arg); break;
             case CELL_REAL: rsaw = 1; rret += arg->rval; break;
             default: ok = 0; break;
         }
@@ -42,7 +61,7 @@ Cell* func_add(US* us, Cell* args)
     return nil;
 }
 
-Cell* func_sub(US* us, Cell* args)
+Cell* func_sub(US* us, int argc, Cell** argv)
 {
     long iret = 0;
     double rret = 0.0;
@@ -50,16 +69,16 @@ Cell* func_sub(US* us, Cell* args)
     int rsaw = 0;
     int ok = 1;
     int pos = 0;
-    CELL_LOOP("sub", pos, args, {
+    ARGS_LOOP("sub", pos, argc, argv, {
         if (pos == 0) {
-            switch (arg->tag) {
-                case CELL_INT : isaw = 1; iret = arg->ival; break;
+            switch (CELL_TAG(arg)) {
+                case CELL_INT : isaw = 1; iret = CELL_IVAL(arg); break;
                 case CELL_REAL: rsaw = 1; rret = arg->rval; break;
                 default: ok = 0; break;
             }
         } else {
-            switch (arg->tag) {
-                case CELL_INT : isaw = 1; iret -= arg->ival; break;
+            switch (CELL_TAG(arg)) {
+                case CELL_INT : isaw = 1; iret -= CELL_IVAL(arg); break;
                 case CELL_REAL: rsaw = 1; rret -= arg->rval; break;
                 default: ok = 0; break;
             }
@@ -67,14 +86,14 @@ Cell* func_sub(US* us, Cell* args)
         if (!ok) break;
     });
     if (!ok) return nil;
-    if (pos == 0) return nil;
-    if (pos == 1) { iret = -iret; rret = -rret; }
+    if (argc == 0) return nil;
+    if (argc == 1) { iret = -iret; rret = -rret; }
     if (rsaw) return cell_create_real(us, rret + iret);
     if (isaw) return cell_create_int(us, iret);
     return nil;
 }
 
-Cell* func_mul(US* us, Cell* args)
+Cell* func_mul(US* us, int argc, Cell** argv)
 {
     long iret = 1;
     double rret = 1.0;
@@ -82,9 +101,9 @@ Cell* func_mul(US* us, Cell* args)
     int rsaw = 0;
     int ok = 1;
     int pos = 0;
-    CELL_LOOP("mul", pos, args, {
-        switch (arg->tag) {
-            case CELL_INT : isaw = 1; iret *= arg->ival; break;
+    ARGS_LOOP("mul", pos, argc, argv, {
+        switch (CELL_TAG(arg)) {
+            case CELL_INT : isaw = 1; iret *= CELL_IVAL(arg); break;
             case CELL_REAL: rsaw = 1; rret *= arg->rval; break;
             default: ok = 0; break;
         }
@@ -96,7 +115,7 @@ Cell* func_mul(US* us, Cell* args)
     return nil;
 }
 
-Cell* func_div(US* us, Cell* args)
+Cell* func_div(US* us, int argc, Cell** argv)
 {
     long iret = 0;
     double rret = 0.0;
@@ -104,35 +123,35 @@ Cell* func_div(US* us, Cell* args)
     int rsaw = 0;
     int ok = 1;
     int pos = 0;
-    CELL_LOOP("div", pos, args, {
+    ARGS_LOOP("div", pos, argc, argv, {
         if (pos == 0) {
-            switch (arg->tag) {
-                case CELL_INT : isaw = 1; iret = arg->ival; break;
+            switch (CELL_TAG(arg)) {
+                case CELL_INT : isaw = 1; iret = CELL_IVAL(arg); break;
                 case CELL_REAL: rsaw = 1; rret = arg->rval; break;
                 default: ok = 0; break;
             }
             continue;
         }
-        switch (arg->tag) {
+        switch (CELL_TAG(arg)) {
             case CELL_INT :
-                if (arg->ival == 0) {
+                if (CELL_IVAL(arg) == 0) {
                     ok = 0;
                     break;
                 }
                 if (isaw) {
-                    long tmp = iret / arg->ival;
-                    if ((tmp * arg->ival) == iret) {
+                    long tmp = iret / CELL_IVAL(arg);
+                    if ((tmp * CELL_IVAL(arg)) == iret) {
                         // exact long division
                         iret = tmp;
                         break;
                     } else {
                         // switch to using reals
-                        rret = (double) iret / (double) arg->ival;
+                        rret = (double) iret / (double) CELL_IVAL(arg);
                         isaw = 0;
                         rsaw = 1;
                     }
                 } else {
-                    rret /= (double) arg->ival;
+                    rret /= (double) CELL_IVAL(arg);
                 }
                 break;
 
@@ -155,8 +174,8 @@ Cell* func_div(US* us, Cell* args)
         if (!ok) break;
     });
     LOG(DEBUG, ("DIV: pos %d, ok %d, isaw %d, rsaw %d, iret %ld, rret %lf", pos, ok, isaw, rsaw, iret, rret));
-    if (pos == 0) return nil;
-    if (pos == 1) {
+    if (argc == 0) return nil;
+    if (argc == 1) {
         if (isaw) {
             if (iret == 0) {
                 ok = 0;
@@ -182,22 +201,22 @@ Cell* func_div(US* us, Cell* args)
     return nil;
 }
 
-Cell* func_eq(US* us, Cell* args)
+Cell* func_eq(US* us, int argc, Cell** argv)
 {
     (void) us;
     int ok = 1;
     int pos = 0;
     Cell* mem = 0;
-    CELL_LOOP("eq", pos, args, {
+    ARGS_LOOP("eq", pos, argc, argv, {
         if (!pos) { mem = arg; continue; }
-        if (mem->tag != arg->tag) { ok = 0; break; }
-        switch (mem->tag) {
+        if (CELL_TAG(mem) != CELL_TAG(arg)) { ok = 0; break; }
+        switch (CELL_TAG(mem)) {
             case CELL_NONE  : break;
-            case CELL_INT   : ok = mem->ival == arg->ival; break;
+            case CELL_INT   : ok = CELL_IVAL(mem) == CELL_IVAL(arg); break;
             case CELL_REAL  : ok = mem->rval == arg->rval; break;
-            case CELL_STRING: // fall through
-            case CELL_SYMBOL: ok = strcmp(mem->sval, arg->sval) == 0; break;
-            case CELL_NATIVE: ok = mem->nval.func == arg->nval.func; break;
+            case CELL_STRING: ok = cell_equal_strings(mem, arg); break;
+            case CELL_SYMBOL: ok = mem == arg; break; // interned
+            case CELL_NATIVE: ok = mem->nval.func == arg->nval.func && mem->nval.vfunc == arg->nval.vfunc; break;
             default: ok = 0; break;
         }
         if (!ok) { break; }
@@ -206,20 +225,20 @@ Cell* func_eq(US* us, Cell* args)
     return ok ? bool_t : bool_f;
 }
 
-Cell* func_gt(US* us, Cell* args)
+Cell* func_gt(US* us, int argc, Cell** argv)
 {
     (void) us;
     int ok = 1;
     int pos = 0;
     Cell* mem = 0;
-    CELL_LOOP("gt", pos, args, {
+    ARGS_LOOP("gt", pos, argc, argv, {
         if (!pos) { mem = arg; continue; }
-        if (mem->tag != arg->tag) { ok = 0; break; }
-        switch (mem->tag) {
-            case CELL_INT   : ok = mem->ival > arg->ival; break;
+        if (CELL_TAG(mem) != CELL_TAG(arg)) { ok = 0; break; }
+        switch (CELL_TAG(mem)) {
+            case CELL_INT   : ok = CELL_IVAL(mem) > CELL_IVAL(arg); break;
             case CELL_REAL  : ok = mem->rval > arg->rval; break;
             case CELL_STRING: // fall through
-            case CELL_SYMBOL: ok = strcmp(mem->sval, arg->sval) > 0; break;
+            case CELL_SYMBOL: ok = cell_compare_strings(mem, arg) > 0; break;
             default: ok = 0; break;
         }
         if (!ok) { break; }
@@ -229,20 +248,20 @@ Cell* func_gt(US* us, Cell* args)
     return ok ? bool_t : bool_f;
 }
 
-Cell* func_lt(US* us, Cell* args)
+Cell* func_lt(US* us, int argc, Cell** argv)
 {
     (void) us;
     int ok = 1;
     int pos = 0;
     Cell* mem = 0;
-    CELL_LOOP("lt", pos, args, {
+    ARGS_LOOP("lt", pos, argc, argv, {
         if (!pos) { mem = arg; continue; }
-        if (mem->tag != arg->tag) { ok = 0; break; }
-        switch (mem->tag) {
-            case CELL_INT   : ok = mem->ival < arg->ival; break;
+        if (CELL_TAG(mem) != CELL_TAG(arg)) { ok = 0; break; }
+        switch (CELL_TAG(mem)) {
+            case CELL_INT   : ok = CELL_IVAL(mem) < CELL_IVAL(arg); break;
             case CELL_REAL  : ok = mem->rval < arg->rval; break;
             case CELL_STRING: // fall through
-            case CELL_SYMBOL: ok = strcmp(mem->sval, arg->sval) < 0; break;
+            case CELL_SYMBOL: ok = cell_compare_strings(mem, arg) < 0; break;
             default: ok = 0; break;
         }
         if (!ok) { break; }
@@ -252,64 +271,56 @@ Cell* func_lt(US* us, Cell* args)
     return ok ? bool_t : bool_f;
 }
 
-Cell* func_cons(US* us, Cell* args)
+Cell* func_cons(US* us, int argc, Cell** argv)
 {
     Cell* ret = nil;
-    Cell* mem[2];
-    int pos = 0;
-    CELL_LOOP("cons", pos, args, {
-        if (pos >= 2) break;
-        mem[pos] = arg;
-    });
-    if (pos == 2) {
-        ret = cell_cons(us, mem[0], mem[1]);
+    if (argc == 2) {
+        ret = cell_cons(us, argv[0], argv[1]);
     }
     LOG(DEBUG, ("CONS: %s", cell_dump(ret, 1, dumper)));
     return ret;
 }
 
-Cell* func_car(US* us, Cell* args)
+Cell* func_car(US* us, int argc, Cell** argv)
 {
     (void) us;
     Cell* ret = nil;
-    Cell* mem[1];
-    int pos = 0;
-    CELL_LOOP("car", pos, args, {
-        if (pos >= 1) break;
-        mem[pos] = arg;
-    });
-    if (pos == 1) {
-        ret = cell_car(mem[0]);
+    if (argc == 1) {
+        ret = cell_car(argv[0]);
     }
     LOG(DEBUG, ("CAR: %s", cell_dump(ret, 1, dumper)));
     return ret;
 }
 
-Cell* func_cdr(US* us, Cell* args)
+Cell* func_cdr(US* us, int argc, Cell** argv)
 {
     (void) us;
     Cell* ret = nil;
-    Cell* mem[1];
-    int pos = 0;
-    CELL_LOOP("cdr", pos, args, {
-        if (pos >= 1) break;
-        mem[pos] = arg;
-    });
-    if (pos == 1) {
-        ret = cell_cdr(mem[0]);
+    if (argc == 1) {
+        ret = cell_cdr(argv[0]);
     }
     LOG(DEBUG, ("CDR: %s", cell_dump(ret, 1, dumper)));
     return ret;
 }
 
-Cell* func_begin(US* us, Cell* args)
+Cell* func_string_length(US* us, int argc, Cell** argv)
+{
+    Cell* ret = nil;
+    if (argc == 1 && CELL_TAG(argv[0]) == CELL_STRING) {
+        ret = cell_create_int(us, argv[0]->len);
+    }
+    LOG(DEBUG, ("STRING-LENGTH: %s", cell_dump(ret, 1, dumper)));
+    return ret;
+}
+
+Cell* func_begin(US* us, int argc, Cell** argv)
 {
     (void) us;
 
     // we don't really do anything here, except remember the last value
     Cell* ret = nil;
     int pos = 0;
-    CELL_LOOP("begin", pos, args, {
+    ARGS_LOOP("begin", pos, argc, argv, {
         ret = arg;
     });
     return ret;
@@ -5,26 +5,34 @@
 struct US;
 struct Cell;
 
-// Native implementations of several procedures
+// Call a native function, whatever way it wants its args; the args must be
+// safe from the GC
+struct Cell* native_apply(struct US* us, struct Cell* proc, int argc, struct Cell** argv);
+
+// Native implementations of several procedures; they all get their args as an
+// array
 
 // Math operations.  These try to be clever when mixing integers and reals, but
 // it is rather messy...
-struct Cell* func_add(struct US* us, struct Cell* args);
-struct Cell* func_sub(struct US* us, struct Cell* args);
-struct Cell* func_mul(struct US* us, struct Cell* args);
-struct Cell* func_div(struct US* us, struct Cell* args);
+struct Cell* func_add(struct US* us, int argc, struct Cell** argv);
+struct Cell* func_sub(struct US* us, int argc, struct Cell** argv);
+struct Cell* func_mul(struct US* us, int argc, struct Cell** argv);
+struct Cell* func_div(struct US* us, int argc, struct Cell** argv);
 
 // TODO: find out if this should be
 // eq, eqv, equals, or something else...
-struct Cell* func_eq(struct US* us, struct Cell* args);
+struct Cell* func_eq(struct US* us, int argc, struct Cell** argv);
+
+struct Cell* func_gt(struct US* us, int argc, struct Cell** argv);
+struct Cell* func_lt(struct US* us, int argc, struct Cell** argv);
 
-struct Cell* func_gt(struct US* us, struct Cell* args);
-struct Cell* func_lt(struct US* us, struct Cell* args);
+struct Cell* func_cons(struct US* us, int argc, struct Cell** argv);
+struct Cell* func_car(struct US* us, int argc, struct Cell** argv);
+struct Cell* func_cdr(struct US* us, int argc, struct Cell** argv);
 
-struct Cell* func_cons(struct US* us, struct Cell* args);
-struct Cell* func_car(struct US* us, struct Cell* args);
-struct Cell* func_cdr(struct US* us, struct Cell* args);
+// Strings know their length, so this takes constant time
+struct Cell* func_string_length(struct US* us, int argc, struct Cell** argv);
 
-struct Cell* func_begin(struct US* us, struct Cell* args);
+struct Cell* func_begin(struct US* us, int argc, struct Cell** argv);
 
 #endif
@@ -1,8 +1,9 @@
-#include <ctype.h>
 #include <string.h>
 #include "us.h"
 #include "cell.h"
+#include "gc.h"
 #include "parser.h"
+#include "scan.h"
 
 #if !defined(MEM_DEBUG)
 #define MEM_DEBUG 0
@@ -13,6 +14,9 @@
 #include "log.h"
 
 #define PARSER_DEFAULT_DEPTH 128
+#define PARSER_DEFAULT_FORMS 16
+#define PARSER_DEFAULT_TEXT  64
+#define PARSER_SCAN_MIN      16 // fewer chars left than this are not scanned
 
 // Possible parser->states for our parser; it starts in STATE_NORMAL
 #define STATE_NORMAL 0
@@ -32,147 +36,277 @@
 #define TOKEN_RPAREN 6
 #define TOKEN_LAST   7
 
-// Check and take action while parsing
-#define CHECK_STATE(u, p, s, t, n, b, c, d) \
-    if ((p)->state == (s)) {                 /* check current state  */ \
-        if (t != TOKEN_NONE) token(u, p, t); /* maybe emit token     */ \
-        (p)->state = n;                      /* switch to next state */ \
-        if (d >= 0) (p)->beg = (p)->pos + d; /* maybe remember pos   */ \
-        if (b) break;                        /* maybe break          */ \
-        if (c) continue;                     /* maybe continue       */ \
-    } \
+// Classes of chars, as far as our parser cares; any char not listed in
+// char_class below is CLASS_OTHER
+#define CLASS_OTHER  0
+#define CLASS_SPACE  1
+#define CLASS_DIGIT  2
+#define CLASS_SIGN   3
+#define CLASS_DOT    4
+#define CLASS_QUOTE  5
+#define CLASS_LPAREN 6
+#define CLASS_RPAREN 7
+#define CLASS_LAST   8
+
+// What to do on a char of a given class in a given state: emit up to two
+// tokens, switch to the next state and, unless beg is negative, remember where
+// the next token begins, relative to the current position
+typedef struct Transition {
+    unsigned char token;    // token to emit first, if any
+    unsigned char after;    // token to emit right after it, if any
+    unsigned char state;    // next state
+    signed char beg;        // offset for the beginning of the next token
+} Transition;
+
+static const unsigned char char_class[256] = {
+    [' ' ] = CLASS_SPACE,
+    ['\t'] = CLASS_SPACE,
+    ['\n'] = CLASS_SPACE,
+    ['\v'] = CLASS_SPACE,
+    ['\f'] = CLASS_SPACE,
+    ['\r'] = CLASS_SPACE,
+    ['0' ] = CLASS_DIGIT,
+    ['1' ] = CLASS_DIGIT,
+    ['2' ] = CLASS_DIGIT,
+    ['3' ] = CLASS_DIGIT,
+    ['4' ] = CLASS_DIGIT,
+    ['5' ] = CLASS_DIGIT,
+    ['6' ] = CLASS_DIGIT,
+    ['7' ] = CLASS_DIGIT,
+    ['8' ] = CLASS_DIGIT,
+    ['9' ] = CLASS_DIGIT,
+    ['+' ] = CLASS_SIGN,
+    ['-' ] = CLASS_SIGN,
+    ['.' ] = CLASS_DOT,
+    ['"' ] = CLASS_QUOTE,
+    ['(' ] = CLASS_LPAREN,
+    [')' ] = CLASS_RPAREN,
+};
+
+#define T(t, a, s, b) { TOKEN_##t, TOKEN_##a, STATE_##s, b }
+
+static const Transition transitions[STATE_LAST][CLASS_LAST] = {
+    [STATE_NORMAL] = {
+        [CLASS_OTHER ] = T(NONE  , NONE  , SYMBOL, +0),
+        [CLASS_SPACE ] = T(NONE  , NONE  , NORMAL, -1),
+        [CLASS_DIGIT ] = T(NONE  , NONE  , INT   , +0),
+        [CLASS_SIGN  ] = T(NONE  , NONE  , INT   , +0),
+        [CLASS_DOT   ] = T(NONE  , NONE  , REAL  , +0),
+        [CLASS_QUOTE ] = T(NONE  , NONE  , STRING, +1),
+        [CLASS_LPAREN] = T(LPAREN, NONE  , NORMAL, -1),
+        [CLASS_RPAREN] = T(RPAREN, NONE  , NORMAL, -1),
+    },
+    [STATE_INT] = {
+        [CLASS_OTHER ] = T(NONE  , NONE  , SYMBOL, -1), // 1/   is a valid symbol
+        [CLASS_SPACE ] = T(INT   , NONE  , NORMAL, -1),
+        [CLASS_DIGIT ] = T(NONE  , NONE  , INT   , -1),
+        [CLASS_SIGN  ] = T(NONE  , NONE  , SYMBOL, -1),
+        [CLASS_DOT   ] = T(NONE  , NONE  , REAL  , -1),
+        [CLASS_QUOTE ] = T(INT   , NONE  , STRING, +1),
+        [CLASS_LPAREN] = T(INT   , LPAREN, NORMAL, -1), // 34( is two tokens
+        [CLASS_RPAREN] = T(INT   , RPAREN, NORMAL, -1), // 34) is two tokens
+    },
+    [STATE_REAL] = {
+        [CLASS_OTHER ] = T(NONE  , NONE  , SYMBOL, -1), // 1.4/ is a valid symbol
+        [CLASS_SPACE ] = T(REAL  , NONE  , NORMAL, -1),
+        [CLASS_DIGIT ] = T(NONE  , NONE  , REAL  , -1),
+        [CLASS_SIGN  ] = T(NONE  , NONE  , SYMBOL, -1),
+        [CLASS_DOT   ] = T(NONE  , NONE  , SYMBOL, -1), // 123.4. is a valid symbol
+        [CLASS_QUOTE ] = T(REAL  , NONE  , STRING, +1),
+        [CLASS_LPAREN] = T(REAL  , LPAREN, NORMAL, -1), // 34.7( is two tokens
+        [CLASS_RPAREN] = T(REAL  , RPAREN, NORMAL, -1), // 34.7) is two tokens
+    },
+    [STATE_STRING] = {
+        [CLASS_OTHER ] = T(NONE  , NONE  , STRING, -1),
+        [CLASS_SPACE ] = T(NONE  , NONE  , STRING, -1),
+        [CLASS_DIGIT ] = T(NONE  , NONE  , STRING, -1),
+        [CLASS_SIGN  ] = T(NONE  , NONE  , STRING, -1),
+        [CLASS_DOT   ] = T(NONE  , NONE  , STRING, -1),
+        [CLASS_QUOTE ] = T(STRING, NONE  , NORMAL, +1),
+        [CLASS_LPAREN] = T(NONE  , NONE  , STRING, -1),
+        [CLASS_RPAREN] = T(NONE  , NONE  , STRING, -1),
+    },
+    [STATE_SYMBOL] = {
+        [CLASS_OTHER ] = T(NONE  , NONE  , SYMBOL, -1),
+        [CLASS_SPACE ] = T(SYMBOL, NONE  , NORMAL, -1),
+        [CLASS_DIGIT ] = T(NONE  , NONE  , SYMBOL, -1),
+        [CLASS_SIGN  ] = T(NONE  , NONE  , SYMBOL, -1),
+        [CLASS_DOT   ] = T(NONE  , NONE  , SYMBOL, -1),
+        [CLASS_QUOTE ] = T(SYMBOL, NONE  , STRING, +1),
+        [CLASS_LPAREN] = T(SYMBOL, LPAREN, NORMAL, -1), // abc( is two tokens
+        [CLASS_RPAREN] = T(SYMBOL, RPAREN, NORMAL, -1), // abc) is two tokens
+    },
+};
+
+#undef T
 
 static int token(US* us, Parser* parser, int token);
+static void add_form(Parser* parser, Cell* cell);
+static void add_text(Parser* parser, const char* str, int len);
+static void reserve_lists(Parser* parser);
 
-Parser* parser_create(int depth)
+Parser* parser_create(GC* gc, int depth)
 {
     Parser* parser = 0;
     MEM_ALLOC_TYPE(parser, 1, Parser);
 
     parser->depth = depth <= 0 ?  PARSER_DEFAULT_DEPTH : depth;
-    MEM_ALLOC_TYPE(parser->exp, parser->depth, Expression);
-
-    parser_reset(parser, 0);
+    MEM_ALLOC_TYPE(parser->lists, parser->depth, Cell*);
+    MEM_ALLOC_TYPE(parser->lasts, parser->depth, Cell*);
+    parser->form_size = PARSER_DEFAULT_FORMS;
+    MEM_ALLOC_TYPE(parser->forms, parser->form_size, Cell*);
+    parser->text_size = PARSER_DEFAULT_TEXT;
+    MEM_ALLOC_SIZE(parser->text, parser->text_size);
+    gc_push_cells(gc, &parser->lists, &parser->level);
+    gc_push_cells(gc, &parser->forms, &parser->form_used);
+
+    parser_reset(parser);
     LOG(INFO, ("created parser %p", parser));
     return parser;
 }
 
-void parser_destroy(Parser* parser)
+void parser_destroy(Parser* parser, GC* gc)
 {
     LOG(INFO, ("destroying parser %p", parser));
-    parser_reset(parser, 0);
-    MEM_FREE_TYPE(parser->exp, parser->depth, Expression);
+    gc_pop(gc, 2);
+    MEM_FREE_SIZE(parser->text, parser->text_size);
+    MEM_FREE_TYPE(parser->forms, parser->form_size, Cell*);
+    MEM_FREE_TYPE(parser->lasts, parser->depth, Cell*);
+    MEM_FREE_TYPE(parser->lists, parser->depth, Cell*);
     MEM_FREE_TYPE(parser, 1, Parser);
 }
 
-void parser_reset(Parser* parser, const char* str)
+void parser_reset(Parser* parser)
 {
     parser->level = 0;
-    LIST_RESET(parser->exp[0]);
+    parser->form_used = 0;
+    parser->form_next = 0;
+    parser->text_used = 0;
     parser->state = STATE_NORMAL;
-    parser->str = str;
+    parser->str = 0;
+    parser->place = 0;
     parser->pos = 0;
     parser->beg = 0;
 }
 
-Cell* parser_result(Parser* parser)
+Cell* parser_next(Parser* parser)
 {
-    Cell* cell = parser->exp[0].frst;
+    if (parser->form_next >= parser->form_used) {
+        return 0;
+    }
+    Cell* cell = parser->forms[parser->form_next++];
+    if (parser->form_next == parser->form_used) {
+        // all forms were taken, start over
+        parser->form_used = 0;
+        parser->form_next = 0;
+    }
     return cell;
 }
 
-void parser_parse(US* us, Parser* parser, const char* str)
+Cell* parser_result(Parser* parser)
 {
-    // Our parser is written this way so that it is ready to be translated to a
-    // much more efficient table lookup implementation.
-    for (parser_reset(parser, str); 1; ++parser->pos) {
-        if (str[parser->pos] == '\0') {
-            CHECK_STATE(us, parser, STATE_NORMAL, TOKEN_NONE  , STATE_NORMAL, 1, 0, -1);
-            CHECK_STATE(us, parser, STATE_INT   , TOKEN_INT   , STATE_NORMAL, 1, 0, -1);
-            CHECK_STATE(us, parser, STATE_REAL  , TOKEN_REAL  , STATE_NORMAL, 1, 0, -1);
-            CHECK_STATE(us, parser, STATE_STRING, TOKEN_NONE  , STATE_NORMAL, 1, 0, -1); // ERROR missing closing "
-            CHECK_STATE(us, parser, STATE_SYMBOL, TOKEN_SYMBOL, STATE_NORMAL, 1, 0, -1);
-            LOG(FATAL, ("unreachable code -- WTF?"));
-        }
-        if (str[parser->pos] == '"') {
-            CHECK_STATE(us, parser, STATE_NORMAL, TOKEN_NONE  , STATE_STRING, 0, 1, +1);
-            CHECK_STATE(us, parser, STATE_INT   , TOKEN_INT   , STATE_STRING, 0, 1, +1);
-            CHECK_STATE(us, parser, STATE_REAL  , TOKEN_REAL  , STATE_STRING, 0, 1, +1);
-            CHECK_STATE(us, parser, STATE_SYMBOL, TOKEN_SYMBOL, STATE_STRING, 0, 1, +1);
-            CHECK_STATE(us, parser, STATE_STRING, TOKEN_STRING, STATE_NORMAL, 0, 1, +1);
-            LOG(FATAL, ("unreachable code -- WTF?"));
-        }
-        if (str[parser->pos] == '(') {
-            CHECK_STATE(us, parser, STATE_STRING, TOKEN_NONE  , STATE_STRING, 0, 1, -1);
-            CHECK_STATE(us, parser, STATE_NORMAL, TOKEN_LPAREN, STATE_NORMAL, 0, 1, -1);
-
-            CHECK_STATE(us, parser, STATE_INT   , TOKEN_INT   , STATE_INT   , 0, 0, -1); // 34( is two tokens
-            CHECK_STATE(us, parser, STATE_INT   , TOKEN_LPAREN, STATE_NORMAL, 0, 1, -1);
-
-            CHECK_STATE(us, parser, STATE_REAL  , TOKEN_REAL  , STATE_REAL  , 0, 0, -1); // 34.7( is two tokens
-            CHECK_STATE(us, parser, STATE_REAL  , TOKEN_LPAREN, STATE_NORMAL, 0, 1, -1);
+    if (parser->form_next >= parser->form_used) {
+        return 0;
+    }
+    return parser->forms[parser->form_used - 1];
+}
 
-            CHECK_STATE(us, parser, STATE_SYMBOL, TOKEN_SYMBOL, STATE_SYMBOL, 0, 0, -1); // abc( is two tokens
-            CHECK_STATE(us, parser, STATE_SYMBOL, TOKEN_LPAREN, STATE_NORMAL, 0, 1, -1);
-            LOG(FATAL, ("unreachable code -- WTF?"));
-        }
-        if (str[parser->pos] == ')') {
-            CHECK_STATE(us, parser, STATE_STRING, TOKEN_NONE  , STATE_STRING, 0, 1, -1);
-            CHECK_STATE(us, parser, STATE_NORMAL, TOKEN_RPAREN, STATE_NORMAL, 0, 1, -1);
+void parser_parse(US* us, Parser* parser, const char* str)
+{
+    parser_reset(parser);
+    parser_feed(us, parser, str, -1);
+    parser_finish(us, parser);
+}
 
-            CHECK_STATE(us, parser, STATE_INT   , TOKEN_INT   , STATE_INT   , 0, 0, -1); // 34) is two tokens
-            CHECK_STATE(us, parser, STATE_INT   , TOKEN_RPAREN, STATE_NORMAL, 0, 1, -1);
+int parser_feed(US* us, Parser* parser, const char* str, int len)
+{
+    if (len < 0) {
+        len = strlen(str);
+    }
 
-            CHECK_STATE(us, parser, STATE_REAL  , TOKEN_REAL  , STATE_REAL  , 0, 0, -1); // 34.7) is two tokens
-            CHECK_STATE(us, parser, STATE_REAL  , TOKEN_RPAREN, STATE_NORMAL, 0, 1, -1);
+    // Any token cut by the end of the previous chunk goes on from the start
+    // of this one.
+    parser->str = str;
+    parser->beg = 0;
 
-            CHECK_STATE(us, parser, STATE_SYMBOL, TOKEN_SYMBOL, STATE_SYMBOL, 0, 0, -1); // abc) is two tokens
-            CHECK_STATE(us, parser, STATE_SYMBOL, TOKEN_RPAREN, STATE_NORMAL, 0, 1, -1);
-            LOG(FATAL, ("unreachable code -- WTF?"));
-        }
-        if (str[parser->pos] == '+' ||
-            str[parser->pos] == '-') {
-            CHECK_STATE(us, parser, STATE_NORMAL, TOKEN_NONE  , STATE_INT   , 0, 1, +0);
-            CHECK_STATE(us, parser, STATE_INT   , TOKEN_NONE  , STATE_SYMBOL, 0, 1, -1);
-            CHECK_STATE(us, parser, STATE_REAL  , TOKEN_NONE  , STATE_SYMBOL, 0, 1, -1);
-            CHECK_STATE(us, parser, STATE_STRING, TOKEN_NONE  , STATE_STRING, 0, 1, -1);
-            CHECK_STATE(us, parser, STATE_SYMBOL, TOKEN_NONE  , STATE_SYMBOL, 0, 1, -1);
-            LOG(FATAL, ("unreachable code -- WTF?"));
-        }
-        if (str[parser->pos] == '.') {
-            CHECK_STATE(us, parser, STATE_NORMAL, TOKEN_NONE  , STATE_REAL  , 0, 1, +0);
-            CHECK_STATE(us, parser, STATE_INT   , TOKEN_NONE  , STATE_REAL  , 0, 1, -1);
-            CHECK_STATE(us, parser, STATE_REAL  , TOKEN_NONE  , STATE_SYMBOL, 0, 1, -1); // 123.4. is a valid symbol
-            CHECK_STATE(us, parser, STATE_STRING, TOKEN_NONE  , STATE_STRING, 0, 1, -1);
-            CHECK_STATE(us, parser, STATE_SYMBOL, TOKEN_NONE  , STATE_SYMBOL, 0, 1, -1);
-            LOG(FATAL, ("unreachable code -- WTF?"));
+    // Each char takes one lookup for its class and one for what to do with
+    // it in the current state; tokens are only emitted when they end.  Inside
+    // a string or a symbol, all chars up to the one that ends it would keep us
+    // in the same state; if the CPU can scan many chars at a time, we skip over
+    // them that way, but only when there are enough of them left to pay for
+    // the call.
+    int scan = scan_current() != SCAN_SCALAR;
+    int state = parser->state;
+    for (int pos = 0; pos < len; ++pos) {
+        const Transition* t = &transitions[state][char_class[(unsigned char) str[pos]]];
+        if (t->token != TOKEN_NONE) {
+            parser->pos = pos;
+            token(us, parser, t->token);
+            if (t->after != TOKEN_NONE) {
+                token(us, parser, t->after);
+            }
         }
-        if (isspace(str[parser->pos])) {
-            CHECK_STATE(us, parser, STATE_NORMAL, TOKEN_NONE  , STATE_NORMAL, 0, 1, -1);
-            CHECK_STATE(us, parser, STATE_INT   , TOKEN_INT   , STATE_NORMAL, 0, 1, -1);
-            CHECK_STATE(us, parser, STATE_REAL  , TOKEN_REAL  , STATE_NORMAL, 0, 1, -1);
-            CHECK_STATE(us, parser, STATE_SYMBOL, TOKEN_SYMBOL, STATE_NORMAL, 0, 1, -1);
-            CHECK_STATE(us, parser, STATE_STRING, TOKEN_NONE  , STATE_STRING, 0, 1, -1);
-            LOG(FATAL, ("unreachable code -- WTF?"));
+        state = t->state;
+        if (t->beg >= 0) {
+            parser->beg = pos + t->beg;
         }
-        if (isdigit(str[parser->pos])) {
-            CHECK_STATE(us, parser, STATE_NORMAL, TOKEN_NONE  , STATE_INT   , 0, 1, +0);
-            CHECK_STATE(us, parser, STATE_INT   , TOKEN_NONE  , STATE_INT   , 0, 1, -1);
-            CHECK_STATE(us, parser, STATE_REAL  , TOKEN_NONE  , STATE_REAL  , 0, 1, -1);
-            CHECK_STATE(us, parser, STATE_STRING, TOKEN_NONE  , STATE_STRING, 0, 1, -1);
-            CHECK_STATE(us, parser, STATE_SYMBOL, TOKEN_NONE  , STATE_SYMBOL, 0, 1, -1);
-            LOG(FATAL, ("unreachable code -- WTF?"));
+        if (!scan || len - pos <= PARSER_SCAN_MIN) {
+            continue;
         }
-        if (1) {
-            CHECK_STATE(us, parser, STATE_NORMAL, TOKEN_NONE  , STATE_SYMBOL, 0, 1, +0);
-            CHECK_STATE(us, parser, STATE_INT   , TOKEN_NONE  , STATE_SYMBOL, 0, 1, -1); // 1/   is a valid symbol
-            CHECK_STATE(us, parser, STATE_REAL  , TOKEN_NONE  , STATE_SYMBOL, 0, 1, -1); // 1.4/ is a valid symbol
-            CHECK_STATE(us, parser, STATE_STRING, TOKEN_NONE  , STATE_STRING, 0, 1, -1);
-            CHECK_STATE(us, parser, STATE_SYMBOL, TOKEN_NONE  , STATE_SYMBOL, 0, 1, -1);
-            LOG(FATAL, ("unreachable code -- WTF?"));
+        if (state == STATE_STRING) {
+            pos = scan_string(str, pos + 1, len) - 1;
+        } else if (state == STATE_SYMBOL) {
+            pos = scan_symbol(str, pos + 1, len) - 1;
         }
-        LOG(FATAL, ("unreachable code -- WTF?"));
     }
+    parser->state = state;
+
+    // keep whatever we have of a token cut by the end of this chunk
+    if (parser->state != STATE_NORMAL) {
+        add_text(parser, str + parser->beg, len - parser->beg);
+    }
+    parser->str = 0;
+    parser->pos = 0;
+    parser->beg = 0;
+    return parser->form_used - parser->form_next;
+}
+
+int parser_feed_in_place(US* us, Parser* parser, char* str, int len)
+{
+    parser->place = str;
+    int ready = parser_feed(us, parser, str, len);
+    parser->place = 0;
+    return ready;
+}
+
+int parser_finish(US* us, Parser* parser)
+{
+    // whatever token we were in, all of it was kept as text
+    parser->str = "";
+    switch (parser->state) {
+        case STATE_INT:
+            token(us, parser, TOKEN_INT);
+            break;
+        case STATE_REAL:
+            token(us, parser, TOKEN_REAL);
+            break;
+        case STATE_SYMBOL:
+            token(us, parser, TOKEN_SYMBOL);
+            break;
+        case STATE_STRING:
+            LOG(ERROR, ("missing closing quote for string"));
+            break;
+    }
+    parser->state = STATE_NORMAL;
+    parser->text_used = 0;
+    parser->str = 0;
+
+    // forget about any lists left open
+    if (parser->level > 0) {
+        LOG(ERROR, ("missing %d closing parens", parser->level));
+        parser->level = 0;
+    }
+    return parser->form_used - parser->form_next;
 }
 
 #if LOG_LEVEL <= LOG_LEVEL_DEBUG
@@ -189,7 +323,7 @@ static const char* Token[TOKEN_LAST] = {
 
 static int token(US* us, Parser* parser, int token)
 {
-    const char* tok = parser->str + parser->beg;;
+    const char* tok = parser->str + parser->beg;
     int len = 0;
     switch (token) {
         case TOKEN_INT:
@@ -197,9 +331,15 @@ static int token(US* us, Parser* parser, int token)
         case TOKEN_STRING:
         case TOKEN_SYMBOL:
             len = parser->pos - parser->beg;
+            if (parser->text_used) {
+                // the token began in an earlier chunk
+                add_text(parser, tok, len);
+                tok = parser->text;
+                len = parser->text_used;
+                parser->text_used = 0;
+            }
             break;
     }
-
     // There are some degenerate cases that are recognized as numbers, but
     // should really be symbols.
     if (len == 1 &&
@@ -228,15 +368,22 @@ static int token(US* us, Parser* parser, int token)
             break;
 
         case TOKEN_STRING:
-            cell = cell_create_string(us, tok, len);
+            if (parser->place && tok == parser->place + parser->beg) {
+                // the closing quote becomes the null for the string
+                parser->place[parser->pos] = '\0';
+                cell = cell_create_string_in_place(us, parser->place + parser->beg, len);
+                break;
+            }
+            // a zero len would mean tok is null-terminated, which it is not
+            cell = cell_create_string(us, len ? tok : "", len);
             break;
 
         case TOKEN_SYMBOL:
-            if (memcmp(tok, CELL_STR_BOOL_T, sizeof(CELL_STR_BOOL_T) - 1) == 0) {
+            if (len >= 2 && memcmp(tok, CELL_STR_BOOL_T, sizeof(CELL_STR_BOOL_T) - 1) == 0) {
                 cell = bool_t; // Special case: #t
                 break;
             }
-            if (memcmp(tok, CELL_STR_BOOL_F, sizeof(CELL_STR_BOOL_F) - 1) == 0) {
+            if (len >= 2 && memcmp(tok, CELL_STR_BOOL_F, sizeof(CELL_STR_BOOL_F) - 1) == 0) {
                 cell = bool_f; // Special case: #f
                 break;
             }
@@ -244,13 +391,20 @@ static int token(US* us, Parser* parser, int token)
             break;
 
         case TOKEN_LPAREN:
+            // the list being built is safe, since all lists are roots
+            reserve_lists(parser);
+            parser->lists[parser->level] = 0;
+            parser->lasts[parser->level] = 0;
             ++parser->level;
-            LIST_RESET(parser->exp[parser->level]);
             break;
 
         case TOKEN_RPAREN:
-            cell = parser->exp[parser->level].frst;
+            if (parser->level == 0) {
+                LOG(ERROR, ("unexpected closing paren"));
+                break;
+            }
             --parser->level;
+            cell = parser->lists[parser->level];
             if (!cell) {
                 cell = nil; // Special case: () => nil
             }
@@ -263,15 +417,72 @@ static int token(US* us, Parser* parser, int token)
         return 0;
     }
 
-    Expression* exp = &parser->exp[parser->level];
     if (parser->level == 0) {
-        LIST_RESET(*exp);
-        exp->frst = cell;
+        add_form(parser, cell);
         return 0;
     }
 
+    // cell_cons keeps cell safe
+    int top = parser->level - 1;
     Cell* c = cell_cons(us, cell, nil);
-    LIST_APPEND(exp, c);
+    if (parser->lists[top]) {
+        cell_set_cdr(us, parser->lasts[top], c);
+    } else {
+        parser->lists[top] = c;
+    }
+    parser->lasts[top] = c;
 
     return 0;
 }
+
+// Add a complete top-level form, to be taken later
+static void add_form(Parser* parser, Cell* cell)
+{
+    if (parser->form_used >= parser->form_size) {
+        Cell** forms = 0;
+        MEM_ALLOC_TYPE(forms, parser->form_size * 2, Cell*);
+        memcpy(forms, parser->forms, parser->form_used * sizeof(Cell*));
+        MEM_FREE_TYPE(parser->forms, parser->form_size, Cell*);
+        parser->forms = forms;
+        parser->form_size *= 2;
+    }
+    parser->forms[parser->form_used++] = cell;
+}
+
+// Add some chars to the text kept for a token cut by the end of a chunk
+static void add_text(Parser* parser, const char* str, int len)
+{
+    if (parser->text_used + len > parser->text_size) {
+        int size = parser->text_size;
+        while (parser->text_used + len > size) {
+            size *= 2;
+        }
+        char* text = 0;
+        MEM_ALLOC_SIZE(text, size);
+        memcpy(text, parser->text, parser->text_used);
+        MEM_FREE_SIZE(parser->text, parser->text_size);
+        parser->text = text;
+        parser->text_size = size;
+    }
+    memcpy(parser->text + parser->text_used, str, len);
+    parser->text_used += len;
+}
+
+// Make sure there is room for one more open list
+static void reserve_lists(Parser* parser)
+{
+    if (parser->level < parser->depth) {
+        return;
+    }
+    Cell** lists = 0;
+    Cell** lasts = 0;
+    MEM_ALLOC_TYPE(lists, parser->depth * 2, Cell*);
+    MEM_ALLOC_TYPE(lasts, parser->depth * 2, Cell*);
+    memcpy(lists, parser->lists, parser->level * sizeof(Cell*));
+    memcpy(lasts, parser->lasts, parser->level * sizeof(Cell*));
+    MEM_FREE_TYPE(parser->lists, parser->depth, Cell*);
+    MEM_FREE_TYPE(parser->lasts, parser->depth, Cell*);
+    parser->lists = lists;
+    parser->lasts = lasts;
+    parser->depth *= 2;
+}
@@ -1,10 +1,13 @@
 #ifndef PARSER_H_
 #define PARSER_H_
 
-// Hand-coded parser for a lisp-like language
+// Hand-coded parser for a lisp-like language.  It is incremental: input can be
+// fed to it in chunks of any size, cut anywhere, even in the middle of a token,
+// and it hands out each top-level form as soon as it is complete.
 
 // Define our structures
 struct US;
+struct GC;
 struct Cell;
 
 typedef struct Expression {
@@ -12,22 +15,59 @@ typedef struct Expression {
     struct Cell* last;
 } Expression;
 
+// All the cells in the parser (the lists still open and the forms not taken
+// yet) are roots for the GC, from when it is created until it is destroyed;
+// so the GC may run between two chunks, or while parsing one.
 typedef struct Parser {
-    Expression* exp;
-    int depth;
-    int level;
+    struct Cell** lists;    // first cons of each list still open
+    struct Cell** lasts;    // last cons of each list still open
+    int depth;              // how many lists can be open before growing
+    int level;              // how many lists are open
+
+    struct Cell** forms;    // complete top-level forms
+    int form_size;          // room for this many forms before growing
+    int form_used;          // how many forms there are, taken or not
+    int form_next;          // next form to be taken
+
+    char* text;             // start of a token cut by the end of a chunk
+    int text_size;          // room for this many chars before growing
+    int text_used;          // how many chars there are
 
     int state;
-    const char* str;
+    const char* str;        // chunk being parsed
+    char* place;            // same chunk, if strings can be kept in it
     int pos;
     int beg;
 } Parser;
 
-Parser* parser_create(int depth);
-void parser_destroy(Parser* parser);
+Parser* parser_create(struct GC* gc, int depth);
+void parser_destroy(Parser* parser, struct GC* gc);
+
+// Forget all input so far, including any forms not taken yet
+void parser_reset(Parser* parser);
+
+// Parse a chunk of len bytes of input, or up to a null if len is negative;
+// return how many complete forms are ready to be taken
+int parser_feed(struct US* us, Parser* parser, const char* str, int len);
 
+// Just like parser_feed, but the chunk may be written to, and strings in it may
+// be kept right there (see cell_create_string_in_place), with their closing
+// quote replaced by a null
+int parser_feed_in_place(struct US* us, Parser* parser, char* str, int len);
+
+// Tell the parser there is no more input, so that a token at the very end is
+// complete too; any lists still open are dropped; return how many complete
+// forms are ready to be taken
+int parser_finish(struct US* us, Parser* parser);
+
+// Take the next complete form, in order, or 0 if there are none ready; the
+// form is no longer safe from the GC once taken
+struct Cell* parser_next(Parser* parser);
+
+// Parse a whole null-terminated string at once, forgetting any earlier input
 void parser_parse(struct US* us, Parser* parser, const char* str);
-void parser_reset(Parser* parser, const char* str);
+
+// Get the last complete form not taken yet, or 0 if there are none
 struct Cell* parser_result(Parser* parser);
 
 #endif
@@ -0,0 +1,172 @@
+#include "us.h"
+#include "cell.h"
+#include "env.h"
+#include "gc.h"
+#include "intern.h"
+#include "parser.h"
+#include "resolve.h"
+
+// #define LOG_LEVEL LOG_LEVEL_DEBUG
+#include "log.h"
+#if defined(LOG_LEVEL) && LOG_LEVEL <= LOG_LEVEL_DEBUG
+static char dumper[10*1024];
+#endif
+
+// The names that can be seen while resolving the body of a lambda; scopes are
+// chained just like the frames will be when the lambda is called
+typedef struct Scope {
+    Cell* names;            // list of names, one per slot
+    struct Scope* parent;   // scope for the enclosing lambda, if any
+} Scope;
+
+static Cell* resolve(US* us, Cell* cell, Scope* scope);
+static Cell* resolve_symbol(US* us, Cell* cell, Scope* scope);
+static Cell* resolve_lambda(US* us, Cell* cell, Scope* scope);
+static Cell* resolve_list(US* us, Cell* cell, int keep, Scope* scope);
+static int add_defines(US* us, Expression* names, Cell* cell);
+static int has_name(Cell* names, Cell* name);
+
+Cell* cell_resolve(US* us, Cell* cell)
+{
+    Cell* ret = resolve(us, cell, 0);
+    LOG(DEBUG, ("RESOLVE: %s", cell_dump(ret, 1, dumper)));
+    return ret;
+}
+
+static Cell* resolve(US* us, Cell* cell, Scope* scope)
+{
+    if (CELL_TAG(cell) == CELL_SYMBOL) {
+        // a symbol => find out where it lives
+        return resolve_symbol(us, cell, scope);
+    }
+
+    if (CELL_TAG(cell) != CELL_CONS) {
+        // anything not a cons => self-evaluating
+        return cell;
+    }
+
+    Cell* car = cell->cons.car;
+    if (car == sym_quote) {
+        // quoted data is never evaluated
+        return cell;
+    }
+    if (car == sym_lambda) {
+        return resolve_lambda(us, cell, scope);
+    }
+
+    // keep the symbol for other special forms, resolve everything else; for
+    // define and set! this resolves the variable being set, too
+    int keep = car == sym_define || car == sym_set || car == sym_if;
+    return resolve_list(us, cell, keep, scope);
+}
+
+static Cell* resolve_symbol(US* us, Cell* cell, Scope* scope)
+{
+    int depth = 0;
+    for (Scope* s = scope; s; s = s->parent, ++depth) {
+        int slot = 0;
+        for (Cell* n = s->names; CELL_TAG(n) == CELL_CONS; n = n->cons.cdr, ++slot) {
+            if (n->cons.car == cell) {
+                LOG(DEBUG, ("RESOLVE: [%s] is local %d:%d", cell->sval, depth, slot));
+                return cell_create_local(us, cell, depth, slot);
+            }
+        }
+    }
+
+    Symbol* sym = env_lookup(us->env, cell, 1);
+    LOG(DEBUG, ("RESOLVE: [%s] is global %p", cell->sval, sym));
+    return cell_create_global(us, sym);
+}
+
+static Cell* resolve_lambda(US* us, Cell* cell, Scope* scope)
+{
+    Cell* rest = cell->cons.cdr;
+    if (CELL_TAG(rest) != CELL_CONS || CELL_TAG(rest->cons.cdr) != CELL_CONS) {
+        LOG(ERROR, ("RESOLVE: lambda without params and body"));
+        return nil;
+    }
+    Cell* params = rest->cons.car;
+    Cell* body = rest->cons.cdr->cons.car;
+
+    // names for the frame: first all params, then all local defines
+    Expression names;
+    LIST_RESET(names);
+    gc_push_cell(us->gc, &names.frst);
+    int arity = 0;
+    for (Cell* p = params; CELL_TAG(p) == CELL_CONS; p = p->cons.cdr) {
+        if (CELL_TAG(p->cons.car) != CELL_SYMBOL) {
+            LOG(ERROR, ("RESOLVE: lambda param #%d is not a symbol", arity));
+            break;
+        }
+        Cell* cons = cell_cons(us, p->cons.car, nil);
+        LIST_APPEND(us, &names, cons);
+        ++arity;
+    }
+    int size = arity + add_defines(us, &names, body);
+
+    Scope inner = { names.frst ? names.frst : nil, scope };
+    body = resolve(us, body, &inner);
+    Cell* ret = cell_create_lambda(us, inner.names, body, arity, size);
+    gc_pop(us->gc, 1);
+    LOG(DEBUG, ("RESOLVE: lambda with %d params, %d slots", arity, size));
+    return ret;
+}
+
+// Resolve each element in a list, optionally keeping the first one as is
+static Cell* resolve_list(US* us, Cell* cell, int keep, Scope* scope)
+{
+    Expression exp;
+    LIST_RESET(exp);
+    gc_push_cell(us->gc, &exp.frst);
+    for (Cell* c = cell; CELL_TAG(c) == CELL_CONS; c = c->cons.cdr) {
+        Cell* r = c->cons.car;
+        if (keep) {
+            keep = 0;
+        } else {
+            r = resolve(us, r, scope);
+        }
+        Cell* cons = cell_cons(us, r, nil);
+        LIST_APPEND(us, &exp, cons);
+    }
+    gc_pop(us->gc, 1);
+    return exp.frst ? exp.frst : nil;
+}
+
+// Add to names every variable defined in an expression (but not in nested
+// lambdas) that is not already there; return how many were added
+static int add_defines(US* us, Expression* names, Cell* cell)
+{
+    if (CELL_TAG(cell) != CELL_CONS) {
+        return 0;
+    }
+
+    int count = 0;
+    Cell* car = cell->cons.car;
+    if (car == sym_quote || car == sym_lambda) {
+        return 0;
+    }
+    if (car == sym_define) {
+        Cell* rest = cell->cons.cdr;
+        if (CELL_TAG(rest) == CELL_CONS &&
+            CELL_TAG(rest->cons.car) == CELL_SYMBOL &&
+            !has_name(names->frst, rest->cons.car)) {
+            Cell* cons = cell_cons(us, rest->cons.car, nil);
+            LIST_APPEND(us, names, cons);
+            ++count;
+        }
+    }
+    for (Cell* c = cell; CELL_TAG(c) == CELL_CONS; c = c->cons.cdr) {
+        count += add_defines(us, names, c->cons.car);
+    }
+    return count;
+}
+
+static int has_name(Cell* names, Cell* name)
+{
+    for (Cell* n = names; n && CELL_TAG(n) == CELL_CONS; n = n->cons.cdr) {
+        if (n->cons.car == name) {
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,26 @@
+#ifndef RESOLVE_H_
+#define RESOLVE_H_
+
+// Resolving is a pre-pass over a parsed expression, done once before it is
+// evaluated, that finds out where each variable will live, so that evaluating
+// the expression never has to look up a name:
+//
+// * Each lambda expression becomes a resolved lambda, which knows its names:
+//   first its params, then every name defined anywhere in its body (except in
+//   nested lambdas); a call to it then gets a frame with one slot per name.
+// * A variable that is one of the names of an enclosing lambda becomes a
+//   reference to a local variable: how many frames up, and which slot.
+// * Any other variable becomes a reference straight to its Symbol in the
+//   global environment, which is created (still unbound) if necessary.
+//
+// Quoted data is left alone, and the original expression is never changed.
+
+// Define our structures
+struct US;
+struct Cell;
+
+// Resolve an expression, to be evaluated in the global environment; the
+// expression must be reachable by the GC while this runs
+struct Cell* cell_resolve(struct US* us, struct Cell* cell);
+
+#endif
@@ -0,0 +1,218 @@
+#include "scan.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define SCAN_X86 1
+#include <immintrin.h>
+#else
+#define SCAN_X86 0
+#endif
+
+typedef int (ScanFunc)(const char* str, int pos, int len);
+
+static int scalar_string(const char* str, int pos, int len);
+static int scalar_symbol(const char* str, int pos, int len);
+#if SCAN_X86
+static int sse2_string(const char* str, int pos, int len);
+static int sse2_symbol(const char* str, int pos, int len);
+static int avx2_string(const char* str, int pos, int len);
+static int avx2_symbol(const char* str, int pos, int len);
+#endif
+static int scan_best(void);
+static int pick_string(const char* str, int pos, int len);
+static int pick_symbol(const char* str, int pos, int len);
+
+static const struct {
+    const char* name;
+    ScanFunc* string;
+    ScanFunc* symbol;
+} scanners[SCAN_LAST] = {
+    [SCAN_SCALAR] = { "scalar", scalar_string, scalar_symbol },
+#if SCAN_X86
+    [SCAN_SSE2  ] = { "sse2"  , sse2_string  , sse2_symbol   },
+    [SCAN_AVX2  ] = { "avx2"  , avx2_string  , avx2_symbol   },
+#else
+    [SCAN_SSE2  ] = { "sse2"  , scalar_string, scalar_symbol },
+    [SCAN_AVX2  ] = { "avx2"  , scalar_string, scalar_symbol },
+#endif
+};
+
+// Chars that end a symbol; they must match the char classes in the parser
+static const unsigned char symbol_end[256] = {
+    [' ' ] = 1,
+    ['\t'] = 1,
+    ['\n'] = 1,
+    ['\v'] = 1,
+    ['\f'] = 1,
+    ['\r'] = 1,
+    ['"' ] = 1,
+    ['(' ] = 1,
+    [')' ] = 1,
+};
+
+// Until first used, these pick the fastest way the CPU can do
+static int scan_kind = -1;
+static ScanFunc* scan_string_func = pick_string;
+static ScanFunc* scan_symbol_func = pick_symbol;
+
+int scan_string(const char* str, int pos, int len)
+{
+    return scan_string_func(str, pos, len);
+}
+
+int scan_symbol(const char* str, int pos, int len)
+{
+    return scan_symbol_func(str, pos, len);
+}
+
+int scan_use(int kind)
+{
+    int best = scan_best();
+    if (kind < 0 || kind > best) {
+        kind = best;
+    }
+    scan_kind = kind;
+    scan_string_func = scanners[kind].string;
+    scan_symbol_func = scanners[kind].symbol;
+    return kind;
+}
+
+int scan_current(void)
+{
+    if (scan_kind < 0) {
+        scan_use(SCAN_LAST);
+    }
+    return scan_kind;
+}
+
+const char* scan_name(int kind)
+{
+    if (kind < 0 || kind >= SCAN_LAST) {
+        return "unknown";
+    }
+    return scanners[kind].name;
+}
+
+static int pick_string(const char* str, int pos, int len)
+{
+    scan_use(SCAN_LAST);
+    return scan_string_func(str, pos, len);
+}
+
+static int pick_symbol(const char* str, int pos, int len)
+{
+    scan_use(SCAN_LAST);
+    return scan_symbol_func(str, pos, len);
+}
+
+static int scan_best(void)
+{
+#if SCAN_X86
+    // SSE2 is part of x86-64 itself
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2") ? SCAN_AVX2 : SCAN_SSE2;
+#else
+    return SCAN_SCALAR;
+#endif
+}
+
+static int scalar_string(const char* str, int pos, int len)
+{
+    for (; pos < len; ++pos) {
+        if (str[pos] == '"') {
+            break;
+        }
+    }
+    return pos;
+}
+
+static int scalar_symbol(const char* str, int pos, int len)
+{
+    for (; pos < len; ++pos) {
+        if (symbol_end[(unsigned char) str[pos]]) {
+            break;
+        }
+    }
+    return pos;
+}
+
+#if SCAN_X86
+
+// Whitespace is '\t' to '\r' (9 to 13) or ' '; the first range is found by
+// subtracting 9 and then checking for at most 4, unsigned
+static int sse2_string(const char* str, int pos, int len)
+{
+    const __m128i quote = _mm_set1_epi8('"');
+    for (; pos + 16 <= len; pos += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*) (str + pos));
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, quote));
+        if (mask) {
+            return pos + __builtin_ctz(mask);
+        }
+    }
+    return scalar_string(str, pos, len);
+}
+
+static int sse2_symbol(const char* str, int pos, int len)
+{
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i lparen = _mm_set1_epi8('(');
+    const __m128i rparen = _mm_set1_epi8(')');
+    const __m128i space = _mm_set1_epi8(' ');
+    const __m128i tab = _mm_set1_epi8('\t');
+    const __m128i four = _mm_set1_epi8(4);
+    for (; pos + 16 <= len; pos += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*) (str + pos));
+        __m128i w = _mm_sub_epi8(v, tab);
+        __m128i end = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, quote),
+                                                _mm_cmpeq_epi8(v, space)),
+                                   _mm_or_si128(_mm_cmpeq_epi8(v, lparen),
+                                                _mm_cmpeq_epi8(v, rparen)));
+        end = _mm_or_si128(end, _mm_cmpeq_epi8(_mm_min_epu8(w, four), w));
+        int mask = _mm_movemask_epi8(end);
+        if (mask) {
+            return pos + __builtin_ctz(mask);
+        }
+    }
+    return scalar_symbol(str, pos, len);
+}
+
+__attribute__((target("avx2")))
+static int avx2_string(const char* str, int pos, int len)
+{
+    const __m256i quote = _mm256_set1_epi8('"');
+    for (; pos + 32 <= len; pos += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*) (str + pos));
+        unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, quote));
+        if (mask) {
+            return pos + __builtin_ctz(mask);
+        }
+    }
+    return sse2_string(str, pos, len);
+}
+
+__attribute__((target("avx2")))
+static int avx2_symbol(const char* str, int pos, int len)
+{
+    const __m256i quote = _mm256_set1_epi8('"');
+    const __m256i lparen = _mm256_set1_epi8('(');
+    const __m256i rparen = _mm256_set1_epi8(')');
+    const __m256i space = _mm256_set1_epi8(' ');
+    const __m256i tab = _mm256_set1_epi8('\t');
+    const __m256i four = _mm256_set1_epi8(4);
+    for (; pos + 32 <= len; pos += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*) (str + pos));
+        __m256i w = _mm256_sub_epi8(v, tab);
+        __m256i end = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, quote),
+                                                      _mm256_cmpeq_epi8(v, space)),
+                                      _mm256_or_si256(_mm256_cmpeq_epi8(v, lparen),
+                                                      _mm256_cmpeq_epi8(v, rparen)));
+        end = _mm256_or_si256(end, _mm256_cmpeq_epi8(_mm256_min_epu8(w, four), w));
+        unsigned mask = _mm256_movemask_epi8(end);
+        if (mask) {
+            return pos + __builtin_ctz(mask);
+        }
+    }
+    return sse2_symbol(str, pos, len);
+}
+
+#endif
@@ -0,0 +1,33 @@
+#ifndef SCAN_H_
+#define SCAN_H_
+
+// Fast scanning over the chars inside a string or a symbol, for the parser.
+// On x86-64 this looks at 16 (SSE2) or 32 (AVX2) chars at a time, using the
+// best the CPU has, picked the first time it is needed; anywhere else, and for
+// the last few chars, it goes one char at a time.
+
+// Possible ways of scanning, from slowest to fastest
+#define SCAN_SCALAR 0
+#define SCAN_SSE2   1
+#define SCAN_AVX2   2
+#define SCAN_LAST   3
+
+// Return the position of the first quote in str, from pos up to len, or len if
+// there are none
+int scan_string(const char* str, int pos, int len);
+
+// Return the position of the first char that ends a symbol in str (a quote, a
+// paren or whitespace), from pos up to len, or len if there are none
+int scan_symbol(const char* str, int pos, int len);
+
+// Scan in a given way, or the fastest one the CPU can do, if it cannot do that
+// one; return the way picked
+int scan_use(int kind);
+
+// Get the way of scanning in use, picking the best one if none was yet
+int scan_current(void);
+
+// Get the name of a way of scanning
+const char* scan_name(int kind);
+
+#endif
@@ -0,0 +1,9 @@
+#include <time.h>
+#include "timer.h"
+
+long timer_now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long) ts.tv_sec * 1000000L + ts.tv_nsec / 1000L;
+}
@@ -0,0 +1,9 @@
+#ifndef TIMER_H_
+#define TIMER_H_
+
+// Simple monotonic clock, used for GC pauses and benchmarks
+
+// Return the current time in microseconds, from an arbitrary starting point
+long timer_now_us(void);
+
+#endif
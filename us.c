@@ -1,9 +1,15 @@
+#include <stdio.h>
 #include "arena.h"
 #include "cell.h"
 #include "env.h"
+#include "intern.h"
 #include "parser.h"
 #include "native.h"
+#include "resolve.h"
+#include "compile.h"
+#include "vm.h"
 #include "eval.h"
+#include "gc.h"
 #include "us.h"
 
 #if !defined(MEM_DEBUG)
@@ -14,17 +20,32 @@
 // #define LOG_LEVEL LOG_LEVEL_DEBUG
 #include "log.h"
 
+// Read script files in chunks of this many bytes
+#define US_READ_CHUNK (64*1024)
+
+// Parse mapped script files in slices of this many bytes
+#define US_LOAD_SLICE (1024*1024)
+
 static Env* make_global_env(US* us);
-static void mark_cell(US* us, const Cell* cell);
-static void mark_env(US* us, Env* env);
+static Cell* eval(US* us, Cell* cell);
+static void eval_ready(US* us, Cell** last);
+static int collect(void* data);
 
 US* us_create(void) {
     US* us = 0;
     MEM_ALLOC_TYPE(us, 1, US);
     LOG(INFO, ("US: created at %p", us));
     us->arena = arena_create();
-    us->parser = parser_create(0);
+    us->gc = gc_create();
+    us->intern = intern_create();
+    us->parser = parser_create(us->gc, 0);
+    us->vm = vm_create(us->gc);
     us->env = make_global_env(us);
+
+    // only now can the arena collect garbage on its own
+    us->arena->collect = collect;
+    us->arena->collect_data = us;
+    us->arena->nursery = GC_DEFAULT_NURSERY;
     return us;
 }
 
@@ -32,130 +53,221 @@ void us_destroy(US* us)
 {
     LOG(INFO, ("US: destroying %p", us));
     // env_destroy(us->env);
-    parser_destroy(us->parser);
+    // both have roots in the GC, so undo them in reverse order
+    vm_destroy(us->vm, us->gc);
+    parser_destroy(us->parser, us->gc);
     arena_destroy(us->arena);
+    intern_destroy(us->intern);
+    gc_destroy(us->gc);
     MEM_FREE_TYPE(us, 1, US);
 }
 
-static void mark_cell(US* us, const Cell* cell)
+int us_gc(US* us, GCStats* stats)
 {
-    if (!cell) {
-        return;
-    }
-    if (arena_is_cell_used(us->arena, cell)) {
-        LOG(DEBUG, ("=== MARKING cell already marked"));
-        return;
-    }
-    LOG(DEBUG, ("=== MARKING cell"));
-    arena_mark_cell_used(us->arena, cell);
-    switch (cell->tag) {
-        case CELL_CONS:
-            LOG(DEBUG, ("=== MARKING cell cons"));
-            mark_cell(us, cell->cons.car);
-            mark_cell(us, cell->cons.cdr);
-            break;
-        case CELL_PROC:
-            LOG(DEBUG, ("=== MARKING cell proc"));
-            mark_cell(us, cell->pval.params);
-            mark_cell(us, cell->pval.body);
-            mark_env(us, cell->pval.env);
-            break;
-    }
+    return gc_collect(us, stats);
 }
 
-static void mark_env(US* us, Env* env)
+void us_set_gc_policy(US* us, double growth, int min_pools)
 {
-    if (!env) {
-        return;
-    }
-    if (arena_is_env_used(us->arena, env)) {
-        LOG(DEBUG, ("=== MARKING env already marked"));
-        return;
-    }
-    LOG(DEBUG, ("=== MARKING env"));
-    arena_mark_env_used(us->arena, env);
-    for (int j = 0; j < env->size; ++j) {
-        for (Symbol* sym = env->table[j]; sym; sym = sym->next) {
-            mark_cell(us, sym->value);
-        }
-    }
-    mark_env(us, env->parent);
+    gc_set_policy(us->gc, growth, min_pools);
 }
 
-int us_gc(US* us)
+void us_set_gc_nursery(US* us, long size)
 {
-    int count = 0;
-    arena_reset_to_empty(us->arena);
-    for (Env* env = us->env; env; env = env->parent) {
-        mark_env(us, env);
+    us->arena->nursery = size < 0 ? 0 : size;
+}
+
+void us_set_gc_incremental(US* us, int slice)
+{
+    gc_set_incremental(us, slice);
+}
+
+void us_set_vm(US* us, int enabled)
+{
+    us->use_vm = enabled;
+}
+
+int us_gc_pauses(US* us, long* counts, int size)
+{
+    int n = size < GC_PAUSE_BUCKETS ? size : GC_PAUSE_BUCKETS;
+    for (int j = 0; j < n; ++j) {
+        counts[j] = us->gc->pauses[j];
     }
-    return count;
+    return GC_PAUSE_BUCKETS;
 }
 
 Cell* us_eval_str(US* us, const char* code)
 {
-    parser_parse(us, us->parser, code);
-    Cell* c = parser_result(us->parser);
-    LOG(DEBUG, ("=== parsed ==="));
-    if (!c) {
+    Cell* r = us_eval_buffer(us, code, -1);
+    if (!r) {
         LOG(WARNING, ("Could not eval code [%s]", code));
+    }
+    return r;
+}
+
+Cell* us_eval_buffer(US* us, const char* code, int len)
+{
+    // the last value must survive parsing and evaluating everything after it
+    Cell* last = 0;
+    gc_push_cell(us->gc, &last);
+    parser_reset(us->parser);
+    parser_feed(us, us->parser, code, len);
+    parser_finish(us, us->parser);
+    eval_ready(us, &last);
+    gc_pop(us->gc, 1);
+    LOG(DEBUG, ("=== evaled buffer ==="));
+    return last;
+}
+
+// Forms are evaluated as soon as they are parsed, so the whole file is never
+// in memory at once.
+Cell* us_eval_file(US* us, const char* path)
+{
+    FILE* fp = fopen(path, "r");
+    if (!fp) {
+        LOG(WARNING, ("Could not open file [%s]", path));
         return 0;
     }
+    char* buf = 0;
+    MEM_ALLOC_SIZE(buf, US_READ_CHUNK);
 
-    Cell* r = cell_eval(us, c, us->env);
-    LOG(DEBUG, ("=== evaled ==="));
+    Cell* last = 0;
+    gc_push_cell(us->gc, &last);
+    parser_reset(us->parser);
+    while (1) {
+        int len = fread(buf, 1, US_READ_CHUNK, fp);
+        if (len <= 0) {
+            break;
+        }
+        parser_feed(us, us->parser, buf, len);
+        eval_ready(us, &last);
+    }
+    parser_finish(us, us->parser);
+    eval_ready(us, &last);
+    gc_pop(us->gc, 1);
 
-    return r;
+    MEM_FREE_SIZE(buf, US_READ_CHUNK);
+    fclose(fp);
+    LOG(DEBUG, ("=== evaled file [%s] ===", path));
+    return last;
 }
 
+// The file is parsed right from its mapping, and evaluated a slice at a time,
+// so that the parser never holds too many forms; only strings cut by the end of
+// a slice are copied.
+Cell* us_load_file(US* us, const char* path)
+{
+    ArenaImage* image = arena_map_image(us->arena, path);
+    if (!image) {
+        LOG(WARNING, ("Could not load file [%s]", path));
+        return 0;
+    }
+
+    Cell* last = 0;
+    gc_push_cell(us->gc, &last);
+    parser_reset(us->parser);
+    for (long pos = 0; pos < image->size; pos += US_LOAD_SLICE) {
+        long len = image->size - pos;
+        if (len > US_LOAD_SLICE) {
+            len = US_LOAD_SLICE;
+        }
+        parser_feed_in_place(us, us->parser, image->base + pos, len);
+        eval_ready(us, &last);
+    }
+    parser_finish(us, us->parser);
+    eval_ready(us, &last);
+    gc_pop(us->gc, 1);
+
+    arena_release_image(us->arena, image);
+    LOG(DEBUG, ("=== loaded file [%s] ===", path));
+    return last;
+}
+
+// Input is fed to the parser as it comes, so a form can span many lines, and a
+// line can be longer than the buffer; each form is evaluated once complete.
 void us_repl(US* us)
 {
+    parser_reset(us->parser);
     while (1) {
         char buf[1024];
-        fputs("> ", stdout);
-        //buf[0] = '\0';
-        if (!fgets(buf, 1024, stdin)) {
-            break;
+        int more = 1;
+        if (!us->parser->level) {
+            fputs("> ", stdout);
         }
-        parser_parse(us, us->parser, buf);
-        Cell* c = parser_result(us->parser);
-        if (!c) {
-            continue;
+        if (!fgets(buf, 1024, stdin)) {
+            parser_finish(us, us->parser);
+            more = 0;
+        } else {
+            parser_feed(us, us->parser, buf, -1);
         }
 
-        const Cell* r = cell_eval(us, c, us->env);
-        cell_print(r, stdout, 1);
+        for (Cell* c = parser_next(us->parser); c; c = parser_next(us->parser)) {
+            const Cell* r = eval(us, c);
+            cell_print(r, stdout, 1);
+        }
+        if (!more) {
+            break;
+        }
     }
 }
 
+// Evaluate a parsed expression at the top level, in the VM if possible
+static Cell* eval(US* us, Cell* cell)
+{
+    gc_push_cell(us->gc, &cell);
+    cell = cell_resolve(us, cell);
+    Cell* code = us->use_vm ? cell_compile(us, cell) : 0;
+    Cell* r = code ? vm_run(us, code) : cell_eval(us, cell, us->env);
+    gc_pop(us->gc, 1);
+    return r;
+}
+
+// Called by the arena when it runs out of free slots, or its nursery is full
+static int collect(void* data)
+{
+    return gc_maybe_collect((US*) data);
+}
+
 static Env* make_global_env(US* us)
 {
     struct {
         const char* name;
-        NativeFunc* func;
+        NativeVecFunc* func;
     } data[] = {
-        { "+"       , func_add   },
-        { "-"       , func_sub   },
-        { "*"       , func_mul   },
-        { "/"       , func_div   },
-        { "="       , func_eq    },
-        { ">"       , func_gt    },
-        { "<"       , func_lt    },
-        { "cons"    , func_cons  },
-        { "car"     , func_car   },
-        { "cdr"     , func_cdr   },
-        { "begin"   , func_begin },
+        { "+"             , func_add           },
+        { "-"             , func_sub           },
+        { "*"             , func_mul           },
+        { "/"             , func_div           },
+        { "="             , func_eq            },
+        { ">"             , func_gt            },
+        { "<"             , func_lt            },
+        { "cons"          , func_cons          },
+        { "car"           , func_car           },
+        { "cdr"           , func_cdr           },
+        { "string-length" , func_string_length },
+        { "begin"         , func_begin         },
     };
     Env* env = arena_get_env(us->arena, 0);
     int n = sizeof(data) / sizeof(data[0]);
     LOG(INFO, ("US: registering all %d native handlers, us %p, arena %p", n, us, us->arena));
     for (int j = 0; j < n; ++j) {
-        const char* name = data[j].name;
-        Symbol* sym = env_lookup(env, name, 1);
-        sym->value = cell_create_native(us, name, data[j].func);
+        Cell* symbol = intern_symbol(us->intern, data[j].name, 0);
+        const char* name = symbol->sval;
+        Symbol* sym = env_lookup(env, symbol, 1);
+        sym->value = cell_create_native_vec(us, name, data[j].func);
+        gc_write_env(us, env, sym->value);
         LOG(INFO, ("US: registered native handler for [%s]", name));
     }
     LOG(INFO, ("US: registered all %d native handlers, us %p, arena %p", n, us, us->arena));
     arena_dump(us->arena, stderr);
     return env;
 }
+
+// Evaluate all the forms the parser has ready, in order, keeping the value of
+// the last one
+static void eval_ready(US* us, Cell** last)
+{
+    for (Cell* c = parser_next(us->parser); c; c = parser_next(us->parser)) {
+        *last = eval(us, c);
+    }
+}
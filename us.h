@@ -6,21 +6,64 @@
 
 // Define our structures
 struct Arena;
+struct GC;
+struct Intern;
 struct Env;
 struct Parser;
+struct GCStats;
+struct VM;
 
 typedef struct US {
     struct Arena* arena;
+    struct GC* gc;
+    struct Intern* intern;
     struct Env* env;
     struct Parser* parser;
+    struct VM* vm;
+    int use_vm;         // non-zero to compile code and run it in the VM
 } US;
 
 void us_destroy(US* us);
 US* us_create(void);
 
-int us_gc(US* us);
+// Collect all garbage; return how many cells were freed and, if stats is not
+// null, fill it in with the details
+int us_gc(US* us, struct GCStats* stats);
 
+// Collect garbage on our own when the arena runs out of free slots, but only
+// once it has at least min_pools pools, and growth times as many pools as
+// were in use after the previous collection
+void us_set_gc_policy(US* us, double growth, int min_pools);
+
+// Run a minor collection, only for young cells/envs, every time size of them
+// have been allocated; 0 means only ever run major collections
+void us_set_gc_nursery(US* us, long size);
+
+// Make major collections on our own incremental, marking slice cells/envs on
+// every allocation instead of all at once; 0 means stop the world instead
+void us_set_gc_incremental(US* us, int slice);
+
+// Copy up to size counters from the histogram of GC pauses into counts: the
+// first one counts pauses below 1 us, and counts[j] pauses of at least
+// 2^(j-1) us and less than 2^j us; return how many counters there are
+int us_gc_pauses(US* us, long* counts, int size);
+
+// Compile code to bytecode and run it in the VM, instead of evaluating it by
+// walking the tree; code that cannot be compiled is still evaluated
+void us_set_vm(US* us, int enabled);
+
+// Evaluate all the forms in some code, one after another, and return the value
+// of the last one, or null if there were none; for a buffer, len is how many
+// bytes there are, or negative for a null-terminated one; a file is read and
+// evaluated in chunks
 struct Cell* us_eval_str(US* us, const char* code);
+struct Cell* us_eval_buffer(US* us, const char* code, int len);
+struct Cell* us_eval_file(US* us, const char* path);
+
+// Evaluate all the forms in a file, like us_eval_file, but map the file in
+// memory instead of reading it; long strings in it are not copied, and the
+// mapping stays around for as long as any of them is in use
+struct Cell* us_load_file(US* us, const char* path);
 
 void us_repl(US* us);
 
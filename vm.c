@@ -0,0 +1,361 @@
+#include <string.h>
+#include "us.h"
+#include "arena.h"
+#include "cell.h"
+#include "env.h"
+#include "gc.h"
+#include "analyze.h"
+#include "compile.h"
+#include "native.h"
+#include "vm.h"
+
+#if !defined(MEM_DEBUG)
+#define MEM_DEBUG 0
+#endif
+#include "mem.h"
+
+// #define LOG_LEVEL LOG_LEVEL_DEBUG
+#include "log.h"
+
+// Initial sizes for the stacks
+#define VM_DEFAULT_VALUES 256
+#define VM_DEFAULT_CALLS  64
+
+// Use computed gotos (a GNU extension) to dispatch ops, if we can
+#if !defined(VM_COMPUTED_GOTO)
+#if defined(__GNUC__)
+#define VM_COMPUTED_GOTO 1
+#else
+#define VM_COMPUTED_GOTO 0
+#endif
+#endif
+
+#if VM_COMPUTED_GOTO
+#define VM_CASE(op) do_##op
+#define VM_NEXT()   goto *labels[ops[pc++]]
+#else
+#define VM_CASE(op) case op
+#define VM_NEXT()   goto dispatch
+#endif
+
+// Get the next operand
+#define VM_OPERAND() (pc += 2, ops[pc - 2] | (ops[pc - 1] << 8))
+
+// Anything that allocates may collect garbage, and the GC must then see all
+// the values we have on the stack
+#define VM_SYNC()   do { vm->value_used = sp; } while (0)
+
+static void reserve_values(VM* vm, int count);
+static void reserve_calls(VM* vm, int count);
+
+VM* vm_create(GC* gc)
+{
+    VM* vm = 0;
+    MEM_ALLOC_TYPE(vm, 1, VM);
+    vm->value_size = VM_DEFAULT_VALUES;
+    MEM_ALLOC_TYPE(vm->values, vm->value_size, Cell*);
+    vm->call_size = VM_DEFAULT_CALLS;
+    MEM_ALLOC_TYPE(vm->codes, vm->call_size, Cell*);
+    MEM_ALLOC_TYPE(vm->envs, vm->call_size, Env*);
+    MEM_ALLOC_TYPE(vm->pcs, vm->call_size, int);
+    gc_push_cells(gc, &vm->values, &vm->value_used);
+    gc_push_cells(gc, &vm->codes, &vm->call_used);
+    gc_push_envs(gc, &vm->envs, &vm->call_used);
+    LOG(INFO, ("VM: created %p", vm));
+    return vm;
+}
+
+void vm_destroy(VM* vm, GC* gc)
+{
+    LOG(INFO, ("VM: destroying %p", vm));
+    gc_pop(gc, 3);
+    MEM_FREE_TYPE(vm->values, vm->value_size, Cell*);
+    MEM_FREE_TYPE(vm->codes, vm->call_size, Cell*);
+    MEM_FREE_TYPE(vm->envs, vm->call_size, Env*);
+    MEM_FREE_TYPE(vm->pcs, vm->call_size, int);
+    MEM_FREE_TYPE(vm, 1, VM);
+}
+
+Cell* vm_run(US* us, Cell* cell)
+{
+#if VM_COMPUTED_GOTO
+    // must be in the same order as the OP_* values
+    static void* labels[OP_LAST] = {
+        &&do_OP_CONST,
+        &&do_OP_LOCAL0,
+        &&do_OP_LOCAL,
+        &&do_OP_GLOBAL,
+        &&do_OP_SET_LOCAL,
+        &&do_OP_SET_GLOBAL,
+        &&do_OP_DEFINE_GLOBAL,
+        &&do_OP_JUMP,
+        &&do_OP_JUMP_UNLESS,
+        &&do_OP_CLOSURE,
+        &&do_OP_CALL,
+        &&do_OP_TAIL_CALL,
+        &&do_OP_RETURN,
+    };
+#endif
+    VM* vm = us->vm;
+    int base = vm->call_used;   // we are done when we return from this call
+    reserve_calls(vm, 1);
+    vm->codes[vm->call_used] = cell;
+    vm->envs[vm->call_used] = us->env;
+    ++vm->call_used;
+
+    Code* code = cell->code;
+    const unsigned char* ops = code->ops;
+    Cell** consts = code->consts;
+    Env* env = us->env;
+    int pc = 0;
+    reserve_values(vm, code->stack);
+    Cell** values = vm->values;
+    int sp = vm->value_used;
+    Cell* ret = 0;
+    int tail = 0;
+
+    VM_NEXT();
+#if !VM_COMPUTED_GOTO
+dispatch:
+    switch (ops[pc++]) {
+#endif
+    VM_CASE(OP_CONST): {
+        int k = VM_OPERAND();
+        values[sp++] = consts[k];
+        VM_NEXT();
+    }
+
+    VM_CASE(OP_LOCAL0): {
+        int slot = VM_OPERAND();
+        Cell* value = env->slots[slot];
+        values[sp++] = value ? value : nil;
+        VM_NEXT();
+    }
+
+    VM_CASE(OP_LOCAL): {
+        int depth = VM_OPERAND();
+        int slot = VM_OPERAND();
+        Env* frame = env;
+        for (; depth > 0; --depth) {
+            frame = frame->parent;
+        }
+        Cell* value = frame->slots[slot];
+        values[sp++] = value ? value : nil;
+        VM_NEXT();
+    }
+
+    VM_CASE(OP_GLOBAL): {
+        int k = VM_OPERAND();
+        Cell* value = consts[k]->gsym->value;
+        values[sp++] = value ? value : nil;
+        VM_NEXT();
+    }
+
+    VM_CASE(OP_SET_LOCAL): {
+        int depth = VM_OPERAND();
+        int slot = VM_OPERAND();
+        Env* frame = env;
+        for (; depth > 0; --depth) {
+            frame = frame->parent;
+        }
+        frame->slots[slot] = values[sp - 1];
+        gc_write_env(us, frame, values[sp - 1]);
+        VM_NEXT();
+    }
+
+    VM_CASE(OP_SET_GLOBAL): {
+        int k = VM_OPERAND();
+        Symbol* sym = consts[k]->gsym;
+        if (!sym->value) {
+            LOG(ERROR, ("VM: symbol [%s] not found", sym->name));
+            values[sp - 1] = nil;
+        } else {
+            sym->value = values[sp - 1];
+            gc_write_env(us, us->env, sym->value);
+        }
+        VM_NEXT();
+    }
+
+    VM_CASE(OP_DEFINE_GLOBAL): {
+        int k = VM_OPERAND();
+        Symbol* sym = consts[k]->gsym;
+        sym->value = values[sp - 1];
+        gc_write_env(us, us->env, sym->value);
+        VM_NEXT();
+    }
+
+    VM_CASE(OP_JUMP): {
+        pc = VM_OPERAND();
+        VM_NEXT();
+    }
+
+    VM_CASE(OP_JUMP_UNLESS): {
+        int to = VM_OPERAND();
+        if (values[--sp] != bool_t) {
+            pc = to;
+        }
+        VM_NEXT();
+    }
+
+    VM_CASE(OP_CLOSURE): {
+        int k = VM_OPERAND();
+        VM_SYNC();
+        Cell* proc = cell_create_procedure(us, consts[k]->code->lambda, env);
+        proc->pval.code = consts[k];
+        gc_write_cell(us, proc, consts[k]);
+        values[sp++] = proc;
+        VM_NEXT();
+    }
+
+    VM_CASE(OP_TAIL_CALL):
+        tail = 1;
+        goto call;
+
+    VM_CASE(OP_CALL):
+        tail = 0;
+    call: {
+        int argc = VM_OPERAND();
+        Cell* proc = values[sp - argc - 1];
+        VM_SYNC();
+        if (CELL_TAG(proc) == CELL_NATIVE) {
+            ret = native_apply(us, proc, argc, values + sp - argc);
+            sp -= argc + 1;
+            if (tail) {
+                goto done;
+            }
+            values[sp++] = ret;
+            VM_NEXT();
+        }
+        if (CELL_TAG(proc) != CELL_PROC) {
+            LOG(ERROR, ("VM: cannot call a non procedure"));
+            ret = nil;
+            sp -= argc + 1;
+            if (tail) {
+                goto done;
+            }
+            values[sp++] = ret;
+            VM_NEXT();
+        }
+        Cell* body = proc->pval.code;
+        if (!body) {
+            // a procedure created by cell_eval, compile it now, once
+            body = cell_compile_lambda(us, proc->pval.lambda);
+            proc->pval.code = body;
+            gc_write_cell(us, proc, body);
+        }
+
+        // create a new frame and bind all args in it, just like cell_eval
+        const Lambda* lambda = &proc->pval.lambda->lval;
+        Env* frame = arena_get_frame(us->arena, lambda->names, lambda->size);
+        int bound = argc < lambda->arity ? argc : lambda->arity;
+        for (int j = 0; j < bound; ++j) {
+            frame->slots[j] = values[sp - argc + j];
+            gc_write_env(us, frame, frame->slots[j]);
+        }
+        gc_chain_env(us, frame, proc->pval.env);
+        if (!body) {
+            // the body cannot be compiled, so run it in the interpreter; proc
+            // stays on the stack meanwhile, so the GC does not take it
+            ret = exec_run(us, proc, frame);
+            sp -= argc + 1;
+            if (tail) {
+                goto done;
+            }
+            values[sp++] = ret;
+            VM_NEXT();
+        }
+        sp -= argc + 1;
+
+        if (!tail) {
+            vm->pcs[vm->call_used - 1] = pc;
+            reserve_calls(vm, 1);
+            ++vm->call_used;
+        }
+        // a tail call just replaces the current call
+        vm->codes[vm->call_used - 1] = body;
+        vm->envs[vm->call_used - 1] = frame;
+        code = body->code;
+        ops = code->ops;
+        consts = code->consts;
+        env = frame;
+        pc = 0;
+        VM_SYNC();
+        reserve_values(vm, code->stack);
+        values = vm->values;
+        VM_NEXT();
+    }
+
+    VM_CASE(OP_RETURN): {
+        ret = values[--sp];
+        goto done;
+    }
+#if !VM_COMPUTED_GOTO
+    default:
+        LOG(ERROR, ("VM: unknown op %d", ops[pc - 1]));
+        ret = nil;
+        goto done;
+    }
+#endif
+
+done:
+    // ret is the value for the current call; go back to the caller, if any
+    --vm->call_used;
+    if (vm->call_used > base) {
+        int top = vm->call_used - 1;
+        code = vm->codes[top]->code;
+        ops = code->ops;
+        consts = code->consts;
+        env = vm->envs[top];
+        pc = vm->pcs[top];
+        values[sp++] = ret;
+        VM_NEXT();
+    }
+    VM_SYNC();
+    return ret;
+}
+
+// Make sure there is room for count more values
+static void reserve_values(VM* vm, int count)
+{
+    if (vm->value_used + count <= vm->value_size) {
+        return;
+    }
+    int size = vm->value_size;
+    while (vm->value_used + count > size) {
+        size *= 2;
+    }
+    Cell** values = 0;
+    MEM_ALLOC_TYPE(values, size, Cell*);
+    memcpy(values, vm->values, vm->value_used * sizeof(Cell*));
+    MEM_FREE_TYPE(vm->values, vm->value_size, Cell*);
+    vm->values = values;
+    vm->value_size = size;
+}
+
+// Make sure there is room for count more calls
+static void reserve_calls(VM* vm, int count)
+{
+    if (vm->call_used + count <= vm->call_size) {
+        return;
+    }
+    int size = vm->call_size;
+    while (vm->call_used + count > size) {
+        size *= 2;
+    }
+    Cell** codes = 0;
+    Env** envs = 0;
+    int* pcs = 0;
+    MEM_ALLOC_TYPE(codes, size, Cell*);
+    MEM_ALLOC_TYPE(envs, size, Env*);
+    MEM_ALLOC_TYPE(pcs, size, int);
+    memcpy(codes, vm->codes, vm->call_used * sizeof(Cell*));
+    memcpy(envs, vm->envs, vm->call_used * sizeof(Env*));
+    memcpy(pcs, vm->pcs, vm->call_used * sizeof(int));
+    MEM_FREE_TYPE(vm->codes, vm->call_size, Cell*);
+    MEM_FREE_TYPE(vm->envs, vm->call_size, Env*);
+    MEM_FREE_TYPE(vm->pcs, vm->call_size, int);
+    vm->codes = codes;
+    vm->envs = envs;
+    vm->pcs = pcs;
+    vm->call_size = size;
+}
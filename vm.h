@@ -0,0 +1,38 @@
+#ifndef VM_H_
+#define VM_H_
+
+// A stack based virtual machine that runs bytecode (see compile.h).
+//
+// Values being computed live in a stack of cells.  Each procedure call pushes
+// a record with its bytecode and its frame, which is an env from the arena,
+// just like with cell_eval, so closures work the same way; a call in tail
+// position replaces the current record instead, so tail calls run in constant
+// space.  Both stacks are registered as roots for the GC.  Ops are dispatched
+// with computed gotos if the compiler supports them, or with a switch.
+
+// Define our structures
+struct US;
+struct GC;
+struct Cell;
+struct Env;
+
+typedef struct VM {
+    struct Cell** values;   // stack of values
+    int value_used;         // number of values in use
+    int value_size;         // number of values allocated
+    struct Cell** codes;    // for each call, its code cell
+    struct Env** envs;      // for each call, its frame
+    int* pcs;               // for each call, where to go on after a call
+    int call_used;          // number of calls in use
+    int call_size;          // number of calls allocated
+} VM;
+
+// Create a VM, registering its stacks with the GC
+VM* vm_create(struct GC* gc);
+void vm_destroy(VM* vm, struct GC* gc);
+
+// Run compiled code (see cell_compile) at the top level, in the global env,
+// and return its value
+struct Cell* vm_run(struct US* us, struct Cell* code);
+
+#endif